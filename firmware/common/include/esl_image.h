@@ -0,0 +1,154 @@
+#ifndef ESL_IMAGE_H__
+#define ESL_IMAGE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <zephyr/sys/crc.h>
+
+/*
+ * Run-length coding of ESL_IMG_* frames
+ *
+ * A coded stream is a sequence of blocks, each starting with a control byte:
+ *
+ *   0x00-0x7F  literal, the next ctrl + 1 bytes are copied
+ *   0x80-0xFF  run, the next byte is repeated (ctrl & 0x7F) + 3 times
+ *
+ * Frames are mostly blank and the XOR of two frames is mostly zero, so runs
+ * dominate. The encoder only stops on a block boundary, which is what lets
+ * every chunk decode on its own. Mirrored by rle_encode() in
+ * image_creation/main.py.
+ */
+#define ESL_RLE_LITERAL_MAX 128
+#define ESL_RLE_RUN_MIN     3
+#define ESL_RLE_RUN_MAX     (0x7F + ESL_RLE_RUN_MIN)
+
+static inline uint8_t esl_rle_byte(const uint8_t *src, const uint8_t *base, size_t i)
+{
+    return base ? src[i] ^ base[i] : src[i];
+}
+
+static inline size_t esl_rle_run_len(const uint8_t *src, const uint8_t *base, size_t i,
+                                     size_t len)
+{
+    size_t n = 1;
+
+    while (i + n < len && n < ESL_RLE_RUN_MAX &&
+           esl_rle_byte(src, base, i + n) == esl_rle_byte(src, base, i)) {
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * @brief Code as much of a frame as fits in a buffer
+ *
+ * @param src Frame
+ * @param base Frame to code the XOR against, NULL to code @p src as is
+ * @param len Bytes of @p src (and @p base) left to code
+ * @param out Coded data
+ * @param out_len Size of @p out
+ * @param consumed Set to the number of frame bytes coded
+ * @return size_t Length of the coded data
+ */
+static inline size_t esl_rle_encode(const uint8_t *src, const uint8_t *base, size_t len,
+                                    uint8_t *out, size_t out_len, size_t *consumed)
+{
+    size_t in = 0;
+    size_t o = 0;
+
+    while (in < len && out_len - o >= 2) {
+        size_t run = esl_rle_run_len(src, base, in, len);
+        size_t max;
+        size_t n = 0;
+
+        if (run >= ESL_RLE_RUN_MIN) {
+            out[o++] = 0x80 | (run - ESL_RLE_RUN_MIN);
+            out[o++] = esl_rle_byte(src, base, in);
+            in += run;
+            continue;
+        }
+
+        /* Literal up to the next run worth coding */
+        max = MIN(ESL_RLE_LITERAL_MAX, out_len - o - 1);
+        while (n < max && in + n < len) {
+            run = esl_rle_run_len(src, base, in + n, len);
+            if (run >= ESL_RLE_RUN_MIN) {
+                break;
+            }
+            n += MIN(run, max - n);
+        }
+
+        out[o++] = n - 1;
+        for (size_t i = 0; i < n; i++) {
+            out[o++] = esl_rle_byte(src, base, in + i);
+        }
+        in += n;
+    }
+
+    *consumed = in;
+    return o;
+}
+
+/**
+ * @brief Decode a coded chunk straight into the frame
+ *
+ * Nothing is written if the data is malformed, so a bad chunk cannot corrupt a
+ * frame that a delta is being applied to.
+ *
+ * @param in Coded data
+ * @param in_len Length of @p in
+ * @param dst Frame at the chunk's offset, NULL to only check the data
+ * @param dst_len Bytes left in the frame from @p dst
+ * @param delta XOR into the frame instead of overwriting it
+ * @return int Number of frame bytes written, -EBADMSG if the data is malformed
+ *         or runs past the end of the frame
+ */
+static inline int esl_rle_decode(const uint8_t *in, size_t in_len, uint8_t *dst,
+                                 size_t dst_len, bool delta)
+{
+    size_t i = 0;
+    size_t o = 0;
+
+    if (dst) {
+        int err = esl_rle_decode(in, in_len, NULL, dst_len, delta);
+
+        if (err < 0) {
+            return err;
+        }
+    }
+
+    while (i < in_len) {
+        uint8_t ctrl = in[i++];
+        bool run = ctrl & 0x80;
+        size_t n = run ? (size_t)(ctrl & 0x7F) + ESL_RLE_RUN_MIN : (size_t)ctrl + 1;
+        size_t coded = run ? 1 : n;
+
+        if (coded > in_len - i || n > dst_len - o) {
+            return -EBADMSG;
+        }
+
+        for (size_t k = 0; dst && k < n; k++) {
+            uint8_t b = run ? in[i] : in[i + k];
+
+            dst[o + k] = delta ? dst[o + k] ^ b : b;
+        }
+
+        i += coded;
+        o += n;
+    }
+
+    return o;
+}
+
+/**
+ * @brief Checksum identifying a frame as the base of a delta
+ */
+static inline uint16_t esl_img_crc(const uint8_t *img, size_t len)
+{
+    return crc16_ccitt(0xFFFF, img, len);
+}
+
+#endif /* ESL_IMAGE_H__ */
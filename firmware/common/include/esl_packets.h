@@ -2,9 +2,29 @@
 #define ESL_PACKETS_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/bluetooth/gap.h>
 
 #define ESL_CMD_COORDINATE 0x01
 #define ESL_CMD_SENSOR 0x02
+#define ESL_CMD_TIMING 0x03
+#define ESL_CMD_IMG_START 0x04
+#define ESL_CMD_IMG_CHUNK 0x05
+#define ESL_CMD_RECT 0x06
+#define ESL_CMD_SET_GROUP 0x07
+#define ESL_CMD_LISTEN 0x08
+#define ESL_CMD_PENDING 0x09
+#define ESL_CMD_MOVE 0x0A
+/*
+ * No data. The tag answers the event that carried it, then drops its sync and
+ * saved train and advertises to be onboarded again, by whichever central
+ * hears it best. Sent when another central may serve the tag better.
+ */
+#define ESL_CMD_RELEASE 0x0B
 
 struct esl_coordinate {
     uint8_t x;
@@ -16,4 +36,413 @@ struct esl_sensor_reading {
     float humidity;
 } __packed;
 
+/*
+ * Sent to ESL_ADDR_BROADCAST in every subevent for a few events before the
+ * central changes the periodic advertising interval. The train restarts with
+ * the new timing after the event in which countdown reaches 0, and tags
+ * resync to it by scanning instead of waiting to be onboarded again.
+ */
+struct esl_cmd_timing {
+    /* New periodic advertising interval in 1.25ms units */
+    uint16_t interval;
+    /* Further events of this subevent sent with the old timing */
+    uint8_t countdown;
+} __packed;
+
+/*
+ * Image transfer
+ *
+ * A 1-bpp frame in LVGL's LV_IMG_CF_INDEXED_1BIT layout without the palette:
+ * rows of ESL_IMG_STRIDE bytes, MSB first, 1 is black. ESL_CMD_IMG_START
+ * announces a transfer and ESL_CMD_IMG_CHUNK carries one chunk of it; chunks
+ * can arrive in any order and more than once. Two chunks fit in one subevent
+ * payload, so an uncoded frame takes 18 events for one tag.
+ *
+ * Chunks are either a plain slice of the frame (ESL_IMG_ENC_RAW) or run-length
+ * coded (see esl_image.h). Coded chunks carry the frame offset they decode to,
+ * so each one is decoded on its own as it arrives.
+ */
+#define ESL_IMG_WIDTH      250
+#define ESL_IMG_HEIGHT     122
+#define ESL_IMG_STRIDE     ((ESL_IMG_WIDTH + 7) / 8)
+#define ESL_IMG_SIZE       (ESL_IMG_STRIDE * ESL_IMG_HEIGHT)
+#define ESL_IMG_CHUNK_LEN  112
+#define ESL_IMG_MAX_CHUNKS ((ESL_IMG_SIZE + ESL_IMG_CHUNK_LEN - 1) / ESL_IMG_CHUNK_LEN)
+
+#define ESL_IMG_ENC_RAW   0x00
+#define ESL_IMG_ENC_RLE   0x01
+/* Run-length coded XOR against the frame the tag shows */
+#define ESL_IMG_ENC_DELTA 0x02
+
+struct esl_img_start {
+    /* Chunks and status of other transfers are ignored */
+    uint8_t image_id;
+    /* Decoded size */
+    uint16_t size;
+    /* ESL_IMG_ENC_RAW: every chunk but the last is this long */
+    uint8_t chunk_len;
+    uint8_t encoding;
+    uint8_t num_chunks;
+    /* ESL_IMG_ENC_DELTA: esl_img_crc() of the frame the delta applies to */
+    uint16_t base_crc;
+    /* esl_img_crc() of the decoded frame. Ids repeat once they wrap or the
+     * central restarts, a start is only a repeat if every field matches.
+     */
+    uint16_t crc;
+} __packed;
+
+/* Followed by the chunk data */
+struct esl_img_chunk {
+    uint8_t image_id;
+    uint8_t index;
+} __packed;
+
+/* Coded chunk, followed by at most ESL_IMG_RLE_LEN bytes of coded data */
+struct esl_img_rle_chunk {
+    uint8_t image_id;
+    uint8_t index;
+    /* Frame offset of the first decoded byte */
+    uint16_t offset;
+} __packed;
+
+#define ESL_IMG_RLE_LEN (ESL_IMG_CHUNK_LEN - sizeof(uint16_t))
+
+/*
+ * Groups
+ *
+ * A tag is in at most one group, given to it in the onboarding timing write or
+ * later with ESL_CMD_SET_GROUP. Commands to ESL_ADDR_GROUP(group) reach every
+ * member listening to the subevent, so a group kept within one subevent is
+ * updated with a single transmission. Group and broadcast commands are
+ * repeated until every member has answered, so tags can see them more than
+ * once.
+ */
+#define ESL_GROUP_COUNT     0x7E
+#define ESL_GROUP_NONE      0xFF
+#define ESL_ADDR_GROUP_BASE 0x80
+#define ESL_ADDR_GROUP(group) ((uint8_t)(ESL_ADDR_GROUP_BASE | (group)))
+
+struct esl_cmd_set_group {
+    /* ESL_GROUP_NONE to leave the current group */
+    uint8_t group;
+} __packed;
+
+/*
+ * Subevent a tag receives besides its home subevent
+ *
+ * The burst subevent is lent to one tag while the central streams to it, and
+ * also carries commands to ESL_ADDR_BURST; the tag drops it once idle_events
+ * of its events in a row had nothing for it. Tags only ever respond in their
+ * home subevent, and report what they received in the burst subevent with
+ * esl_burst_status. The extra subevent costs a receive window per interval.
+ */
+#define ESL_SUBEVENT_NONE 0xFF
+
+struct esl_cmd_listen {
+    /* ESL_SUBEVENT_NONE to stop receiving it */
+    uint8_t subevent;
+    /* Not 0, tags ignore the command otherwise */
+    uint8_t idle_events;
+} __packed;
+
+/*
+ * Sent to ESL_ADDR_BROADCAST every few events of each subevent. Tags of the
+ * subevent whose response slot bit is clear get nothing in it before the
+ * next hint, events later, so they can stop receiving until just before
+ * then. Tags that have not heard a hint yet keep receiving every event.
+ */
+struct esl_cmd_pending {
+    /* Events until the next hint */
+    uint8_t events;
+    /* BIT(response slot) of the tags that have something coming */
+    uint16_t slots;
+} __packed;
+
+/*
+ * Moves a tag to another home subevent and response slot, to even out the
+ * load of the subevents. The tag still answers the event that carried it in
+ * the old slot, and from the next event on in the new one.
+ */
+struct esl_cmd_move {
+    uint8_t subevent;
+    uint8_t response_slot;
+} __packed;
+
+/*
+ * Written straight to the panel in the area it covers, followed by the pixels
+ * in the ESL_IMG_* layout with rows of DIV_ROUND_UP(width, 8) bytes. y and
+ * height are multiples of ESL_RECT_ALIGN so that panels addressed in 8 pixel
+ * pages can take the area as is. The area stays until the screen is redrawn.
+ */
+#define ESL_RECT_ALIGN      8
+#define ESL_RECT_PIXELS_MAX (ESL_IMG_CHUNK_LEN - sizeof(uint16_t))
+
+struct esl_cmd_rect {
+    uint8_t x;
+    uint8_t y;
+    uint8_t width;
+    uint8_t height;
+} __packed;
+
+/*
+ * Response slot payload
+ *
+ * Tags answer with the sensor reading as a manufacturer specific AD structure
+ * without a company ID. Any further AD structures are ESL records,
+ * manufacturer specific data with the ESL company ID and a record type:
+ *
+ *   | 9 | 0xFF | esl_sensor_reading | len | 0xFF | 0x59 0x00 | type | record... |
+ */
+#define ESL_RSP_IMG_STATUS 0x01
+#define ESL_RSP_BURST      0x02
+
+/* The tag does not show the frame a delta was coded against */
+#define ESL_IMG_STATUS_REJECTED BIT(0)
+/* Every chunk arrived but the frame does not match the crc, it is not shown */
+#define ESL_IMG_STATUS_CRC_FAILED BIT(1)
+
+/* Progress of the current or last image transfer */
+struct esl_img_status {
+    uint8_t image_id;
+    /* crc of the start this reports on */
+    uint16_t crc;
+    uint8_t received;
+    uint8_t flags;
+    /* Bit n set while chunk n is still missing */
+    uint8_t missing[(ESL_IMG_MAX_CHUNKS + 7) / 8];
+} __packed;
+
+/*
+ * Sent while the tag receives a burst subevent. The response in the home
+ * subevent says nothing about the burst subevent, so the tag counts the
+ * events there that carried commands for it, from 0 at every ESL_CMD_LISTEN
+ * for a burst subevent, wrapping at 256.
+ */
+struct esl_burst_status {
+    uint8_t subevent;
+    uint8_t batches;
+} __packed;
+
+/* Longest response: the sensor reading plus every record type once */
+#define ESL_RSP_RECORD_LEN(type) (5 + sizeof(type))
+#define ESL_RSP_MAX_LEN                                                                      \
+    (2 + sizeof(struct esl_sensor_reading) + ESL_RSP_RECORD_LEN(struct esl_img_status) +     \
+     ESL_RSP_RECORD_LEN(struct esl_burst_status))
+
+/*
+ * Firmware version advertised by tags in their connectable advertising
+ * (manufacturer specific data after the company ID). The central caches GATT
+ * handles per version, so bump this whenever the attribute layout of the tag
+ * changes.
+ */
+#define ESL_FW_VERSION 2
+
+struct esl_adv_info {
+    uint16_t company_id;
+    uint16_t fw_version;
+} __packed;
+
+/*
+ * Notified by the tag on the PAwR characteristic when it has synced to the
+ * train, so the central can close the connection straight away. The CCC
+ * descriptor directly follows the characteristic value.
+ */
+struct esl_sync_status {
+    uint8_t synced;
+    uint8_t subevent;
+    uint8_t response_slot;
+} __packed;
+
+/*
+ * Subevent payload framing
+ *
+ * A subevent payload is a single manufacturer specific AD structure holding
+ * any number of addressed commands back to back:
+ *
+ *   | len | 0xFF | 0x59 0x00 | addr type len data... | addr type len data... |
+ *
+ * addr is the response slot of the tag within the subevent, ESL_ADDR_GROUP()
+ * for the members of a group, or ESL_ADDR_BROADCAST for every tag listening to
+ * the subevent. ESL_ADDR_BURST is the tag the subevent is lent to, see
+ * ESL_CMD_LISTEN. Response slots are below ESL_ADDR_GROUP_BASE. The core spec
+ * allows 251 bytes of subevent data, the tag's sync buffer
+ * (CONFIG_BT_PER_ADV_SYNC_BUF_SIZE) holds 247.
+ */
+#define ESL_PAYLOAD_MAX_LEN 247
+#define ESL_COMPANY_ID      0x0059
+#define ESL_FRAME_HDR_LEN   4
+#define ESL_ADDR_BURST      0xFE
+#define ESL_ADDR_BROADCAST  0xFF
+
+struct esl_cmd_hdr {
+    uint8_t addr;
+    uint8_t type;
+    uint8_t len;
+} __packed;
+
+/* Decoded command, data points into the received buffer */
+struct esl_cmd {
+    uint8_t addr;
+    uint8_t type;
+    uint8_t len;
+    const uint8_t *data;
+};
+
+typedef bool (*esl_cmd_func_t)(const struct esl_cmd *cmd, void *user_data);
+
+/**
+ * @brief Start a new frame at the beginning of an empty buffer
+ */
+static inline void esl_frame_init(struct net_buf_simple *buf)
+{
+    net_buf_simple_add_u8(buf, ESL_FRAME_HDR_LEN - 1);
+    net_buf_simple_add_u8(buf, BT_DATA_MANUFACTURER_DATA);
+    net_buf_simple_add_le16(buf, ESL_COMPANY_ID);
+}
+
+/**
+ * @brief Largest command body that still fits in the frame
+ */
+static inline size_t esl_frame_room(const struct net_buf_simple *buf)
+{
+    size_t room;
+
+    if (buf->len >= ESL_PAYLOAD_MAX_LEN) {
+        return 0;
+    }
+
+    room = MIN(net_buf_simple_tailroom(buf), (size_t)(ESL_PAYLOAD_MAX_LEN - buf->len));
+
+    return room > sizeof(struct esl_cmd_hdr) ? room - sizeof(struct esl_cmd_hdr) : 0;
+}
+
+static inline bool esl_frame_is_empty(const struct net_buf_simple *buf)
+{
+    return buf->len <= ESL_FRAME_HDR_LEN;
+}
+
+/**
+ * @brief Append an addressed command to a frame started with esl_frame_init()
+ *
+ * @return int 0 on success, -ENOMEM if the command does not fit
+ */
+static inline int esl_frame_add(struct net_buf_simple *buf, uint8_t addr, uint8_t type,
+                                const void *data, uint8_t len)
+{
+    if (buf->len < ESL_FRAME_HDR_LEN || esl_frame_room(buf) < len) {
+        return -ENOMEM;
+    }
+
+    net_buf_simple_add_u8(buf, addr);
+    net_buf_simple_add_u8(buf, type);
+    net_buf_simple_add_u8(buf, len);
+    net_buf_simple_add_mem(buf, data, len);
+
+    buf->data[0] = buf->len - 1;
+
+    return 0;
+}
+
+/**
+ * @brief Walk the commands of a received frame in place
+ *
+ * The buffer is not modified. Parsing stops early when @p func returns false.
+ *
+ * @return int Number of commands visited, -EBADMSG if the frame is malformed
+ */
+static inline int esl_frame_parse(const struct net_buf_simple *buf, esl_cmd_func_t func,
+                                  void *user_data)
+{
+    const uint8_t *p = buf->data;
+    const uint8_t *end;
+    struct esl_cmd cmd;
+    int count = 0;
+
+    if (buf->len < ESL_FRAME_HDR_LEN || p[1] != BT_DATA_MANUFACTURER_DATA ||
+        sys_get_le16(&p[2]) != ESL_COMPANY_ID || p[0] + 1 > buf->len) {
+        return -EBADMSG;
+    }
+
+    end = p + p[0] + 1;
+    p += ESL_FRAME_HDR_LEN;
+
+    while (p < end) {
+        if ((size_t)(end - p) < sizeof(struct esl_cmd_hdr)) {
+            return -EBADMSG;
+        }
+
+        cmd.addr = p[0];
+        cmd.type = p[1];
+        cmd.len = p[2];
+        cmd.data = p + sizeof(struct esl_cmd_hdr);
+
+        if (end - cmd.data < cmd.len) {
+            return -EBADMSG;
+        }
+
+        p = cmd.data + cmd.len;
+        count++;
+
+        if (!func(&cmd, user_data)) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Find an ESL record in a response payload
+ *
+ * @param buf Response payload, not modified
+ * @param type Record type (ESL_RSP_*)
+ * @param len Length of the record body
+ * @return const uint8_t* Record body, NULL if the response has no such record
+ */
+static inline const uint8_t *esl_rsp_find(const struct net_buf_simple *buf, uint8_t type,
+                                          uint8_t *len)
+{
+    const uint8_t *p = buf->data;
+    const uint8_t *end = buf->data + buf->len;
+
+    /* Skip the sensor reading, its contents could look like a record */
+    if (buf->len < 1 || p[0] + 1 > buf->len) {
+        return NULL;
+    }
+    p += p[0] + 1;
+
+    while (end - p >= 2 && p[0] != 0 && p + p[0] + 1 <= end) {
+        if (p[0] >= 4 && p[1] == BT_DATA_MANUFACTURER_DATA &&
+            sys_get_le16(&p[2]) == ESL_COMPANY_ID && p[4] == type) {
+            *len = p[0] - 4;
+            return &p[5];
+        }
+
+        p += p[0] + 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Append an ESL record to a response payload
+ *
+ * @return int 0 on success, -ENOMEM if it does not fit
+ */
+static inline int esl_rsp_add(struct net_buf_simple *buf, uint8_t type, const void *data,
+                              uint8_t len)
+{
+    if (net_buf_simple_tailroom(buf) < (size_t)len + 5 || len > UINT8_MAX - 4) {
+        return -ENOMEM;
+    }
+
+    net_buf_simple_add_u8(buf, len + 4);
+    net_buf_simple_add_u8(buf, BT_DATA_MANUFACTURER_DATA);
+    net_buf_simple_add_le16(buf, ESL_COMPANY_ID);
+    net_buf_simple_add_u8(buf, type);
+    net_buf_simple_add_mem(buf, data, len);
+
+    return 0;
+}
+
 #endif
@@ -0,0 +1,124 @@
+#ifndef ESL_POOL_H__
+#define ESL_POOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/iterable_sections.h>
+
+/*
+ * Fixed block pools for PAwR traffic: subevent payloads, responses and
+ * queued commands
+ *
+ * A k_mem_slab that remembers the most blocks it ever had out and how often
+ * it ran dry, so block counts can be set from measurements rather than worst
+ * cases. Every pool of the image is listed by esl_pool_foreach(), which needs
+ * the section from common/esl_pool.ld:
+ *
+ *     zephyr_linker_sources(DATA_SECTIONS ${CMAKE_CURRENT_SOURCE_DIR}/../common/esl_pool.ld)
+ */
+struct esl_pool {
+    struct k_mem_slab *slab;
+    const char *name;
+    size_t block_size;
+    atomic_t used_max;
+    atomic_t failed;
+};
+
+struct esl_pool_stats {
+    const char *name;
+    size_t block_size;
+    uint32_t blocks;
+    uint32_t used;
+    uint32_t used_max;
+    /* Allocations that found the pool empty */
+    uint32_t failed;
+};
+
+/**
+ * @brief Define a pool, the name has to be unique in the image
+ */
+#define ESL_POOL_DEFINE(_name, _block_size, _blocks)                                      \
+    K_MEM_SLAB_DEFINE_STATIC(_name##_slab, WB_UP(_block_size), _blocks, 4);               \
+    STRUCT_SECTION_ITERABLE(esl_pool, _name) = {                                          \
+        .slab = &_name##_slab,                                                            \
+        .name = #_name,                                                                   \
+        .block_size = (_block_size),                                                      \
+    }
+
+#define esl_pool_foreach(_pool) STRUCT_SECTION_FOREACH(esl_pool, _pool)
+
+/**
+ * @brief Take a block, never waits
+ *
+ * @return void* The block, NULL if the pool is empty
+ */
+static inline void *esl_pool_alloc(struct esl_pool *pool)
+{
+    void *block;
+    atomic_val_t used;
+    atomic_val_t max;
+
+    if (k_mem_slab_alloc(pool->slab, &block, K_NO_WAIT)) {
+        atomic_inc(&pool->failed);
+        return NULL;
+    }
+
+    used = k_mem_slab_num_used_get(pool->slab);
+    do {
+        max = atomic_get(&pool->used_max);
+    } while (used > max && !atomic_cas(&pool->used_max, max, used));
+
+    return block;
+}
+
+static inline void esl_pool_free(struct esl_pool *pool, void *block)
+{
+    k_mem_slab_free(pool->slab, block);
+}
+
+/**
+ * @brief Take a block and set up an empty buffer on it
+ *
+ * @return int 0 on success, -ENOMEM if the pool is empty
+ */
+static inline int esl_pool_buf_alloc(struct esl_pool *pool, struct net_buf_simple *buf)
+{
+    void *block = esl_pool_alloc(pool);
+
+    if (!block) {
+        return -ENOMEM;
+    }
+
+    net_buf_simple_init_with_data(buf, block, pool->block_size);
+    net_buf_simple_reset(buf);
+
+    return 0;
+}
+
+/**
+ * @brief Give back the block under a buffer from esl_pool_buf_alloc()
+ */
+static inline void esl_pool_buf_free(struct esl_pool *pool, struct net_buf_simple *buf)
+{
+    esl_pool_free(pool, buf->__buf);
+    buf->__buf = NULL;
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+}
+
+static inline void esl_pool_get_stats(const struct esl_pool *pool, struct esl_pool_stats *stats)
+{
+    stats->name = pool->name;
+    stats->block_size = pool->block_size;
+    stats->blocks = pool->slab->info.num_blocks;
+    stats->used = k_mem_slab_num_used_get(pool->slab);
+    stats->used_max = atomic_get(&pool->used_max);
+    stats->failed = atomic_get(&pool->failed);
+}
+
+#endif /* ESL_POOL_H__ */
@@ -0,0 +1,515 @@
+"""Link between centrals for firmware/esl_central_adv/src/coord.c.
+
+hub: relays frames between the coordination UARTs of centrals and logs every
+frame it sees. This is how the firmware itself is run together: DK builds
+wired to serial ports, or nrf54l15bsim builds sharing a simulated radio, each
+with its UARTE21 on a pty (see esl_central_adv/boards):
+
+    west build -b nrf54l15bsim/nrf54l15/cpuapp esl_central_adv
+    zephyr.exe -s=esl -d=0 -uart<n>_pty ...   # once per central, -d=1, ...
+    python main.py hub /dev/pts/3 /dev/pts/5 listen:4000
+
+sim: a model of the claim, release and anchor rules of coord.c for trying
+out layouts of many centrals and walking tags without building anything. It
+prints who owns which tag, handovers and where each central's trains sit.
+coord.c is the reference, check what the model shows against real builds
+through the hub, which can also join the model through the same endpoints.
+
+    python main.py sim --centrals 3 --tags 24 --duration 120
+    python main.py sim --centrals 2 --attach /dev/pts/3
+
+Endpoints: a pty or serial device path, tcp:HOST:PORT to connect,
+listen:PORT to accept connections, unix:PATH for a unix socket.
+"""
+import argparse
+import binascii
+import math
+import os
+import random
+import select
+import socket
+import struct
+import sys
+import time
+import tty
+
+# Must match coord.h
+COORD_SOF = 0xE5
+COORD_HELLO = 0x01
+COORD_CLAIM = 0x02
+COORD_PAYLOAD_MAX = 16
+COORD_HELLO_MS = 1000
+COORD_PEER_TIMEOUT_MS = 5000
+COORD_CLAIM_MS = 300
+COORD_VERDICT_MS = 10000
+COORD_OWNER_BONUS_DB = 6
+COORD_WEAK_RSSI = -85
+COORD_WEAK_CHECKS = 3
+COORD_CHECK_MS = 5000
+COORD_CLAIM_OWNER = 0x01
+
+HDR = struct.Struct('<BBI')
+HELLO = struct.Struct('<HBBHI')
+CLAIM = struct.Struct('<B6sbB')
+
+TICK_MS = 50
+# Below this a central does not hear a tag at all
+SENSITIVITY_DBM = -95
+
+
+def crc(data):
+    # CRC-16/CCITT-FALSE, crc16_itu_t() seeded with 0xFFFF
+    return binascii.crc_hqx(data, 0xFFFF)
+
+
+def encode(sender, type_, payload):
+    body = HDR.pack(len(payload), type_, sender) + payload
+    return bytes([COORD_SOF]) + body + struct.pack('<H', crc(body))
+
+
+class Parser:
+    """Splits a byte stream into frames like rx_byte() in coord.c"""
+
+    def __init__(self):
+        self.buf = bytearray()
+        self.in_frame = False
+        self.dropped = 0
+
+    def feed(self, data):
+        frames = []
+        for byte in data:
+            if not self.in_frame:
+                self.in_frame = byte == COORD_SOF
+                self.buf.clear()
+                continue
+
+            self.buf.append(byte)
+            if self.buf[0] > COORD_PAYLOAD_MAX:
+                self.in_frame = False
+                continue
+
+            total = HDR.size + self.buf[0] + 2
+            if len(self.buf) < total:
+                continue
+
+            self.in_frame = False
+            body = bytes(self.buf[:total - 2])
+            if crc(body) != struct.unpack('<H', self.buf[total - 2:total])[0]:
+                self.dropped += 1
+                continue
+
+            length, type_, sender = HDR.unpack(body[:HDR.size])
+            frames.append((sender, type_, body[HDR.size:HDR.size + length]))
+        return frames
+
+
+def describe(sender, type_, payload):
+    if type_ == COORD_HELLO and len(payload) >= HELLO.size:
+        interval, se_interval, trains, tags, phase = HELLO.unpack(payload[:HELLO.size])
+        return (f'{sender:08x} hello interval {interval} subevent interval {se_interval} '
+                f'trains {trains} tags {tags} phase {phase} us')
+    if type_ == COORD_CLAIM and len(payload) >= CLAIM.size:
+        _, addr, rssi, flags = CLAIM.unpack(payload[:CLAIM.size])
+        owner = ' owner' if flags & COORD_CLAIM_OWNER else ''
+        return f'{sender:08x} claim {addr_str(addr)} {rssi} dBm{owner}'
+    return f'{sender:08x} type {type_:#04x} len {len(payload)}'
+
+
+def addr_str(addr):
+    return ':'.join(f'{b:02X}' for b in reversed(addr))
+
+
+class Endpoint:
+    def __init__(self, spec):
+        self.spec = spec
+        self.listener = None
+        self.conns = []
+        self.parser = Parser()
+
+        if spec.startswith('listen:'):
+            self.listener = socket.create_server(('', int(spec[7:])))
+            self.listener.setblocking(False)
+        elif spec.startswith('tcp:'):
+            host, port = spec[4:].rsplit(':', 1)
+            self.conns.append(socket.create_connection((host, int(port))))
+        elif spec.startswith('unix:'):
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(spec[5:])
+            self.conns.append(sock)
+        else:
+            fd = os.open(spec, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+            if os.isatty(fd):
+                tty.setraw(fd)
+            self.conns.append(fd)
+
+    def fds(self):
+        fds = list(self.conns)
+        if self.listener:
+            fds.append(self.listener)
+        return fds
+
+    def read(self, fd):
+        if fd is self.listener:
+            conn, peer = self.listener.accept()
+            print(f'{self.spec}: {peer} connected')
+            self.conns.append(conn)
+            return b''
+        try:
+            data = os.read(fd, 512) if isinstance(fd, int) else fd.recv(512)
+        except (BlockingIOError, InterruptedError):
+            return b''
+        except OSError:
+            data = b''
+        if not data and not isinstance(fd, int):
+            print(f'{self.spec}: disconnected')
+            self.conns.remove(fd)
+            fd.close()
+        return data
+
+    def write(self, data, skip=None):
+        for conn in list(self.conns):
+            if conn is skip:
+                continue
+            try:
+                if isinstance(conn, int):
+                    os.write(conn, data)
+                else:
+                    conn.sendall(data)
+            except OSError:
+                pass
+
+
+class Bus:
+    """Shared medium between endpoints and simulated centrals"""
+
+    def __init__(self, specs, log):
+        self.endpoints = [Endpoint(spec) for spec in specs]
+        self.log = log
+        self.local = []
+
+    def poll(self, timeout):
+        fds = {}
+        for endpoint in self.endpoints:
+            for fd in endpoint.fds():
+                fds[fd] = endpoint
+        if not fds:
+            time.sleep(timeout)
+            return
+
+        readable, _, _ = select.select(list(fds), [], [], timeout)
+        for fd in readable:
+            endpoint = fds[fd]
+            data = endpoint.read(fd)
+            if not data:
+                continue
+            for other in self.endpoints:
+                other.write(data, skip=fd if other is endpoint else None)
+            for frame in endpoint.parser.feed(data):
+                self.deliver(frame)
+
+    def send(self, sender, type_, payload):
+        frame = encode(sender, type_, payload)
+        for endpoint in self.endpoints:
+            endpoint.write(frame)
+        self.deliver((sender, type_, payload))
+
+    def deliver(self, frame):
+        if self.log:
+            print(f'[{time.strftime("%H:%M:%S")}] {describe(*frame)}')
+        for central in self.local:
+            central.receive(*frame)
+
+
+def hub(args):
+    bus = Bus(args.endpoints, log=True)
+    while True:
+        bus.poll(1.0)
+
+
+class Tag:
+    def __init__(self, index, area):
+        self.addr = bytes([index & 0xFF, index >> 8, 0x00, 0x00, 0x54, 0xC0])
+        self.x = random.uniform(0, area)
+        self.y = random.uniform(0, area)
+        self.heading = random.uniform(0, 2 * math.pi)
+        self.owner = None
+
+    def walk(self, area, speed):
+        self.heading += random.gauss(0, 0.05)
+        self.x = min(max(self.x + speed * math.cos(self.heading), 0), area)
+        self.y = min(max(self.y + speed * math.sin(self.heading), 0), area)
+
+
+class Central:
+    """Claims, releases and anchors as in coord.c"""
+
+    def __init__(self, sim, id_, x, y):
+        self.sim = sim
+        self.id = id_
+        self.x = x
+        self.y = y
+        self.peers = {}
+        self.claims = {}
+        self.tags = set()
+        self.weak = {}
+        self.released = set()
+        # Time of the first train's first event, moved by a realign
+        self.anchor_ms = random.uniform(0, sim.interval_ms)
+        self.aligned_at = None
+        self.hello_at = 0
+        self.check_at = random.uniform(0, COORD_CHECK_MS)
+        self.stats = dict(won=0, lost=0, released=0, handed_over=0, realigns=0)
+
+    def rssi(self, tag):
+        d = max(math.hypot(tag.x - self.x, tag.y - self.y), 1.0)
+        return int(-40 - 30 * math.log10(d) + random.gauss(0, 2))
+
+    def phase_us(self, now):
+        return int(((now - self.anchor_ms) % self.sim.interval_ms) * 1000)
+
+    def claim(self, tag, rssi, now):
+        c = self.claim_get(tag.addr, now)
+        if c['decided']:
+            return c['won']
+        if not c['claimed']:
+            owner = tag.addr in self.tags
+            c['claimed'] = True
+            c['owner'] = owner
+            self.offer(c, self.id, rssi + (COORD_OWNER_BONUS_DB if owner else 0))
+            flags = COORD_CLAIM_OWNER if owner else 0
+            self.sim.bus.send(self.id, COORD_CLAIM, CLAIM.pack(0, tag.addr, rssi, flags))
+        return False
+
+    def claim_get(self, addr, now):
+        c = self.claims.get(addr)
+        if c is None or c['expires'] <= now:
+            c = dict(deadline=now + COORD_CLAIM_MS, expires=now + COORD_CLAIM_MS + COORD_VERDICT_MS,
+                     best_id=0, best_rssi=-1000, claimed=False, owner=False, decided=False,
+                     won=False)
+            self.claims[addr] = c
+        return c
+
+    @staticmethod
+    def offer(c, id_, rssi):
+        if c['decided']:
+            return
+        if rssi > c['best_rssi'] or (rssi == c['best_rssi'] and id_ < c['best_id']):
+            c['best_rssi'] = rssi
+            c['best_id'] = id_
+
+    def receive(self, sender, type_, payload):
+        if sender == self.id:
+            return
+        now = self.sim.now
+        if type_ == COORD_HELLO and len(payload) >= HELLO.size:
+            self.peers[sender] = (now, HELLO.unpack(payload[:HELLO.size]))
+        elif type_ == COORD_CLAIM and len(payload) >= CLAIM.size:
+            _, addr, rssi, flags = CLAIM.unpack(payload[:CLAIM.size])
+            c = self.claim_get(addr, now)
+            self.offer(c, sender, rssi + (COORD_OWNER_BONUS_DB if flags & COORD_CLAIM_OWNER else 0))
+            if addr in self.tags:
+                c['owner'] = True
+                tag = self.sim.tag_by_addr.get(addr)
+                if tag and not c['claimed'] and not c['decided']:
+                    # Our RSSI on record, the tag is still synced to us
+                    rssi = self.rssi(tag)
+                    if rssi >= SENSITIVITY_DBM:
+                        c['claimed'] = True
+                        self.offer(c, self.id, rssi + COORD_OWNER_BONUS_DB)
+                        self.sim.bus.send(self.id, COORD_CLAIM,
+                                          CLAIM.pack(0, addr, rssi, COORD_CLAIM_OWNER))
+
+    def tick(self, now):
+        for addr, c in list(self.claims.items()):
+            if c['expires'] <= now:
+                del self.claims[addr]
+                continue
+            if c['decided'] or now < c['deadline']:
+                continue
+            c['decided'] = True
+            c['won'] = c['claimed'] and c['best_id'] == self.id
+            if c['won']:
+                self.stats['won'] += 1
+                continue
+            if c['claimed']:
+                self.stats['lost'] += 1
+            if c['owner'] and addr in self.tags:
+                self.tags.discard(addr)
+                self.released.discard(addr)
+                self.stats['handed_over'] += 1
+                self.sim.event(f'{self.id:08x} hands {addr_str(addr)} over to {c["best_id"]:08x}')
+
+        for id_ in [id_ for id_, (seen, _) in self.peers.items()
+                    if now - seen >= COORD_PEER_TIMEOUT_MS]:
+            del self.peers[id_]
+            self.sim.event(f'{self.id:08x} lost central {id_:08x}')
+
+        if now >= self.hello_at:
+            hello = HELLO.pack(self.sim.interval, self.sim.subevent_interval, self.sim.trains,
+                               len(self.tags), self.phase_us(now))
+            self.sim.bus.send(self.id, COORD_HELLO, hello)
+            self.hello_at = now + COORD_HELLO_MS
+            self.align(now)
+
+        if now >= self.check_at:
+            self.check_at = now + COORD_CHECK_MS
+            if self.peers:
+                self.check_weak()
+
+    def check_weak(self):
+        for addr in list(self.tags):
+            tag = self.sim.tag_by_addr[addr]
+            rssi = self.rssi(tag)
+            if rssi >= COORD_WEAK_RSSI:
+                self.weak[addr] = 0
+                if rssi >= COORD_WEAK_RSSI + COORD_OWNER_BONUS_DB:
+                    self.released.discard(addr)
+                continue
+            self.weak[addr] = min(self.weak.get(addr, 0) + 1, COORD_WEAK_CHECKS)
+            if self.weak[addr] < COORD_WEAK_CHECKS or addr in self.released:
+                continue
+            self.released.add(addr)
+            self.stats['released'] += 1
+            tag.owner = None
+            self.sim.event(f'{self.id:08x} releases {addr_str(addr)} at {rssi} dBm')
+
+    def align(self, now):
+        same = [id_ for id_, (_, h) in self.peers.items()
+                if h[:3] == (self.sim.interval, self.sim.subevent_interval, self.sim.trains)]
+        leader = min(same + [self.id])
+        if leader == self.id:
+            return
+
+        seen, hello = self.peers[leader]
+        rank = sum(1 for id_ in self.peers if id_ < self.id)
+        centrals = len(self.peers) + 1
+        interval_us = self.sim.interval * 1250
+        step_us = self.sim.subevent_interval * 1250 // (centrals * self.sim.trains)
+        leader_us = (hello[4] + int((now - seen) * 1000)) % interval_us
+        target_us = (leader_us - step_us * rank) % interval_us
+        error = (self.phase_us(now) - target_us) % interval_us
+        if error > interval_us // 2:
+            error -= interval_us
+        if abs(error) <= max(step_us // 4, 2000):
+            return
+        if self.aligned_at is not None and now - self.aligned_at < self.sim.holdoff_ms:
+            return
+
+        self.aligned_at = now
+        self.anchor_ms = now + ((interval_us - target_us) % interval_us) / 1000
+        self.stats['realigns'] += 1
+        self.sim.event(f'{self.id:08x} restarts trains, {error} us off, rank {rank} of {centrals}')
+
+
+class Sim:
+    def __init__(self, args):
+        self.interval = args.interval
+        self.subevent_interval = args.subevent_interval
+        self.trains = args.trains
+        self.interval_ms = self.interval * 1.25
+        self.holdoff_ms = args.holdoff * 1000
+        self.area = args.area
+        self.speed = args.speed
+        self.now = 0.0
+        self.bus = Bus(args.attach, log=args.verbose)
+        self.tags = [Tag(i, self.area) for i in range(args.tags)]
+        self.tag_by_addr = {tag.addr: tag for tag in self.tags}
+        self.centrals = []
+        for i in range(args.centrals):
+            # Spread along the diagonal so neighbours overlap
+            pos = self.area * (i + 0.5) / args.centrals
+            self.centrals.append(Central(self, random.getrandbits(32), pos, pos))
+        self.bus.local = self.centrals
+
+    def event(self, text):
+        print(f'{self.now / 1000:8.1f} s  {text}')
+
+    def step(self):
+        for tag in self.tags:
+            tag.walk(self.area, self.speed * TICK_MS / 1000)
+            if tag.owner is None:
+                self.advertise(tag)
+        for central in self.centrals:
+            central.tick(self.now)
+
+    def advertise(self, tag):
+        winner = None
+        for central in self.centrals:
+            rssi = central.rssi(tag)
+            if rssi < SENSITIVITY_DBM:
+                continue
+            if central.claim(tag, rssi, self.now):
+                winner = central
+        if winner:
+            winner.tags.add(tag.addr)
+            winner.weak[tag.addr] = 0
+            tag.owner = winner
+            for central in self.centrals:
+                if central is not winner and tag.addr in central.tags:
+                    # Forgotten on its lost verdict, this only catches a missed one
+                    central.tags.discard(tag.addr)
+            self.event(f'{winner.id:08x} onboards {addr_str(tag.addr)}')
+
+    def report(self):
+        print(f'{self.now / 1000:8.1f} s  ownership:')
+        for central in self.centrals:
+            anchor = central.phase_us(self.now)
+            print(f'    {central.id:08x}: {len(central.tags)} tags, phase {anchor} us, '
+                  + ', '.join(f'{k} {v}' for k, v in central.stats.items()))
+        unowned = sum(1 for tag in self.tags if tag.owner is None)
+        print(f'    unowned tags: {unowned}')
+
+
+def sim(args):
+    s = Sim(args)
+    realtime = bool(args.attach)
+    report_at = 0
+    started = time.monotonic()
+
+    while s.now < args.duration * 1000:
+        if realtime:
+            s.bus.poll(max(0, started + (s.now + TICK_MS) / 1000 - time.monotonic()))
+        s.step()
+        if s.now >= report_at:
+            s.report()
+            report_at += args.report * 1000
+        s.now += TICK_MS
+
+    s.report()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='mode', required=True)
+
+    p = sub.add_parser('hub', help='Relay and log frames between endpoints')
+    p.add_argument('endpoints', nargs='+')
+
+    p = sub.add_parser('sim', help='Simulate centrals and moving tags')
+    p.add_argument('--centrals', type=int, default=3)
+    p.add_argument('--tags', type=int, default=24)
+    p.add_argument('--duration', type=int, default=120, help='Seconds')
+    p.add_argument('--report', type=int, default=20, help='Seconds between reports')
+    p.add_argument('--area', type=float, default=60.0, help='Side of the floor in m')
+    p.add_argument('--speed', type=float, default=1.0, help='Tag speed in m/s')
+    p.add_argument('--interval', type=int, default=160, help='In 1.25 ms units')
+    p.add_argument('--subevent-interval', type=int, default=20, help='In 1.25 ms units')
+    p.add_argument('--trains', type=int, default=2)
+    p.add_argument('--holdoff', type=int, default=600, help='Seconds between realigns')
+    p.add_argument('--attach', nargs='*', default=[], help='Endpoints of real centrals')
+    p.add_argument('--seed', type=int)
+    p.add_argument('--verbose', action='store_true', help='Log every frame')
+
+    args = parser.parse_args()
+    if getattr(args, 'seed', None) is not None:
+        random.seed(args.seed)
+
+    try:
+        hub(args) if args.mode == 'hub' else sim(args)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    sys.exit(main())
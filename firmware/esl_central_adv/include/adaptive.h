@@ -0,0 +1,34 @@
+#ifndef ADAPTIVE_H__
+#define ADAPTIVE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+struct adaptive_stats {
+	/* Switches to the fast interval and back */
+	uint32_t to_fast;
+	uint32_t to_slow;
+	/* Time spent on the fast interval */
+	uint64_t fast_ms;
+};
+
+/**
+ * @brief Start switching the periodic interval with the downlink load
+ *
+ * While commands are queued or in flight the train runs on the fast variant
+ * of the configured timing, see pawr_params_set_fast(). After the queues have
+ * been empty for a few fast intervals it goes back to the configured interval.
+ * Every switch is announced to the tags with ESL_CMD_TIMING first.
+ */
+void adaptive_start(void);
+
+/**
+ * @brief Allow or stop interval switching, stopping returns to the slow interval
+ */
+void adaptive_enable(bool enable);
+
+bool adaptive_is_enabled(void);
+
+void adaptive_get_stats(struct adaptive_stats *stats);
+
+#endif /* ADAPTIVE_H__ */
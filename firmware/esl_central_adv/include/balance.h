@@ -0,0 +1,76 @@
+#ifndef BALANCE_H__
+#define BALANCE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pawr_config.h"
+
+/* Seconds over which traffic is counted before it is folded into the loads */
+#define BALANCE_PERIOD_S 30
+/* Gap between the busiest and the quietest subevent worth moving a tag for,
+ * in bytes per period
+ */
+#define BALANCE_MIN_GAP 256
+
+struct balance_stats {
+	/* Moves asked of the onboarding thread, and the ones the tag carried out */
+	uint32_t requested;
+	uint32_t moved;
+	/* Bytes per period of each subevent, as of the last fold */
+	uint32_t load[NUM_SUBEVENTS];
+};
+
+/**
+ * @brief Count traffic to or from a tag
+ *
+ * Called from the data request and response callbacks, a single atomic add.
+ *
+ * @param tag Tag index, see TAG_ID()
+ * @param bytes Command or response bytes on air
+ */
+void balance_count(uint16_t tag, uint16_t bytes);
+
+/**
+ * @brief Traffic of a subevent's tags, in bytes per period
+ *
+ * A running average over a few periods, so a tag's traffic class follows
+ * what it does lately rather than a single busy moment.
+ */
+uint32_t balance_subevent_load(uint8_t subevent);
+
+/**
+ * @brief Traffic of one tag, in bytes per period
+ */
+uint32_t balance_tag_load(uint16_t tag);
+
+/**
+ * @brief Carry a tag's load over to its new slot, see onboarding_move()
+ */
+void balance_moved(uint16_t from, uint16_t to);
+
+/**
+ * @brief Move one tag from the busiest subevent to the quietest one of its train
+ *
+ * Only registered tags outside groups that have nothing queued, in flight or
+ * being streamed are moved, so nothing is lost on the way. The tag picked is
+ * the one whose load comes closest to splitting the difference.
+ *
+ * @return int 0 if a move was requested, -EALREADY if the subevents are close
+ *         enough, -ENOENT if no tag qualifies, error from onboarding_move()
+ *         otherwise
+ */
+int balance_run(void);
+
+/**
+ * @brief Start folding loads every BALANCE_PERIOD_S, and moving tags if enabled
+ */
+void balance_start(void);
+
+void balance_enable(bool enable);
+
+bool balance_is_enabled(void);
+
+void balance_get_stats(struct balance_stats *stats);
+
+#endif /* BALANCE_H__ */
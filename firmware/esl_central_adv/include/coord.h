@@ -0,0 +1,161 @@
+#ifndef COORD_H__
+#define COORD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/toolchain.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/bluetooth/addr.h>
+
+/*
+ * Coordination between centrals covering overlapping areas
+ *
+ * Centrals exchange frames over the UART chosen as esl,coord-uart in the
+ * devicetree, UARTE21 in the nrf54l15dk and nrf54l15bsim overlays in boards/:
+ *
+ *     / { chosen { esl,coord-uart = &uart21; }; };
+ *
+ * The link is a shared medium: every frame goes to every other central, over
+ * a bus, a hub relaying between point to point links, or in simulation the
+ * hub in firmware/coord_sim relaying between simulated centrals' UARTs and
+ * local sockets. Without the chosen node, or without peers on the link, the
+ * central works on its own as before.
+ *
+ * Frame: COORD_SOF, then struct coord_hdr, the payload and a CRC-16/CCITT
+ * (crc16_itu_t() seeded with 0xFFFF) over header and payload, little endian.
+ */
+#define COORD_SOF 0xE5
+
+/* struct coord_hello, every COORD_HELLO_MS */
+#define COORD_HELLO 0x01
+/* struct coord_claim, when a tag is heard advertising */
+#define COORD_CLAIM 0x02
+
+#define COORD_PAYLOAD_MAX 16
+
+#define COORD_HELLO_MS        1000
+/* A central not heard from for this long is gone */
+#define COORD_PEER_TIMEOUT_MS 5000
+#define COORD_MAX_PEERS       7
+/* Claims for a tag are collected this long before the best one wins */
+#define COORD_CLAIM_MS        300
+/* How long the outcome holds before the tag can be claimed again */
+#define COORD_VERDICT_MS      10000
+/* Added to the claim of the central the tag is registered with */
+#define COORD_OWNER_BONUS_DB  6
+/* Tags answering weaker than this are released to the other centrals */
+#define COORD_WEAK_RSSI       -85
+/* Checks in a row below COORD_WEAK_RSSI before a tag is released */
+#define COORD_WEAK_CHECKS     3
+#define COORD_CHECK_MS        5000
+/* Least time between two restarts of the trains to move their anchors */
+#define COORD_ALIGN_HOLDOFF_S 600
+
+struct coord_hdr {
+	uint8_t len;
+	uint8_t type;
+	/* Sender's id, the low four bytes of its identity address */
+	uint32_t sender;
+} __packed;
+
+struct coord_hello {
+	/* Timing every train of the sender runs, see pawr_params_get() */
+	uint16_t interval;
+	uint8_t subevent_interval;
+	uint8_t trains;
+	uint16_t tags;
+	/* Time since the last event of the sender's first train, in us */
+	uint32_t phase_us;
+} __packed;
+
+/* The sender has the tag registered, see COORD_OWNER_BONUS_DB */
+#define COORD_CLAIM_OWNER BIT(0)
+
+struct coord_claim {
+	bt_addr_le_t addr;
+	int8_t rssi;
+	uint8_t flags;
+} __packed;
+
+BUILD_ASSERT(sizeof(struct coord_hello) <= COORD_PAYLOAD_MAX &&
+	     sizeof(struct coord_claim) <= COORD_PAYLOAD_MAX);
+
+struct coord_peer {
+	uint32_t id;
+	/* Since last heard from */
+	uint32_t age_ms;
+	struct coord_hello hello;
+};
+
+struct coord_stats {
+	uint32_t id;
+	uint8_t peers;
+	/* Tags claimed, and the claims that won or lost */
+	uint32_t claimed;
+	uint32_t won;
+	uint32_t lost;
+	/* Tags told to go to another central, and registered ones given up */
+	uint32_t released;
+	uint32_t handed_over;
+	/* Restarts of the trains, and the anchor error at the last check */
+	uint32_t realigns;
+	int32_t phase_error_us;
+	/* Frames dropped for a bad CRC or a full queue */
+	uint32_t dropped;
+};
+
+/**
+ * @brief Start coordinating with the other centrals
+ *
+ * Call after bt_enable() and the trains have been started.
+ *
+ * Ownership: a central hearing an unknown or lost tag advertise claims it
+ * with the RSSI it heard it at, plus COORD_OWNER_BONUS_DB if the tag is
+ * registered with it. After COORD_CLAIM_MS every central has seen the same
+ * claims, and the best one, ties going to the lowest id, onboards the tag.
+ * A central that had the tag registered and lost gives its slot up.
+ *
+ * Handover: a tag answering below COORD_WEAK_RSSI for COORD_WEAK_CHECKS
+ * checks in a row is sent ESL_CMD_RELEASE, as long as there are peers, and
+ * advertises to be claimed again. It is not released again before its RSSI
+ * recovers, so a tag no other central hears better stays put.
+ *
+ * Anchors: the central with the lowest id is the reference. The others
+ * restart their trains, after telling their tags with ESL_CMD_TIMING, so the
+ * trains of all centrals interleave within each subevent interval in id
+ * order, like the trains of one central do. Only between centrals running
+ * the same timing, and at most every COORD_ALIGN_HOLDOFF_S.
+ *
+ * @return int 0 on success, -ENODEV if there is no coordination link
+ */
+int coord_start(void);
+
+/**
+ * @brief Claim a tag heard advertising, called from the scan callback
+ *
+ * @param addr Tag address
+ * @param rssi RSSI the advertisement was received at
+ * @param owner Whether the tag is registered with this central
+ * @return int 0 to go ahead and onboard it, -EINPROGRESS while claims are
+ *         collected, -EPERM if another central won it
+ */
+int coord_claim(const bt_addr_le_t *addr, int8_t rssi, bool owner);
+
+/**
+ * @brief Check whether a claim of ours is undecided or won and not yet expired
+ *
+ * Keeps onboarding scanning, so a tag we claimed or won is heard again.
+ */
+bool coord_claims_pending(void);
+
+/**
+ * @brief Copy out a peer
+ *
+ * @param index From 0 up
+ * @return int 0 on success, -ENOENT past the last peer
+ */
+int coord_get_peer(uint8_t index, struct coord_peer *peer);
+
+void coord_get_stats(struct coord_stats *stats);
+
+#endif /* COORD_H__ */
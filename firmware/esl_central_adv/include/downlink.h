@@ -0,0 +1,233 @@
+#ifndef DOWNLINK_H__
+#define DOWNLINK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/net/buf.h>
+
+#include "pawr_config.h"
+#include "esl_packets.h"
+
+/* Largest command body that can be queued for a single tag, an image chunk */
+#define DOWNLINK_CMD_DATA_MAX (sizeof(struct esl_img_chunk) + ESL_IMG_CHUNK_LEN)
+/* Number of commands that can be pending across all tags */
+#define DOWNLINK_CMD_POOL_SIZE 64
+/* Retransmissions of an unacknowledged event before its commands are dropped */
+#define DOWNLINK_MAX_RETRIES 5
+/* Events in a row with nothing to send before a lent subevent is taken back */
+#define DOWNLINK_BURST_IDLE 4
+/* Events between sleep hints, the longest a new command waits for an idle tag */
+#define DOWNLINK_HINT_EVENTS 8
+
+struct downlink_subevent_stats {
+	/* Payload bytes placed in the most recent event for this subevent */
+	uint16_t bytes_last;
+	/* Payload bytes placed since boot */
+	uint32_t bytes_total;
+	/* Events that carried at least one command */
+	uint32_t events_used;
+	/* Events sent with an empty payload because nothing was queued */
+	uint32_t events_empty;
+};
+
+struct downlink_stats {
+	uint32_t queued;
+	uint32_t sent;
+	uint32_t dropped;
+	/* Commands confirmed by a response from the tag */
+	uint32_t acked;
+	/* Commands put back on the queue after a missed response */
+	uint32_t retried;
+	/* Commands given up on after DOWNLINK_MAX_RETRIES */
+	uint32_t expired;
+	/* Subevents lent with downlink_burst(), and commands sent in them */
+	uint32_t bursts;
+	uint32_t burst_sent;
+	/* ESL_CMD_PENDING hints sent */
+	uint32_t hints;
+	/* Commands currently waiting across all tags */
+	uint16_t queue_depth;
+	uint16_t queue_depth_max;
+	struct downlink_subevent_stats subevent[NUM_SUBEVENTS];
+};
+
+/**
+ * @brief Queue a command for a tag
+ *
+ * @param tag Tag index, see TAG_ID()
+ * @param type Command type (ESL_CMD_*)
+ * @param data Command body
+ * @param len Length of the command body
+ * @return int 0 on success, -EINVAL on bad arguments, -ENOMEM if the pool is exhausted
+ */
+int downlink_enqueue(uint16_t tag, uint8_t type, const void *data, uint8_t len);
+
+/**
+ * @brief Queue a command for several tags of one subevent
+ *
+ * The command is sent once to @p addr for all of them, and sent again until
+ * every tag in @p members has answered after it, up to DOWNLINK_MAX_RETRIES
+ * times. It goes out ahead of commands queued for single tags.
+ *
+ * @param subevent Subevent of the tags
+ * @param addr ESL_ADDR_GROUP() or ESL_ADDR_BROADCAST
+ * @param members Response slots of the tags, BIT(slot) each
+ * @param type Command type (ESL_CMD_*)
+ * @param data Command body
+ * @param len Length of the command body
+ * @return int 0 on success, -EINVAL on bad arguments, -ENOMEM if the pool is exhausted
+ */
+int downlink_enqueue_multicast(uint8_t subevent, uint8_t addr, uint16_t members, uint8_t type,
+			       const void *data, uint8_t len);
+
+/**
+ * @brief Lend a tag a second subevent while it has a lot queued
+ *
+ * The tag is told with ESL_CMD_LISTEN to also receive the least busy other
+ * subevent, where its queue is drained to ESL_ADDR_BURST after the
+ * subevent's own tags have been served. Each subevent keeps one event's worth
+ * in flight and they are acknowledged separately, so commands can arrive out
+ * of order: only use it while the queue holds commands that do not depend on
+ * each other, such as image chunks. The subevent is taken back after
+ * DOWNLINK_BURST_IDLE events with nothing to send, the tag gives it up after
+ * twice as many.
+ *
+ * @param tag Tag index
+ * @return int 0 on success or if the tag already has one, -EINVAL on bad
+ *         arguments, -EBUSY if every other subevent is lent out, error from
+ *         downlink_enqueue() otherwise
+ */
+int downlink_burst(uint16_t tag);
+
+/**
+ * @brief Subevent a tag is receiving from besides its own
+ *
+ * @return uint8_t Subevent, ESL_SUBEVENT_NONE if the tag has none or has not
+ *         confirmed it yet
+ */
+uint8_t downlink_burst_subevent(uint16_t tag);
+
+/**
+ * @brief Drop every command queued for a tag
+ *
+ * Multicast commands stop waiting for the tag.
+ *
+ * @param tag Tag index
+ */
+void downlink_flush(uint16_t tag);
+
+/**
+ * @brief Count a reported response slot, answered or not
+ *
+ * Called for every response slot the controller reports, before
+ * downlink_ack() or downlink_nack(). Keeps track of which event the
+ * responses belong to.
+ *
+ * @param tag Tag index
+ */
+void downlink_report(uint16_t tag);
+
+/**
+ * @brief Acknowledge the commands in flight to a tag
+ *
+ * Called when the tag answered in its response slot, which it only does after
+ * receiving the subevent. Only acknowledges commands sent in the event
+ * answered or before, not ones built for a later event.
+ *
+ * @param tag Tag index
+ */
+void downlink_ack(uint16_t tag);
+
+/**
+ * @brief Process the records of a response from a tag
+ *
+ * Acknowledges what was sent in the subevent lent to the tag, see
+ * downlink_burst(). Called after downlink_ack() for the same response.
+ *
+ * @param tag Tag index
+ * @param buf Response payload
+ */
+void downlink_ingest(uint16_t tag, const struct net_buf_simple *buf);
+
+/**
+ * @brief Report a failed response from a tag
+ *
+ * Commands in flight are put back at the head of the tag's queue and resent
+ * with exponential backoff, up to DOWNLINK_MAX_RETRIES times. A miss in an
+ * event before the commands went out is ignored.
+ *
+ * @param tag Tag index
+ */
+void downlink_nack(uint16_t tag);
+
+/**
+ * @brief Broadcast a command in every subevent for a number of events
+ *
+ * The command goes out to ESL_ADDR_BROADCAST ahead of the tag queues. Its last
+ * data byte is overwritten with the number of events of the subevent still to
+ * carry it, 0 in the last one, so tags can tell when the repeats end.
+ * Broadcasts are not acknowledged. Tags a hint let sleep only listen again
+ * for the next hint, so the command is sent until every subevent has carried
+ * one with it. That can take up to DOWNLINK_HINT_EVENTS events, however few
+ * were asked for; downlink_announcing() tells when it is done.
+ *
+ * @param type Command type (ESL_CMD_*)
+ * @param data Command body, the last byte is the countdown
+ * @param len Length of the command body
+ * @param events Number of events per subevent to send the command in
+ * @return int 0 on success, -EINVAL on bad arguments, -EBUSY if the previous
+ *         broadcast is still going out
+ */
+int downlink_announce(uint8_t type, const void *data, uint8_t len, uint8_t events);
+
+/**
+ * @brief Check whether a broadcast from downlink_announce() is still going out
+ */
+bool downlink_announcing(void);
+
+/**
+ * @brief Check whether a tag was told it can sleep until the next hint
+ *
+ * Such a tag is not expected to answer in its response slot.
+ */
+bool downlink_asleep(uint16_t tag);
+
+/**
+ * @brief Check that nothing is queued or waiting for an acknowledgement
+ */
+bool downlink_idle(void);
+
+/**
+ * @brief Fill the payload for one subevent from the pending queues
+ *
+ * Called from the PAwR data request callback. Tags in the subevent are served
+ * round-robin until the buffer is full, skipping tags that are waiting for an
+ * acknowledgement or backing off, then a tag the subevent is lent to fills
+ * what is left. Every DOWNLINK_HINT_EVENTS events the payload starts with an
+ * ESL_CMD_PENDING hint, and tags it lets sleep are skipped until the next.
+ * Commands not acknowledged within two events are retried. When nothing is
+ * queued the buffer is left empty.
+ *
+ * @param subevent Subevent the payload is for
+ * @param buf Buffer to fill, reset by the caller
+ */
+void downlink_build_subevent(uint8_t subevent, struct net_buf_simple *buf);
+
+/**
+ * @brief Check whether anything is queued for a subevent
+ */
+bool downlink_subevent_pending(uint8_t subevent);
+
+/**
+ * @brief Number of commands queued for a tag
+ */
+uint8_t downlink_queue_depth(uint16_t tag);
+
+/**
+ * @brief Number of commands sent to a tag and not yet acknowledged
+ */
+uint8_t downlink_inflight(uint16_t tag);
+
+void downlink_get_stats(struct downlink_stats *stats);
+
+#endif /* DOWNLINK_H__ */
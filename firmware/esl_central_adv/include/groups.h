@@ -0,0 +1,72 @@
+#ifndef GROUPS_H__
+#define GROUPS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pawr_config.h"
+#include "esl_packets.h"
+
+/**
+ * @brief Record a tag that has been given a slot
+ *
+ * @param tag Tag index, see TAG_ID()
+ * @param group Group the tag is told about, ESL_GROUP_NONE for none
+ */
+void groups_assign(uint16_t tag, uint8_t group);
+
+/**
+ * @brief Forget a tag whose slot was freed
+ */
+void groups_release(uint16_t tag);
+
+/**
+ * @brief Forget every tag, called when all slots are freed
+ */
+void groups_reset(void);
+
+/**
+ * @brief Group of a tag, ESL_GROUP_NONE if it is in none or has no slot
+ */
+uint8_t groups_get(uint16_t tag);
+
+/**
+ * @brief Tags of a subevent in a group
+ *
+ * @return uint16_t BIT(slot) for every member
+ */
+uint16_t groups_members(uint8_t group, uint8_t subevent);
+
+/**
+ * @brief Move a tag to another group
+ *
+ * The tag is told with ESL_CMD_SET_GROUP and keeps its subevent, so the new
+ * group may span more subevents than it did.
+ *
+ * @param tag Tag index
+ * @param group New group, ESL_GROUP_NONE to leave the current one
+ * @return int 0 on success, -EINVAL on bad arguments, -ENOENT if the tag has
+ *         no slot, error from downlink_enqueue() otherwise
+ */
+int groups_move(uint16_t tag, uint8_t group);
+
+/**
+ * @brief Send a command to every member of a group
+ *
+ * One multicast command is queued per subevent the group spans.
+ *
+ * @return int Number of transmissions queued, -EINVAL on bad arguments,
+ *         -ENOENT if the group has no members, error from
+ *         downlink_enqueue_multicast() otherwise
+ */
+int groups_send(uint8_t group, uint8_t type, const void *data, uint8_t len);
+
+/**
+ * @brief Send a command to every tag that has a slot
+ *
+ * Like groups_send() with ESL_ADDR_BROADCAST, one transmission per subevent
+ * in use.
+ */
+int groups_broadcast(uint8_t type, const void *data, uint8_t len);
+
+#endif /* GROUPS_H__ */
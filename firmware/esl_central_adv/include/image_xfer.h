@@ -0,0 +1,117 @@
+#ifndef IMAGE_XFER_H__
+#define IMAGE_XFER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/net/buf.h>
+
+#include "pawr_config.h"
+
+/* Transfers that can be in progress at once */
+#define IMAGE_XFER_MAX    4
+/* Chunks queued or in flight per tag, keeps one transfer from draining the pool.
+ * Covers a batch in flight in both the home and a lent subevent.
+ */
+#define IMAGE_XFER_WINDOW 6
+/* Transfers with more chunks than this borrow a second subevent */
+#define IMAGE_XFER_BURST_CHUNKS 4
+/* Passes over the missing chunks before a transfer is given up on */
+#define IMAGE_XFER_MAX_ROUNDS 8
+/* Sync timeouts without a response before the tag is taken as lost */
+#define IMAGE_XFER_LOST_TIMEOUTS 16
+
+struct image_xfer_progress {
+	uint8_t image_id;
+	uint8_t received;
+	uint8_t num_chunks;
+	uint8_t round;
+	uint32_t elapsed_ms;
+};
+
+struct image_xfer_stats {
+	uint32_t started;
+	uint32_t completed;
+	uint32_t failed;
+	uint32_t chunks_sent;
+	/* Chunks sent again after the tag reported them missing */
+	uint32_t chunks_resent;
+	/* Deltas the tag had no base for, sent again in full */
+	uint32_t rejected;
+	/* Frame bytes of started transfers, and chunk data to send them once */
+	uint32_t image_bytes;
+	uint32_t coded_bytes;
+	/* Start command to the tag's last chunk, of completed transfers */
+	uint32_t last_ms;
+	uint64_t total_ms;
+};
+
+/**
+ * @brief Send an image to a tag
+ *
+ * The frame is run-length coded, or sent as is if that does not save a chunk.
+ * With a base frame the XOR against it is coded instead, which only carries
+ * what changed; if the tag does not show the base the frame is sent again in
+ * full.
+ *
+ * Chunks are fed to the downlink queue a few at a time as the tag
+ * acknowledges them, through a second subevent as well for larger transfers
+ * (see downlink_burst()). After every chunk has been sent once, the ones the
+ * tag reports missing are sent again, up to IMAGE_XFER_MAX_ROUNDS times.
+ * The transfer fails if the tag stops responding for IMAGE_XFER_LOST_TIMEOUTS
+ * sync timeouts or the frame it put together does not match the crc, and is
+ * aborted if the tag is forgotten or moves.
+ *
+ * @param tag Tag index, see TAG_ID()
+ * @param image Frame in the ESL_IMG_* layout, must stay valid until the
+ *              transfer ends
+ * @param base Frame the tag shows, or NULL. Must stay valid until the
+ *             transfer ends
+ * @param size Length of @p image and @p base, at most ESL_IMG_SIZE
+ * @return int 0 on success, -EINVAL on bad arguments, -EBUSY if the tag is
+ *         already receiving an image, -ENOMEM if IMAGE_XFER_MAX are running
+ */
+int image_xfer_start(uint16_t tag, const uint8_t *image, const uint8_t *base, uint16_t size);
+
+/**
+ * @brief Stop sending to a tag, chunks already queued still go out
+ */
+void image_xfer_abort(uint16_t tag);
+
+/**
+ * @brief Handle a response from a tag, called from the PAwR response callback
+ *
+ * @param tag Tag index
+ * @param buf Response payload
+ */
+void image_xfer_ingest(uint16_t tag, const struct net_buf_simple *buf);
+
+/**
+ * @brief Send an area of a frame to be drawn straight to a tag's panel
+ *
+ * Far cheaper than a full transfer for a change to a single field. The area
+ * is sent as ESL_CMD_RECT commands small enough for the downlink queue, which
+ * copies them, so @p image can change as soon as this returns.
+ *
+ * @param tag Tag index, see TAG_ID()
+ * @param image Frame in the ESL_IMG_* layout
+ * @param x Left edge of the area
+ * @param y Top edge of the area, a multiple of ESL_RECT_ALIGN
+ * @param width Width of the area
+ * @param height Height of the area, a multiple of ESL_RECT_ALIGN
+ * @return int 0 on success, -EINVAL on bad arguments, error from
+ *         downlink_enqueue() otherwise, in which case part of the area may
+ *         have been queued
+ */
+int image_xfer_send_rect(uint16_t tag, const uint8_t *image, uint8_t x, uint8_t y,
+			 uint8_t width, uint8_t height);
+
+/**
+ * @brief Progress of the transfer to a tag
+ *
+ * @return int 0 on success, -ENOENT if nothing is being sent to the tag
+ */
+int image_xfer_get_progress(uint16_t tag, struct image_xfer_progress *progress);
+
+void image_xfer_get_stats(struct image_xfer_stats *stats);
+
+#endif /* IMAGE_XFER_H__ */
@@ -0,0 +1,132 @@
+#ifndef ONBOARDING_H__
+#define ONBOARDING_H__
+
+#include <stdint.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+#include "pawr_config.h"
+
+/* Passed to onboarding_forget() for every tag */
+#define ONBOARDING_FORGET_ALL UINT16_MAX
+
+struct onboarding_stats {
+	/* Tags whose sync was confirmed before the connection was closed */
+	uint32_t onboarded;
+	/* Tags that were configured but not seen in their slot before the timeout */
+	uint32_t unconfirmed;
+	uint32_t failed;
+	/* Timing writes that skipped discovery thanks to the handle cache */
+	uint32_t cache_hits;
+	uint32_t cache_misses;
+	/* Connections opened so far, including the ones in progress */
+	uint32_t started;
+	/* Connections currently being worked on */
+	uint8_t active;
+	/* Sum of connect-to-disconnect time of all configured tags */
+	uint64_t conn_time_ms;
+	/* Uptime of the first and most recent completed onboarding */
+	int64_t first_ms;
+	int64_t last_ms;
+};
+
+/**
+ * @brief Onboard tags into the slots of the current timing, does not return
+ *
+ * Keeps up to CONFIG_BT_MAX_CONN connections going at once. Each one sends
+ * PAST, writes the tag's subevent and response slot, and is closed as soon as
+ * the tag notifies that it has synced, shows up in its slot, or
+ * pawr_params_sync_timeout_ms() passes. Scanning stops while every slot is
+ * assigned and no registered tag has gone quiet.
+ *
+ * Tags are registered by address once their timing is written, see
+ * registry.h. A registered tag that comes back advertising gets its old slot
+ * and group, also after the central restarts.
+ *
+ * PAST hands over the train of the tag's slot, see pawr_params_adv().
+ */
+void onboarding_run(void);
+
+/**
+ * @brief Free every slot, called after the PAwR timing has changed
+ *
+ * Connections in progress are closed and tags are onboarded again as they
+ * lose sync and start advertising. Registered tags keep their slots if the
+ * new timing still has them.
+ *
+ * @return int 0 on success, -EAGAIN if the onboarding thread is not keeping up
+ */
+int onboarding_reset(void);
+
+/**
+ * @brief Free the slot of a registered tag and forget its address
+ *
+ * For tags taken out of service; one that is still synced keeps answering in
+ * the slot until it is given to another tag. Tags being onboarded are skipped.
+ *
+ * @param tag Tag index, or ONBOARDING_FORGET_ALL
+ * @return int 0 on success, -EINVAL if @p tag is out of range, -EAGAIN if the
+ *         onboarding thread is not keeping up
+ */
+int onboarding_forget(uint16_t tag);
+
+/**
+ * @brief Move a registered tag to a free slot of another subevent of its train
+ *
+ * The tag is sent ESL_CMD_MOVE in its current slot. Once it answers in the
+ * new one, its registration, group and load follow it and the old slot is
+ * freed. If it does not show up there within a few sync timeouts the move is
+ * abandoned. Only one tag is moved at a time, others are ignored meanwhile,
+ * as are tags being onboarded, subevents without a free slot and subevents
+ * of other trains.
+ *
+ * @param tag Tag index
+ * @param subevent Subevent to move to
+ * @return int 0 if the move was queued, -EINVAL on bad arguments, -EAGAIN if
+ *         the onboarding thread is not keeping up
+ */
+int onboarding_move(uint16_t tag, uint8_t subevent);
+
+/**
+ * @brief Hold off new connections while a timing change is announced
+ *
+ * A tag onboarded after the notice went out would be handed the old train.
+ * Connections already in progress carry on, callers check
+ * onboarding_stats.active and onboarding_stats.started around the change.
+ * Calls nest, each onboarding_pause() needs an onboarding_resume().
+ */
+void onboarding_pause(void);
+
+void onboarding_resume(void);
+
+/**
+ * @brief Report a response from a tag, called from the PAwR response callback
+ *
+ * @param tag Tag index, see TAG_ID()
+ */
+void onboarding_tag_responded(uint16_t tag);
+
+/**
+ * @brief Check whether a slot is handed out, registered tags included
+ *
+ * A single bit test, safe from the PAwR response callback.
+ *
+ * @param tag Tag index, see TAG_ID()
+ */
+bool onboarding_slot_assigned(uint16_t tag);
+
+/**
+ * @brief Put tags onboarded from now on in a group
+ *
+ * The group goes out with the timing write. Members are placed in subevents
+ * that already hold members, or in empty ones, while there is room.
+ *
+ * @param group Group id, ESL_GROUP_NONE for no group
+ * @return int 0 on success, -EINVAL if @p group is out of range
+ */
+int onboarding_set_group(uint8_t group);
+
+uint8_t onboarding_get_group(void);
+
+void onboarding_get_stats(struct onboarding_stats *stats);
+
+#endif /* ONBOARDING_H__ */
@@ -0,0 +1,35 @@
+#ifndef PAWR_CONFIG_H__
+#define PAWR_CONFIG_H__
+
+#include <stdint.h>
+#include <zephyr/toolchain.h>
+
+#define NUM_RSP_SLOTS 10
+/* Periodic advertising sets run side by side, each its own PAwR train */
+#define NUM_TRAINS      2
+/* Subevents of one train */
+#define TRAIN_SUBEVENTS 10
+/* Subevents of every train, numbered train by train. Per-subevent tables use
+ * this numbering, tags are only ever told the number within their train.
+ */
+#define NUM_SUBEVENTS (NUM_TRAINS * TRAIN_SUBEVENTS)
+#define MAX_SYNCS     (NUM_SUBEVENTS * NUM_RSP_SLOTS)
+
+#define SUBEVENT_ID(train, subevent) ((uint8_t)((train) * TRAIN_SUBEVENTS + (subevent)))
+#define SUBEVENT_TRAIN(subevent)     ((uint8_t)((subevent) / TRAIN_SUBEVENTS))
+#define SUBEVENT_LOCAL(subevent)     ((uint8_t)((subevent) % TRAIN_SUBEVENTS))
+
+/* Index into the per-tag tables for a (subevent, response slot) assignment */
+#define TAG_ID(subevent, slot) ((uint16_t)((subevent) * NUM_RSP_SLOTS + (slot)))
+#define TAG_SUBEVENT(tag)      ((uint8_t)((tag) / NUM_RSP_SLOTS))
+#define TAG_RSP_SLOT(tag)      ((uint8_t)((tag) % NUM_RSP_SLOTS))
+
+/* Written to the tag's PAwR characteristic during onboarding */
+struct pawr_timing {
+	uint8_t subevent;
+	uint8_t response_slot;
+	/* ESL_GROUP_NONE if the tag is in no group */
+	uint8_t group;
+} __packed;
+
+#endif /* PAWR_CONFIG_H__ */
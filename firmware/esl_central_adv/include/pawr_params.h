@@ -0,0 +1,185 @@
+#ifndef PAWR_PARAMS_H__
+#define PAWR_PARAMS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+#include "pawr_config.h"
+
+/* Most trains pawr_params_capacity() plans with, whatever the build supports */
+#define PAWR_CAPACITY_TRAINS_MAX 32
+
+/** @brief Capacity estimate from pawr_params_capacity() */
+struct pawr_capacity {
+	/* Fewest trains that hold the tags within the budget */
+	uint8_t trains;
+	/* Advertising sets the host was built for */
+	uint8_t trains_max;
+	uint16_t tags_per_train;
+	/* Timing each train would run, interval in 1.25ms units */
+	uint16_t interval;
+	uint8_t subevents;
+	uint8_t response_slots;
+	/* Share of the interval one train keeps the radio busy */
+	uint16_t busy_permille;
+	/* Share of the trains' busy airtime that another train also wants */
+	uint16_t collide_permille;
+};
+
+/**
+ * @brief Program the default timing on every train's advertising set
+ *
+ * Must be called once, before periodic advertising is started.
+ *
+ * @param adv PAwR advertising sets, one per train
+ * @return int 0 on success, negative error code from the host otherwise
+ */
+int pawr_params_init(struct bt_le_ext_adv *const adv[NUM_TRAINS]);
+
+/**
+ * @brief Start periodic and extended advertising on every train
+ *
+ * Each train is started a fraction of a subevent interval after the one
+ * before, so their subevents interleave rather than collide. Blocks for up to
+ * one subevent interval.
+ *
+ * @return int 0 on success, negative error code from the host otherwise
+ */
+int pawr_params_start(void);
+
+/**
+ * @brief Restart every train a while from now, to move their anchors
+ *
+ * Tags lose sync unless they were told with ESL_CMD_TIMING first, like for an
+ * interval change. Blocks for @p delay_us plus the stagger of the trains.
+ *
+ * @param delay_us Time from stopping the trains to starting the first one
+ * @return int 0 on success, -EALREADY if the trains were not running,
+ *         negative error code from the host otherwise
+ */
+int pawr_params_realign(uint32_t delay_us);
+
+/**
+ * @brief Time since the last event of the first train, in us
+ *
+ * Counted from when the train was started, so off by the controller's start
+ * latency and drifting with its clock. 0 before the trains are started.
+ */
+uint32_t pawr_params_phase_us(void);
+
+/**
+ * @brief Advertising set of a train, NULL before pawr_params_init()
+ */
+struct bt_le_ext_adv *pawr_params_adv(uint8_t train);
+
+/**
+ * @brief Train an advertising set runs
+ *
+ * @return int Train number, -ENOENT if the set is not a train
+ */
+int pawr_params_train(const struct bt_le_ext_adv *adv);
+
+/**
+ * @brief Timing currently programmed on every train
+ */
+const struct bt_le_per_adv_param *pawr_params_get(void);
+
+/**
+ * @brief Check timing against the specification and the table sizes
+ *
+ * Applies the same constraints as the build time checks on the defaults, and
+ * that the subevent and response slot counts fit TRAIN_SUBEVENTS and
+ * NUM_RSP_SLOTS. The first violated constraint is logged.
+ *
+ * @return int 0 if valid, -EINVAL otherwise
+ */
+int pawr_params_check(const struct bt_le_per_adv_param *param);
+
+/**
+ * @brief Compute timing for a tag count and latency budget
+ *
+ * The tags are shared out over every train. Uses as few subevents per train
+ * as possible, since each one costs a response slot delay on top of its slots,
+ * and stretches the interval to the whole budget so tags wake as rarely as the
+ * budget allows.
+ *
+ * @param tags Number of tags that need a response slot
+ * @param latency_ms Longest acceptable time between two events for a tag
+ * @param param Computed timing
+ * @return int 0 on success, -EINVAL if @p tags does not fit the tables,
+ *         -ERANGE if the tags do not fit in the budget
+ */
+int pawr_params_plan(uint16_t tags, uint32_t latency_ms, struct bt_le_per_adv_param *param);
+
+/**
+ * @brief Estimate how many trains a tag count needs and how much they collide
+ *
+ * Plans the fewest trains that hold the tags within the budget, up to
+ * PAWR_CAPACITY_TRAINS_MAX whatever number of advertising sets the host was
+ * built for, and works out how much of their airtime overlaps when they are
+ * started staggered as pawr_params_start() does.
+ * The controller can only serve one train at a time, so colliding airtime is
+ * where subevents get dropped or pushed back. Changes nothing.
+ *
+ * @param tags Number of tags that need a response slot
+ * @param latency_ms Longest acceptable time between two events for a tag
+ * @param out Estimate
+ * @return int 0 on success, -EINVAL if @p tags is 0, -ERANGE if no plan
+ *         holds the tags within the budget
+ */
+int pawr_params_capacity(uint16_t tags, uint32_t latency_ms, struct pawr_capacity *out);
+
+/**
+ * @brief Reprogram every train with new timing
+ *
+ * Becomes the configured timing. Periodic advertising is stopped while the
+ * parameters are changed. Synced tags lose sync and have to be onboarded
+ * again.
+ *
+ * @return int 0 on success, -EINVAL if the timing is invalid, negative error
+ *         code from the host otherwise, in which case the old timing is kept
+ */
+int pawr_params_apply(const struct bt_le_per_adv_param *param);
+
+/**
+ * @brief Periodic advertising interval of the configured or the fast timing
+ *
+ * @param fast Whether to give the fast interval
+ * @return uint16_t Interval in 1.25ms units
+ */
+uint16_t pawr_params_interval(bool fast);
+
+/**
+ * @brief Switch between the configured timing and its fast variant
+ *
+ * The fast variant keeps the subevent and response slot counts, so tags keep
+ * their slots, and packs the subevents back to back for the shortest interval
+ * the planner allows. Tags must have been told about the new interval with
+ * ESL_CMD_TIMING, otherwise they lose sync.
+ *
+ * @param fast Whether to program the fast variant
+ * @return int 0 on success, negative error code from the host otherwise
+ */
+int pawr_params_set_fast(bool fast);
+
+bool pawr_params_is_fast(void);
+
+/**
+ * @brief Check whether a subevent, numbered over all trains, is in the
+ *        current timing
+ */
+bool pawr_params_subevent_active(uint8_t subevent);
+
+/**
+ * @brief Check whether a tag index has a subevent and response slot in the
+ *        current timing
+ */
+bool pawr_params_tag_active(uint16_t tag);
+
+/**
+ * @brief How long to wait for a newly configured tag to show up in its slot
+ */
+uint32_t pawr_params_sync_timeout_ms(void);
+
+#endif /* PAWR_PARAMS_H__ */
@@ -0,0 +1,69 @@
+#ifndef REGISTRY_H__
+#define REGISTRY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <zephyr/bluetooth/addr.h>
+
+#include "pawr_config.h"
+
+/* Kept in settings under "reg/<tag>" */
+struct registry_entry {
+	bt_addr_le_t addr;
+	/* ESL_GROUP_NONE if the tag is in no group */
+	uint8_t group;
+} __packed;
+
+/**
+ * @brief Load the saved tags
+ *
+ * Initializes the settings subsystem, call once at boot before onboarding
+ * starts.
+ *
+ * @return int 0 on success, error from the settings subsystem otherwise
+ */
+int registry_init(void);
+
+/**
+ * @brief Tag index a device was given, constant time
+ *
+ * @return int Tag index, -ENOENT if the address is not registered
+ */
+int registry_lookup(const bt_addr_le_t *addr);
+
+/**
+ * @brief Copy out the device registered in a slot
+ *
+ * @return int 0 on success, -ENOENT if the slot is not registered
+ */
+int registry_get(uint16_t tag, struct registry_entry *entry);
+
+/**
+ * @brief Check whether a slot is registered, without locking
+ */
+bool registry_known(uint16_t tag);
+
+/**
+ * @brief Register a device in a slot and save it
+ *
+ * A device already in the slot, and the slot the address had before, are
+ * both dropped.
+ *
+ * @return int 0 on success, -EINVAL if @p tag is out of range, error from the
+ *         settings subsystem otherwise
+ */
+int registry_add(uint16_t tag, const bt_addr_le_t *addr, uint8_t group);
+
+/**
+ * @brief Forget the device in a slot
+ */
+void registry_remove(uint16_t tag);
+
+/**
+ * @brief Save a new group for a registered tag
+ */
+void registry_set_group(uint16_t tag, uint8_t group);
+
+uint16_t registry_count(void);
+
+#endif /* REGISTRY_H__ */
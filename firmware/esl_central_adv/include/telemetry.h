@@ -0,0 +1,73 @@
+#ifndef TELEMETRY_H__
+#define TELEMETRY_H__
+
+#include <stdint.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+#include "pawr_config.h"
+
+struct telemetry_tag {
+	/* Hundredths of a degree Celsius / percent relative humidity */
+	int16_t temperature;
+	uint16_t humidity;
+	int8_t rssi;
+	/* Subevent event count at the last response, see telemetry_subevent_event() */
+	uint16_t event_counter;
+	uint16_t missed;
+};
+
+struct telemetry_summary {
+	uint16_t tags_seen;
+	int16_t temperature_min;
+	int16_t temperature_max;
+	int16_t temperature_avg;
+	uint16_t humidity_avg;
+	int8_t rssi_min;
+	uint32_t responses;
+	uint32_t missed;
+};
+
+/**
+ * @brief Count a transmitted event for a subevent
+ *
+ * Called from the PAwR data request callback, gives the event counter used to
+ * tell how stale each tag's last response is.
+ */
+void telemetry_subevent_event(uint8_t subevent);
+
+/**
+ * @brief Decode a response into the tag table, called from the response callback
+ *
+ * No logging and no parsing beyond a fixed layout check, this runs once per
+ * response slot.
+ *
+ * @param tag Tag owning the response slot, the info only has the subevent
+ *            number within the train
+ * @param info Response info from the controller
+ * @param buf Response payload, NULL if the controller failed to receive it.
+ *            Every NULL counts as a miss, so only pass it for slots that
+ *            have a tag.
+ */
+void telemetry_ingest(uint16_t tag, const struct bt_le_per_adv_response_info *info,
+		      const struct net_buf_simple *buf);
+
+/**
+ * @brief Copy out one tag's entry
+ *
+ * @return int 0 on success, -ENOENT if the tag never responded
+ */
+int telemetry_get(uint16_t tag, struct telemetry_tag *out);
+
+/**
+ * @brief Drop a slot's entry, when the slot no longer belongs to the same tag
+ */
+void telemetry_forget(uint16_t tag);
+
+/**
+ * @brief Events since the tag last responded
+ */
+uint16_t telemetry_age(uint16_t tag);
+
+void telemetry_summarize(struct telemetry_summary *summary);
+
+#endif /* TELEMETRY_H__ */
@@ -0,0 +1,170 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(adaptive, LOG_LEVEL_INF);
+
+#include "adaptive.h"
+#include "downlink.h"
+#include "onboarding.h"
+#include "pawr_params.h"
+#include "esl_packets.h"
+
+#define ADAPTIVE_STACK_SIZE 1024
+#define ADAPTIVE_PRIORITY   7
+#define ADAPTIVE_POLL_MS    100
+/* Copies of the timing notice, so one miss is survivable. More go out while
+ * tags are asleep, see downlink_announce().
+ */
+#define NOTICE_EVENTS 2
+/* Idle fast intervals before going back to the slow interval */
+#define IDLE_EVENTS 3
+
+/* Interval units of 1.25ms to milliseconds */
+#define INTERVAL_MS(interval) ((uint32_t)(interval) * 5 / 4)
+
+static atomic_t enabled = ATOMIC_INIT(1);
+static struct adaptive_stats stats;
+static int64_t fast_since;
+
+static void adaptive_thread(void *p1, void *p2, void *p3);
+
+K_THREAD_DEFINE(adaptive_tid, ADAPTIVE_STACK_SIZE, adaptive_thread, NULL, NULL, NULL,
+		ADAPTIVE_PRIORITY, 0, K_TICKS_FOREVER);
+
+static int switch_interval(bool fast)
+{
+	uint16_t old_interval = pawr_params_get()->interval_max;
+	struct esl_cmd_timing notice = {
+		.interval = sys_cpu_to_le16(pawr_params_interval(fast)),
+	};
+	struct onboarding_stats onboarding;
+	uint32_t started;
+	int64_t now;
+	int err;
+
+	if (pawr_params_interval(fast) == old_interval) {
+		/* The configured interval is already as short as it gets */
+		return -EALREADY;
+	}
+
+	/* Tags being onboarded are handed the current train and would miss the
+	 * notice, none are taken on until the switch is done.
+	 */
+	onboarding_get_stats(&onboarding);
+	if (onboarding.active) {
+		return -EBUSY;
+	}
+
+	onboarding_pause();
+	started = onboarding.started;
+
+	err = downlink_announce(ESL_CMD_TIMING, &notice, sizeof(notice), NOTICE_EVENTS);
+	if (err) {
+		goto out;
+	}
+
+	while (downlink_announcing()) {
+		k_msleep(ADAPTIVE_POLL_MS);
+	}
+
+	/* The last notice was handed to the controller ahead of its event, give
+	 * it an interval to go out. Tags resync no earlier than one interval
+	 * after the last notice they heard.
+	 */
+	k_msleep(INTERVAL_MS(old_interval));
+
+	/* A connection that got in just as onboarding paused */
+	onboarding_get_stats(&onboarding);
+	if (onboarding.active || onboarding.started != started) {
+		LOG_WRN("Tag onboarded during the notice, interval not switched");
+		err = -EBUSY;
+		goto out;
+	}
+
+	err = pawr_params_set_fast(fast);
+	if (err) {
+		LOG_ERR("Failed to switch interval (err %d)", err);
+	}
+
+out:
+	onboarding_resume();
+	if (err) {
+		return err;
+	}
+
+	now = k_uptime_get();
+	if (fast) {
+		stats.to_fast++;
+		fast_since = now;
+	} else {
+		stats.to_slow++;
+		stats.fast_ms += now - fast_since;
+	}
+
+	LOG_INF("Switched to %s interval of %u ms", fast ? "fast" : "slow",
+		INTERVAL_MS(pawr_params_get()->interval_max));
+
+	return 0;
+}
+
+static void adaptive_thread(void *p1, void *p2, void *p3)
+{
+	int64_t busy_at = 0;
+
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	while (true) {
+		bool fast = pawr_params_is_fast();
+		bool want_fast;
+		int64_t now;
+
+		k_msleep(ADAPTIVE_POLL_MS);
+
+		now = k_uptime_get();
+		if (!downlink_idle()) {
+			busy_at = now;
+		}
+
+		if (!atomic_get(&enabled)) {
+			want_fast = false;
+		} else if (fast) {
+			want_fast = now - busy_at <
+				    IDLE_EVENTS * INTERVAL_MS(pawr_params_get()->interval_max);
+		} else {
+			want_fast = busy_at == now;
+		}
+
+		if (want_fast == fast) {
+			continue;
+		}
+
+		(void)switch_interval(want_fast);
+	}
+}
+
+void adaptive_start(void)
+{
+	k_thread_start(adaptive_tid);
+}
+
+void adaptive_enable(bool enable)
+{
+	atomic_set(&enabled, enable);
+}
+
+bool adaptive_is_enabled(void)
+{
+	return atomic_get(&enabled);
+}
+
+void adaptive_get_stats(struct adaptive_stats *out)
+{
+	*out = stats;
+
+	if (pawr_params_is_fast()) {
+		out->fast_ms += k_uptime_get() - fast_since;
+	}
+}
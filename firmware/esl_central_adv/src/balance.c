@@ -0,0 +1,209 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(balance, LOG_LEVEL_INF);
+
+#include "balance.h"
+#include "downlink.h"
+#include "groups.h"
+#include "image_xfer.h"
+#include "onboarding.h"
+#include "pawr_params.h"
+#include "registry.h"
+
+static struct k_spinlock lock;
+/* Bytes counted since the last fold */
+static atomic_t window[MAX_SYNCS];
+/* Running average of the windows, bytes per period */
+static uint32_t load[MAX_SYNCS];
+static uint32_t subevent_load[NUM_SUBEVENTS];
+static atomic_t enabled = ATOMIC_INIT(1);
+static struct balance_stats stats;
+
+static void balance_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(balance_work, balance_handler);
+
+void balance_count(uint16_t tag, uint16_t bytes)
+{
+	if (tag < MAX_SYNCS) {
+		(void)atomic_add(&window[tag], bytes);
+	}
+}
+
+/* Must be called with the lock held */
+static void sum_subevents(void)
+{
+	memset(subevent_load, 0, sizeof(subevent_load));
+
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		subevent_load[TAG_SUBEVENT(tag)] += load[tag];
+	}
+}
+
+static void fold(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		/* Weighs the last period a quarter */
+		load[tag] = (load[tag] * 3 + atomic_clear(&window[tag])) / 4;
+	}
+
+	sum_subevents();
+	k_spin_unlock(&lock, key);
+}
+
+uint32_t balance_subevent_load(uint8_t subevent)
+{
+	return subevent < NUM_SUBEVENTS ? subevent_load[subevent] : 0;
+}
+
+uint32_t balance_tag_load(uint16_t tag)
+{
+	return tag < MAX_SYNCS ? load[tag] : 0;
+}
+
+void balance_moved(uint16_t from, uint16_t to)
+{
+	k_spinlock_key_t key;
+
+	if (from >= MAX_SYNCS || to >= MAX_SYNCS) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	load[to] = load[from];
+	load[from] = 0;
+	(void)atomic_set(&window[to], atomic_clear(&window[from]));
+	sum_subevents();
+	stats.moved++;
+	k_spin_unlock(&lock, key);
+}
+
+static bool movable(uint16_t tag)
+{
+	struct image_xfer_progress progress;
+
+	return registry_known(tag) && groups_get(tag) == ESL_GROUP_NONE &&
+	       !downlink_queue_depth(tag) && !downlink_inflight(tag) &&
+	       downlink_burst_subevent(tag) == ESL_SUBEVENT_NONE && !downlink_asleep(tag) &&
+	       image_xfer_get_progress(tag, &progress) != 0;
+}
+
+static uint8_t registered(uint8_t subevent)
+{
+	uint8_t tags = 0;
+
+	for (uint8_t slot = 0; slot < NUM_RSP_SLOTS; slot++) {
+		tags += registry_known(TAG_ID(subevent, slot));
+	}
+
+	return tags;
+}
+
+int balance_run(void)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	uint8_t hot = 0;
+	uint8_t cool = ESL_SUBEVENT_NONE;
+	uint32_t gap;
+	int best = -ENOENT;
+	uint32_t best_miss = UINT32_MAX;
+	int err;
+
+	for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+		if (pawr_params_subevent_active(subevent) &&
+		    subevent_load[subevent] > subevent_load[hot]) {
+			hot = subevent;
+		}
+	}
+
+	/* Tags can only be moved within the train they are synced to */
+	for (uint8_t local = 0; local < param->num_subevents; local++) {
+		uint8_t subevent = SUBEVENT_ID(SUBEVENT_TRAIN(hot), local);
+
+		/* Somewhere to go, counting slots that are being onboarded into as free */
+		if (registered(subevent) < param->num_response_slots &&
+		    (cool == ESL_SUBEVENT_NONE || subevent_load[subevent] < subevent_load[cool])) {
+			cool = subevent;
+		}
+	}
+
+	if (cool == ESL_SUBEVENT_NONE || cool == hot) {
+		return -EALREADY;
+	}
+
+	/* Not worth the churn unless the busiest one carries a quarter more */
+	gap = subevent_load[hot] - subevent_load[cool];
+	if (gap < BALANCE_MIN_GAP || subevent_load[hot] * 4 < subevent_load[cool] * 5) {
+		return -EALREADY;
+	}
+
+	/* Moving a tag of load L leaves max(hot - L, cool + L), best at L = gap / 2 */
+	for (uint8_t slot = 0; slot < param->num_response_slots; slot++) {
+		uint16_t tag = TAG_ID(hot, slot);
+		uint32_t miss;
+
+		if (!load[tag] || load[tag] >= gap || !movable(tag)) {
+			continue;
+		}
+
+		miss = load[tag] * 2 > gap ? load[tag] * 2 - gap : gap - load[tag] * 2;
+		if (miss < best_miss) {
+			best_miss = miss;
+			best = tag;
+		}
+	}
+
+	if (best < 0) {
+		return best;
+	}
+
+	err = onboarding_move(best, cool);
+	if (err) {
+		return err;
+	}
+
+	stats.requested++;
+	LOG_INF("Moving tag %d (%u B) from subevent %d (%u B) to %d (%u B)", best, load[best], hot,
+		subevent_load[hot], cool, subevent_load[cool]);
+
+	return 0;
+}
+
+static void balance_handler(struct k_work *work)
+{
+	fold();
+
+	if (atomic_get(&enabled)) {
+		(void)balance_run();
+	}
+
+	k_work_reschedule(&balance_work, K_SECONDS(BALANCE_PERIOD_S));
+}
+
+void balance_start(void)
+{
+	k_work_reschedule(&balance_work, K_SECONDS(BALANCE_PERIOD_S));
+}
+
+void balance_enable(bool enable)
+{
+	atomic_set(&enabled, enable);
+}
+
+bool balance_is_enabled(void)
+{
+	return atomic_get(&enabled);
+}
+
+void balance_get_stats(struct balance_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	memcpy(out->load, subevent_load, sizeof(out->load));
+	k_spin_unlock(&lock, key);
+}
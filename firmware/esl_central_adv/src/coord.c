@@ -0,0 +1,784 @@
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+#include <zephyr/device.h>
+#include <zephyr/drivers/uart.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(coord, LOG_LEVEL_INF);
+
+#include "coord.h"
+#include "downlink.h"
+#include "onboarding.h"
+#include "pawr_params.h"
+#include "registry.h"
+#include "telemetry.h"
+#include "esl_packets.h"
+
+#define COORD_STACK_SIZE 1024
+#define COORD_PRIORITY   7
+#define ALIGN_STACK_SIZE 1024
+#define ALIGN_PRIORITY   8
+/* How often claims are decided and peers timed out */
+#define COORD_TICK_MS    50
+#define ALIGN_POLL_MS    100
+
+/* Tags claimed at once, more than advertise at the same time in practice */
+#define COORD_CLAIMS 8
+/* A registered tag heard within this many events still has our RSSI on record */
+#define FRESH_EVENTS 32
+/* Copies of the timing notice before a restart, more while tags are asleep */
+#define NOTICE_EVENTS 2
+/* Least anchor error worth a restart, UART and host latency are below it */
+#define ALIGN_MIN_US 2000
+
+#define INTERVAL_MS(interval) ((uint32_t)(interval) * 5 / 4)
+
+#if DT_HAS_CHOSEN(esl_coord_uart)
+static const struct device *const uart = DEVICE_DT_GET(DT_CHOSEN(esl_coord_uart));
+#else
+static const struct device *const uart;
+#endif
+
+/* A received frame, or a claim to send when the sender is us */
+struct coord_msg {
+	int64_t at_us;
+	uint32_t sender;
+	uint8_t type;
+	uint8_t len;
+	uint8_t data[COORD_PAYLOAD_MAX];
+};
+
+K_MSGQ_DEFINE(msg_q, sizeof(struct coord_msg), 16, 4);
+
+struct claim {
+	bt_addr_le_t addr;
+	/* Decided at deadline, forgotten at expires, 0 for a free entry */
+	int64_t deadline;
+	int64_t expires;
+	uint32_t best_id;
+	int16_t best_rssi;
+	/* We claimed it, and it is registered with us */
+	bool claimed;
+	bool owner;
+	bool decided;
+	bool won;
+};
+
+struct peer {
+	uint32_t id;
+	int64_t seen;
+	struct coord_hello hello;
+};
+
+static struct k_spinlock lock;
+static struct claim claims[COORD_CLAIMS];
+static struct peer peers[COORD_MAX_PEERS];
+static uint8_t num_peers;
+static atomic_t live;
+static uint32_t self_id;
+static struct coord_stats stats;
+
+/* Last hello of the central with the lowest id, the reference for anchors */
+static struct {
+	bool valid;
+	int64_t at_us;
+	struct coord_hello hello;
+	/* Our place among the centrals in id order, and their number */
+	uint8_t rank;
+	uint8_t centrals;
+} ref;
+
+/* Released for a weak RSSI, not released again before it recovers */
+static ATOMIC_DEFINE(released, MAX_SYNCS);
+static uint8_t weak[MAX_SYNCS];
+
+/* Frame being received, after COORD_SOF */
+static struct {
+	uint8_t buf[sizeof(struct coord_hdr) + COORD_PAYLOAD_MAX + sizeof(uint16_t)];
+	uint8_t len;
+	bool in_frame;
+} rx;
+
+static K_SEM_DEFINE(align_sem, 0, 1);
+static int64_t aligned_at;
+
+static void coord_thread(void *p1, void *p2, void *p3);
+static void align_thread(void *p1, void *p2, void *p3);
+
+K_THREAD_DEFINE(coord_tid, COORD_STACK_SIZE, coord_thread, NULL, NULL, NULL, COORD_PRIORITY, 0,
+		K_TICKS_FOREVER);
+K_THREAD_DEFINE(align_tid, ALIGN_STACK_SIZE, align_thread, NULL, NULL, NULL, ALIGN_PRIORITY, 0,
+		K_TICKS_FOREVER);
+
+static int64_t now_us(void)
+{
+	return k_ticks_to_us_floor64(k_uptime_ticks());
+}
+
+static void rx_byte(uint8_t byte)
+{
+	struct coord_hdr hdr;
+	struct coord_msg msg;
+	size_t total;
+
+	if (!rx.in_frame) {
+		rx.in_frame = (byte == COORD_SOF);
+		rx.len = 0;
+		return;
+	}
+
+	rx.buf[rx.len++] = byte;
+
+	/* The length comes first, a bad one means we are not in a frame */
+	if (rx.buf[0] > COORD_PAYLOAD_MAX) {
+		rx.in_frame = false;
+		return;
+	}
+
+	total = sizeof(hdr) + rx.buf[0] + sizeof(uint16_t);
+	if (rx.len < total) {
+		return;
+	}
+
+	rx.in_frame = false;
+
+	if (crc16_itu_t(0xFFFF, rx.buf, total - sizeof(uint16_t)) !=
+	    sys_get_le16(&rx.buf[total - sizeof(uint16_t)])) {
+		stats.dropped++;
+		return;
+	}
+
+	memcpy(&hdr, rx.buf, sizeof(hdr));
+	msg.sender = sys_le32_to_cpu(hdr.sender);
+	if (msg.sender == self_id) {
+		/* Our own frame, echoed by a bus */
+		return;
+	}
+
+	msg.at_us = now_us();
+	msg.type = hdr.type;
+	msg.len = hdr.len;
+	memcpy(msg.data, &rx.buf[sizeof(hdr)], hdr.len);
+
+	if (k_msgq_put(&msg_q, &msg, K_NO_WAIT)) {
+		stats.dropped++;
+	}
+}
+
+static void uart_cb(const struct device *dev, void *user_data)
+{
+	uint8_t buf[16];
+	int len;
+
+	ARG_UNUSED(user_data);
+
+	if (!uart_irq_update(dev)) {
+		return;
+	}
+
+	while (uart_irq_rx_ready(dev)) {
+		len = uart_fifo_read(dev, buf, sizeof(buf));
+		if (len <= 0) {
+			break;
+		}
+
+		for (int i = 0; i < len; i++) {
+			rx_byte(buf[i]);
+		}
+	}
+}
+
+/* Only called from the coordination thread */
+static void send(uint8_t type, const void *data, uint8_t len)
+{
+	uint8_t frame[1 + sizeof(struct coord_hdr) + COORD_PAYLOAD_MAX + sizeof(uint16_t)];
+	struct coord_hdr hdr = {
+		.len = len,
+		.type = type,
+		.sender = sys_cpu_to_le32(self_id),
+	};
+	size_t n = 0;
+
+	frame[n++] = COORD_SOF;
+	memcpy(&frame[n], &hdr, sizeof(hdr));
+	n += sizeof(hdr);
+	memcpy(&frame[n], data, len);
+	n += len;
+	sys_put_le16(crc16_itu_t(0xFFFF, &frame[1], n - 1), &frame[n]);
+	n += sizeof(uint16_t);
+
+	for (size_t i = 0; i < n; i++) {
+		uart_poll_out(uart, frame[i]);
+	}
+}
+
+/* Entry for a tag, a fresh one if it has none. Must be called with the lock
+ * held.
+ */
+static struct claim *claim_get(const bt_addr_le_t *addr, int64_t now)
+{
+	struct claim *oldest = &claims[0];
+
+	for (size_t i = 0; i < ARRAY_SIZE(claims); i++) {
+		if (claims[i].expires > now && bt_addr_le_eq(&claims[i].addr, addr)) {
+			return &claims[i];
+		}
+
+		if (claims[i].expires < oldest->expires) {
+			oldest = &claims[i];
+		}
+	}
+
+	memset(oldest, 0, sizeof(*oldest));
+	bt_addr_le_copy(&oldest->addr, addr);
+	oldest->deadline = now + COORD_CLAIM_MS;
+	oldest->expires = oldest->deadline + COORD_VERDICT_MS;
+	oldest->best_rssi = INT16_MIN;
+
+	return oldest;
+}
+
+/* Must be called with the lock held */
+static void claim_offer(struct claim *c, uint32_t id, int16_t rssi)
+{
+	if (c->decided) {
+		return;
+	}
+
+	if (rssi > c->best_rssi || (rssi == c->best_rssi && id < c->best_id)) {
+		c->best_rssi = rssi;
+		c->best_id = id;
+	}
+}
+
+static void claim_msg(struct coord_msg *msg, const bt_addr_le_t *addr, int8_t rssi, bool owner)
+{
+	struct coord_claim claim = {
+		.rssi = rssi,
+		.flags = owner ? COORD_CLAIM_OWNER : 0,
+	};
+
+	bt_addr_le_copy(&claim.addr, addr);
+
+	msg->sender = self_id;
+	msg->type = COORD_CLAIM;
+	msg->len = sizeof(claim);
+	memcpy(msg->data, &claim, sizeof(claim));
+}
+
+int coord_claim(const bt_addr_le_t *addr, int8_t rssi, bool owner)
+{
+	struct coord_msg msg;
+	k_spinlock_key_t key;
+	struct claim *c;
+	int err;
+
+	/* On our own, nobody to ask */
+	if (!uart || !atomic_get(&live)) {
+		return 0;
+	}
+
+	key = k_spin_lock(&lock);
+	c = claim_get(addr, k_uptime_get());
+
+	if (c->decided) {
+		err = c->won ? 0 : -EPERM;
+		k_spin_unlock(&lock, key);
+		return err;
+	}
+
+	if (c->claimed) {
+		k_spin_unlock(&lock, key);
+		return -EINPROGRESS;
+	}
+
+	c->claimed = true;
+	c->owner = owner;
+	claim_offer(c, self_id, rssi + (owner ? COORD_OWNER_BONUS_DB : 0));
+	stats.claimed++;
+	k_spin_unlock(&lock, key);
+
+	claim_msg(&msg, addr, rssi, owner);
+	if (k_msgq_put(&msg_q, &msg, K_NO_WAIT)) {
+		stats.dropped++;
+	}
+
+	return -EINPROGRESS;
+}
+
+bool coord_claims_pending(void)
+{
+	int64_t now = k_uptime_get();
+	bool pending = false;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (size_t i = 0; i < ARRAY_SIZE(claims); i++) {
+		if (claims[i].expires > now && (claims[i].decided ? claims[i].won :
+					       claims[i].claimed)) {
+			pending = true;
+			break;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return pending;
+}
+
+static void handle_claim(const struct coord_msg *msg)
+{
+	struct coord_claim claim;
+	struct telemetry_tag entry = { 0 };
+	struct coord_msg counter;
+	k_spinlock_key_t key;
+	struct claim *c;
+	bool send_counter = false;
+	int tag;
+
+	if (msg->len < sizeof(claim)) {
+		return;
+	}
+
+	memcpy(&claim, msg->data, sizeof(claim));
+	tag = registry_lookup(&claim.addr);
+
+	key = k_spin_lock(&lock);
+	c = claim_get(&claim.addr, k_uptime_get());
+	claim_offer(c, msg->sender,
+		    claim.rssi + ((claim.flags & COORD_CLAIM_OWNER) ? COORD_OWNER_BONUS_DB : 0));
+
+	if (tag >= 0) {
+		c->owner = true;
+
+		/* Ours and heard lately, so we have a say even without hearing
+		 * it advertise: our link as it was.
+		 */
+		if (!c->claimed && !c->decided && !telemetry_get(tag, &entry) &&
+		    telemetry_age(tag) < FRESH_EVENTS) {
+			c->claimed = true;
+			claim_offer(c, self_id, entry.rssi + COORD_OWNER_BONUS_DB);
+			stats.claimed++;
+			send_counter = true;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (send_counter) {
+		claim_msg(&counter, &claim.addr, entry.rssi, true);
+		send(counter.type, counter.data, counter.len);
+	}
+}
+
+static void claims_decide(int64_t now)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(claims); i++) {
+		k_spinlock_key_t key = k_spin_lock(&lock);
+		struct claim c = claims[i];
+		int tag;
+
+		if (!c.expires || c.decided || now < c.deadline) {
+			k_spin_unlock(&lock, key);
+			continue;
+		}
+
+		claims[i].decided = true;
+		claims[i].won = c.claimed && c.best_id == self_id;
+		c.won = claims[i].won;
+		k_spin_unlock(&lock, key);
+
+		if (c.won) {
+			stats.won++;
+			continue;
+		}
+
+		if (c.claimed) {
+			stats.lost++;
+		}
+
+		tag = c.owner ? registry_lookup(&c.addr) : -ENOENT;
+		if (tag >= 0) {
+			/* Skipped if it is being onboarded right now, the next claim
+			 * settles it then.
+			 */
+			(void)onboarding_forget(tag);
+			atomic_clear_bit(released, tag);
+			stats.handed_over++;
+			LOG_INF("Tag %d handed over to central %08x", tag, c.best_id);
+		}
+	}
+}
+
+/* Must be called with the lock held */
+static void ref_update(void)
+{
+	uint32_t leader = self_id;
+	uint8_t rank = 0;
+
+	for (uint8_t i = 0; i < num_peers; i++) {
+		leader = MIN(leader, peers[i].id);
+		rank += peers[i].id < self_id;
+	}
+
+	ref.rank = rank;
+	ref.centrals = num_peers + 1;
+	if (leader == self_id) {
+		ref.valid = false;
+	}
+}
+
+static void handle_hello(const struct coord_msg *msg)
+{
+	struct coord_hello hello;
+	k_spinlock_key_t key;
+	struct peer *peer = NULL;
+	bool leader = true;
+
+	if (msg->len < sizeof(hello)) {
+		return;
+	}
+
+	memcpy(&hello, msg->data, sizeof(hello));
+
+	key = k_spin_lock(&lock);
+
+	for (uint8_t i = 0; i < num_peers; i++) {
+		if (peers[i].id == msg->sender) {
+			peer = &peers[i];
+		}
+		leader &= peers[i].id >= msg->sender;
+	}
+
+	if (!peer && num_peers < ARRAY_SIZE(peers)) {
+		peer = &peers[num_peers++];
+		peer->id = msg->sender;
+		LOG_INF("Central %08x joined", msg->sender);
+	}
+
+	if (!peer) {
+		k_spin_unlock(&lock, key);
+		return;
+	}
+
+	peer->seen = k_uptime_get();
+	peer->hello = hello;
+	atomic_set(&live, num_peers);
+	ref_update();
+
+	if (leader && msg->sender < self_id) {
+		ref.valid = true;
+		ref.at_us = msg->at_us;
+		ref.hello = hello;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (leader && msg->sender < self_id) {
+		k_sem_give(&align_sem);
+	}
+}
+
+static void peers_expire(int64_t now)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	for (uint8_t i = 0; i < num_peers;) {
+		if (now - peers[i].seen < COORD_PEER_TIMEOUT_MS) {
+			i++;
+			continue;
+		}
+
+		LOG_INF("Central %08x gone", peers[i].id);
+		peers[i] = peers[--num_peers];
+		atomic_set(&live, num_peers);
+		ref_update();
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+static void send_hello(void)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	struct coord_hello hello = {
+		.interval = sys_cpu_to_le16(param->interval_max),
+		.subevent_interval = param->subevent_interval,
+		.trains = NUM_TRAINS,
+		.tags = sys_cpu_to_le16(registry_count()),
+		.phase_us = sys_cpu_to_le32(pawr_params_phase_us()),
+	};
+
+	send(COORD_HELLO, &hello, sizeof(hello));
+}
+
+static void check_weak(void)
+{
+	struct telemetry_tag entry;
+
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		if (!registry_known(tag) || !pawr_params_tag_active(tag) ||
+		    telemetry_get(tag, &entry) || telemetry_age(tag) > 1) {
+			/* Only judged on a current RSSI */
+			weak[tag] = 0;
+			continue;
+		}
+
+		if (entry.rssi >= COORD_WEAK_RSSI) {
+			weak[tag] = 0;
+			if (entry.rssi >= COORD_WEAK_RSSI + COORD_OWNER_BONUS_DB) {
+				atomic_clear_bit(released, tag);
+			}
+			continue;
+		}
+
+		if (weak[tag] < COORD_WEAK_CHECKS) {
+			weak[tag]++;
+		}
+
+		if (weak[tag] < COORD_WEAK_CHECKS || atomic_test_bit(released, tag)) {
+			continue;
+		}
+
+		if (!downlink_enqueue(tag, ESL_CMD_RELEASE, NULL, 0)) {
+			atomic_set_bit(released, tag);
+			stats.released++;
+			LOG_INF("Tag %d released at %d dBm", tag, entry.rssi);
+		}
+	}
+}
+
+static void coord_thread(void *p1, void *p2, void *p3)
+{
+	int64_t hello_at = 0;
+	int64_t check_at = 0;
+	struct coord_msg msg;
+
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	while (true) {
+		int64_t now;
+
+		if (k_msgq_get(&msg_q, &msg, K_MSEC(COORD_TICK_MS)) == 0) {
+			if (msg.sender == self_id) {
+				send(msg.type, msg.data, msg.len);
+			} else if (msg.type == COORD_HELLO) {
+				handle_hello(&msg);
+			} else if (msg.type == COORD_CLAIM) {
+				handle_claim(&msg);
+			}
+		}
+
+		now = k_uptime_get();
+		claims_decide(now);
+		peers_expire(now);
+
+		if (now >= hello_at) {
+			send_hello();
+			hello_at = now + COORD_HELLO_MS;
+		}
+
+		if (now >= check_at) {
+			if (atomic_get(&live)) {
+				check_weak();
+			}
+			check_at = now + COORD_CHECK_MS;
+		}
+	}
+}
+
+/* Anchor error against the reference, and the delay after which a restart
+ * puts the first train where it belongs.
+ */
+static int align_target(int32_t *error_us, uint32_t *delay_us, uint32_t *tolerance_us)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint32_t interval_us;
+	uint32_t step_us;
+	uint32_t leader_us;
+	uint32_t target_us;
+	int64_t error;
+
+	/* Interleaving only works out between trains of the same timing */
+	if (!ref.valid || sys_le16_to_cpu(ref.hello.interval) != param->interval_max ||
+	    ref.hello.subevent_interval != param->subevent_interval ||
+	    ref.hello.trains != NUM_TRAINS) {
+		k_spin_unlock(&lock, key);
+		return -ENOTSUP;
+	}
+
+	interval_us = param->interval_max * 1250U;
+	/* Every train of every central gets its own share of a subevent
+	 * interval, ours start rank shares after the reference's.
+	 */
+	step_us = param->subevent_interval * 1250U / (ref.centrals * NUM_TRAINS);
+	leader_us = (sys_le32_to_cpu(ref.hello.phase_us) + (now_us() - ref.at_us)) % interval_us;
+	target_us = (leader_us + interval_us - step_us * ref.rank % interval_us) % interval_us;
+	k_spin_unlock(&lock, key);
+
+	error = ((int64_t)pawr_params_phase_us() + interval_us - target_us) % interval_us;
+	if (error > interval_us / 2) {
+		error -= interval_us;
+	}
+
+	*error_us = error;
+	*delay_us = (interval_us - target_us) % interval_us;
+	*tolerance_us = MAX(step_us / 4, ALIGN_MIN_US);
+
+	return 0;
+}
+
+static void align(void)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	struct esl_cmd_timing notice = {
+		.interval = sys_cpu_to_le16(param->interval_max),
+	};
+	struct onboarding_stats onboarding;
+	uint32_t tolerance_us;
+	uint32_t started;
+	uint32_t delay_us;
+	int32_t error_us;
+	int err;
+
+	if (align_target(&error_us, &delay_us, &tolerance_us)) {
+		return;
+	}
+
+	stats.phase_error_us = error_us;
+	if (abs(error_us) <= tolerance_us ||
+	    (aligned_at && k_uptime_get() - aligned_at < COORD_ALIGN_HOLDOFF_S * MSEC_PER_SEC)) {
+		return;
+	}
+
+	/* Tags being onboarded are handed the current trains and would miss
+	 * the notice, none are taken on until the restart is done.
+	 */
+	onboarding_get_stats(&onboarding);
+	if (onboarding.active) {
+		return;
+	}
+
+	onboarding_pause();
+	started = onboarding.started;
+
+	/* Same interval, tags only resync to the restarted trains */
+	if (registry_count()) {
+		err = downlink_announce(ESL_CMD_TIMING, &notice, sizeof(notice), NOTICE_EVENTS);
+		if (err) {
+			goto out;
+		}
+
+		while (downlink_announcing()) {
+			k_msleep(ALIGN_POLL_MS);
+		}
+
+		k_msleep(INTERVAL_MS(param->interval_max));
+	}
+
+	/* The reference has moved on meanwhile */
+	err = align_target(&error_us, &delay_us, &tolerance_us);
+	if (err) {
+		goto out;
+	}
+
+	/* A connection that got in just as onboarding paused */
+	onboarding_get_stats(&onboarding);
+	if (onboarding.active || onboarding.started != started) {
+		LOG_WRN("Tag onboarded during the notice, trains not restarted");
+		err = -EBUSY;
+		goto out;
+	}
+
+	aligned_at = k_uptime_get();
+	err = pawr_params_realign(delay_us);
+	if (err) {
+		LOG_ERR("Failed to restart trains (err %d)", err);
+	}
+
+out:
+	onboarding_resume();
+	if (err) {
+		return;
+	}
+
+	stats.realigns++;
+	LOG_INF("Trains restarted, were %d us off central %d of %d", error_us, ref.rank,
+		ref.centrals);
+}
+
+static void align_thread(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	while (true) {
+		k_sem_take(&align_sem, K_FOREVER);
+		align();
+	}
+}
+
+int coord_start(void)
+{
+	bt_addr_le_t addrs[CONFIG_BT_ID_MAX];
+	size_t count = ARRAY_SIZE(addrs);
+	int err;
+
+	if (!uart || !device_is_ready(uart)) {
+		LOG_INF("No coordination link, working on our own");
+		return -ENODEV;
+	}
+
+	bt_id_get(addrs, &count);
+	if (count == 0) {
+		return -ENODEV;
+	}
+
+	self_id = sys_get_le32(addrs[BT_ID_DEFAULT].a.val);
+	stats.id = self_id;
+
+	err = uart_irq_callback_user_data_set(uart, uart_cb, NULL);
+	if (err) {
+		LOG_ERR("Failed to set UART callback (err %d)", err);
+		return err;
+	}
+
+	uart_irq_rx_enable(uart);
+
+	k_thread_start(coord_tid);
+	k_thread_start(align_tid);
+
+	LOG_INF("Coordinating as central %08x", self_id);
+
+	return 0;
+}
+
+int coord_get_peer(uint8_t index, struct coord_peer *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	int err = -ENOENT;
+
+	if (index < num_peers) {
+		out->id = peers[index].id;
+		out->age_ms = k_uptime_get() - peers[index].seen;
+		out->hello = peers[index].hello;
+		err = 0;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return err;
+}
+
+void coord_get_stats(struct coord_stats *out)
+{
+	*out = stats;
+	out->peers = atomic_get(&live);
+}
@@ -0,0 +1,961 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/slist.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(downlink, LOG_LEVEL_INF);
+
+#include "downlink.h"
+#include "balance.h"
+#include "pawr_params.h"
+#include "esl_packets.h"
+#include "esl_pool.h"
+
+struct downlink_cmd {
+	sys_snode_t node;
+	uint8_t type;
+	uint8_t len;
+	/* Multicast commands only, see downlink_enqueue_multicast() */
+	uint8_t addr;
+	uint8_t retries;
+	bool sent;
+	uint16_t sent_event;
+	/* Response slots that have not answered since the command went out */
+	uint16_t members;
+	uint8_t data[DOWNLINK_CMD_DATA_MAX];
+};
+
+BUILD_ASSERT(NUM_RSP_SLOTS <= 16, "Multicast member bitmap holds 16 slots");
+BUILD_ASSERT(NUM_RSP_SLOTS <= ESL_ADDR_GROUP_BASE, "Response slots overlap group addresses");
+
+ESL_POOL_DEFINE(downlink_cmd_pool, sizeof(struct downlink_cmd), DOWNLINK_CMD_POOL_SIZE);
+
+static struct k_spinlock lock;
+
+static sys_slist_t queues[MAX_SYNCS];
+static uint8_t depth[MAX_SYNCS];
+/* Number of commands queued per subevent, lets idle subevents skip the slot scan */
+static uint16_t subevent_pending[NUM_SUBEVENTS];
+/* Slot to start from next time, so one busy tag cannot starve its neighbours */
+static uint8_t next_slot[NUM_SUBEVENTS];
+
+/*
+ * Delivery tracking. A tag only answers in its response slot after it has
+ * received the subevent, so a response acknowledges everything sent to it in
+ * that event or before. Commands stay on the in-flight list until then and
+ * each tag has at most one event's worth of commands outstanding.
+ */
+static sys_slist_t inflight[MAX_SYNCS];
+static uint8_t inflight_count[MAX_SYNCS];
+static uint8_t retries[MAX_SYNCS];
+/* Subevent event the in-flight commands were handed to the controller for */
+static uint16_t sent_event[MAX_SYNCS];
+/* First event the tag may be sent to again after a miss, while backing off */
+static uint16_t retry_event[MAX_SYNCS];
+static ATOMIC_DEFINE(backoff, MAX_SYNCS);
+/* Tags with commands in flight per subevent, skips the timeout scan when idle */
+static uint16_t subevent_inflight[NUM_SUBEVENTS];
+/* Last event built per subevent */
+static uint16_t subevent_event[NUM_SUBEVENTS];
+
+/*
+ * Event the responses being reported belong to, in the numbering of
+ * subevent_event. The controller asks for data ahead of the responses, so
+ * the last event built can be one past it. Neither the data request nor the
+ * response report carries the periodic event counter on the advertiser
+ * side, the events are counted instead: every event reports its response
+ * slots in order, a slot not above the previous one starts the next event.
+ * Only touched from the PAwR callbacks, which run in the same thread.
+ */
+static uint16_t rsp_event[NUM_SUBEVENTS];
+static uint8_t rsp_slot[NUM_SUBEVENTS] = {[0 ... NUM_SUBEVENTS - 1] = UINT8_MAX};
+
+/* Commands for several tags of a subevent, sent ahead of the tag queues */
+static sys_slist_t multicast[NUM_SUBEVENTS];
+
+/*
+ * Subevents lent to a tag, see downlink_burst(). The tag's queue is drained
+ * from the lent subevent as well, with one batch in flight there besides the
+ * one in its home subevent. A response only acknowledges the home subevent;
+ * the batch in the lent one is acknowledged by the counter in the tag's
+ * esl_burst_status moving on.
+ */
+enum burst_state {
+	BURST_FREE,
+	/* ESL_CMD_LISTEN queued, or put back after a miss */
+	BURST_REQUESTED,
+	/* ESL_CMD_LISTEN in flight */
+	BURST_LISTEN_SENT,
+	BURST_ACTIVE,
+};
+
+static struct {
+	uint8_t state;
+	/* Events in a row with nothing sent to the tag */
+	uint8_t idle;
+	/* Batches in a row that were not acknowledged */
+	uint8_t misses;
+	uint8_t count;
+	/* Last esl_burst_status counter from the tag */
+	uint8_t batches;
+	uint16_t tag;
+	uint16_t sent_event;
+	sys_slist_t inflight;
+} burst[NUM_SUBEVENTS];
+/* Subevent lent to each tag */
+static uint8_t burst_of[MAX_SYNCS] = {[0 ... MAX_SYNCS - 1] = ESL_SUBEVENT_NONE};
+
+/*
+ * Sleep hints, see ESL_CMD_PENDING. Tags left out of the last hint of their
+ * subevent may not be listening, so nothing is sent to them before the next.
+ */
+static uint16_t hint_event[NUM_SUBEVENTS];
+static uint16_t awake[NUM_SUBEVENTS];
+
+/* Broadcast sent ahead of the tag queues, see downlink_announce() */
+static struct {
+	uint8_t type;
+	uint8_t len;
+	uint8_t data[DOWNLINK_CMD_DATA_MAX];
+} announcement;
+/* Events left to carry the announcement, per subevent */
+static uint8_t announce_left[NUM_SUBEVENTS];
+
+static struct downlink_stats stats;
+
+static bool event_before(uint16_t a, uint16_t b)
+{
+	return (int16_t)(a - b) < 0;
+}
+
+static void free_list(sys_slist_t *list)
+{
+	sys_snode_t *node;
+
+	while ((node = sys_slist_get(list)) != NULL) {
+		esl_pool_free(&downlink_cmd_pool, CONTAINER_OF(node, struct downlink_cmd, node));
+	}
+}
+
+static void inflight_clear(uint16_t tag)
+{
+	free_list(&inflight[tag]);
+	inflight_count[tag] = 0;
+	subevent_inflight[TAG_SUBEVENT(tag)]--;
+}
+
+/* Must be called with the lock held. Puts commands back in front of anything
+ * queued for the tag since they were sent.
+ */
+static void requeue(uint16_t tag, sys_slist_t *list, uint8_t count)
+{
+	sys_slist_merge_slist(list, &queues[tag]);
+	queues[tag] = *list;
+	sys_slist_init(list);
+
+	depth[tag] += count;
+	subevent_pending[TAG_SUBEVENT(tag)] += count;
+	stats.queue_depth += count;
+	stats.queue_depth_max = MAX(stats.queue_depth_max, stats.queue_depth);
+}
+
+/* Must be called with the lock held */
+static void burst_end(uint8_t subevent)
+{
+	uint16_t tag = burst[subevent].tag;
+
+	if (burst[subevent].count) {
+		requeue(tag, &burst[subevent].inflight, burst[subevent].count);
+		burst[subevent].count = 0;
+	}
+
+	burst[subevent].state = BURST_FREE;
+	burst_of[tag] = ESL_SUBEVENT_NONE;
+
+	LOG_DBG("Subevent %d taken back from tag %d", subevent, tag);
+}
+
+/* Must be called with the lock held */
+static void burst_ack(uint8_t subevent)
+{
+	/* ESL_CMD_LISTEN only goes out in the tag's home subevent, which this
+	 * response acknowledges. The tag counts batches from 0 from here on.
+	 */
+	if (burst[subevent].state == BURST_LISTEN_SENT) {
+		burst[subevent].state = BURST_ACTIVE;
+		burst[subevent].batches = 0;
+		burst[subevent].idle = 0;
+	}
+}
+
+/* Must be called with the lock held and commands in flight */
+static void retry(uint16_t tag, uint16_t next_event)
+{
+	uint8_t subevent = TAG_SUBEVENT(tag);
+	uint8_t count = inflight_count[tag];
+	uint8_t lent = burst_of[tag];
+
+	if (++retries[tag] > DOWNLINK_MAX_RETRIES) {
+		stats.expired += count;
+		retries[tag] = 0;
+		inflight_clear(tag);
+		if (lent != ESL_SUBEVENT_NONE && burst[lent].state == BURST_LISTEN_SENT) {
+			burst_end(lent);
+		}
+		return;
+	}
+
+	requeue(tag, &inflight[tag], count);
+	inflight_count[tag] = 0;
+	subevent_inflight[subevent]--;
+	stats.retried += count;
+
+	if (lent != ESL_SUBEVENT_NONE && burst[lent].state == BURST_LISTEN_SENT) {
+		burst[lent].state = BURST_REQUESTED;
+	}
+
+	/* First retry goes in the next event, then back off exponentially */
+	retry_event[tag] = next_event + BIT(MIN(retries[tag] - 1, 7)) - 1;
+	atomic_set_bit(backoff, tag);
+}
+
+int downlink_enqueue(uint16_t tag, uint8_t type, const void *data, uint8_t len)
+{
+	struct downlink_cmd *cmd;
+	k_spinlock_key_t key;
+
+	if (tag >= MAX_SYNCS || len > DOWNLINK_CMD_DATA_MAX || (len && !data)) {
+		return -EINVAL;
+	}
+
+	cmd = esl_pool_alloc(&downlink_cmd_pool);
+	if (!cmd) {
+		LOG_WRN("Command pool exhausted, dropping command for tag %d", tag);
+		key = k_spin_lock(&lock);
+		stats.dropped++;
+		k_spin_unlock(&lock, key);
+		return -ENOMEM;
+	}
+
+	cmd->type = type;
+	cmd->len = len;
+	memcpy(cmd->data, data, len);
+
+	key = k_spin_lock(&lock);
+	sys_slist_append(&queues[tag], &cmd->node);
+	depth[tag]++;
+	subevent_pending[TAG_SUBEVENT(tag)]++;
+	stats.queued++;
+	stats.queue_depth++;
+	stats.queue_depth_max = MAX(stats.queue_depth_max, stats.queue_depth);
+	k_spin_unlock(&lock, key);
+
+	return 0;
+}
+
+/* Must be called with the lock held. Drops tags from the multicast commands of
+ * their subevent, freeing commands that no longer wait for anyone. With
+ * @p ack, only from commands sent in @p event or before, which the tags'
+ * answers to @p event cover.
+ */
+static void multicast_clear(uint8_t subevent, uint16_t slots, bool ack, uint16_t event)
+{
+	sys_snode_t *node;
+	sys_snode_t *tmp;
+	sys_snode_t *prev = NULL;
+
+	SYS_SLIST_FOR_EACH_NODE_SAFE(&multicast[subevent], node, tmp) {
+		struct downlink_cmd *cmd = CONTAINER_OF(node, struct downlink_cmd, node);
+
+		if (!ack || (cmd->sent && !event_before(event, cmd->sent_event))) {
+			cmd->members &= ~slots;
+		}
+
+		if (cmd->members) {
+			prev = node;
+			continue;
+		}
+
+		sys_slist_remove(&multicast[subevent], prev, node);
+		esl_pool_free(&downlink_cmd_pool, cmd);
+		if (ack) {
+			stats.acked++;
+		}
+	}
+}
+
+int downlink_enqueue_multicast(uint8_t subevent, uint8_t addr, uint16_t members, uint8_t type,
+			       const void *data, uint8_t len)
+{
+	struct downlink_cmd *cmd;
+	k_spinlock_key_t key;
+
+	if (subevent >= NUM_SUBEVENTS || addr < ESL_ADDR_GROUP_BASE || !members ||
+	    members >= BIT(NUM_RSP_SLOTS) || len > DOWNLINK_CMD_DATA_MAX || (len && !data)) {
+		return -EINVAL;
+	}
+
+	cmd = esl_pool_alloc(&downlink_cmd_pool);
+	if (!cmd) {
+		LOG_WRN("Command pool exhausted, dropping command for subevent %d", subevent);
+		key = k_spin_lock(&lock);
+		stats.dropped++;
+		k_spin_unlock(&lock, key);
+		return -ENOMEM;
+	}
+
+	cmd->type = type;
+	cmd->len = len;
+	cmd->addr = addr;
+	cmd->retries = 0;
+	cmd->sent = false;
+	cmd->members = members;
+	memcpy(cmd->data, data, len);
+
+	key = k_spin_lock(&lock);
+	sys_slist_append(&multicast[subevent], &cmd->node);
+	stats.queued++;
+	k_spin_unlock(&lock, key);
+
+	return 0;
+}
+
+int downlink_burst(uint16_t tag)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	struct esl_cmd_listen listen = { .idle_events = 2 * DOWNLINK_BURST_IDLE };
+	uint8_t lent = ESL_SUBEVENT_NONE;
+	k_spinlock_key_t key;
+	int err;
+
+	if (tag >= MAX_SYNCS) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&lock);
+
+	if (burst_of[tag] != ESL_SUBEVENT_NONE) {
+		k_spin_unlock(&lock, key);
+		return 0;
+	}
+
+	/* The least busy subevent that is not lent out yet, on the tag's own
+	 * train since it is only synced to that one.
+	 */
+	for (uint8_t local = 0; local < param->num_subevents; local++) {
+		uint8_t i = SUBEVENT_ID(SUBEVENT_TRAIN(TAG_SUBEVENT(tag)), local);
+
+		if (i == TAG_SUBEVENT(tag) || burst[i].state != BURST_FREE) {
+			continue;
+		}
+
+		if (lent == ESL_SUBEVENT_NONE || subevent_pending[i] < subevent_pending[lent]) {
+			lent = i;
+		}
+	}
+
+	if (lent == ESL_SUBEVENT_NONE) {
+		k_spin_unlock(&lock, key);
+		return -EBUSY;
+	}
+
+	burst[lent].state = BURST_REQUESTED;
+	burst[lent].tag = tag;
+	burst[lent].idle = 0;
+	burst[lent].misses = 0;
+	burst[lent].count = 0;
+	sys_slist_init(&burst[lent].inflight);
+	burst_of[tag] = lent;
+	stats.bursts++;
+
+	k_spin_unlock(&lock, key);
+
+	listen.subevent = SUBEVENT_LOCAL(lent);
+	err = downlink_enqueue(tag, ESL_CMD_LISTEN, &listen, sizeof(listen));
+	if (err) {
+		key = k_spin_lock(&lock);
+		if (burst_of[tag] == lent) {
+			burst_end(lent);
+		}
+		k_spin_unlock(&lock, key);
+		return err;
+	}
+
+	LOG_DBG("Subevent %d lent to tag %d", lent, tag);
+
+	return 0;
+}
+
+uint8_t downlink_burst_subevent(uint16_t tag)
+{
+	if (tag >= MAX_SYNCS || burst_of[tag] == ESL_SUBEVENT_NONE ||
+	    burst[burst_of[tag]].state != BURST_ACTIVE) {
+		return ESL_SUBEVENT_NONE;
+	}
+
+	return burst_of[tag];
+}
+
+void downlink_flush(uint16_t tag)
+{
+	k_spinlock_key_t key;
+
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	if (burst_of[tag] != ESL_SUBEVENT_NONE) {
+		burst_end(burst_of[tag]);
+	}
+	free_list(&queues[tag]);
+	stats.dropped += depth[tag] + inflight_count[tag];
+	subevent_pending[TAG_SUBEVENT(tag)] -= depth[tag];
+	stats.queue_depth -= depth[tag];
+	depth[tag] = 0;
+	if (inflight_count[tag]) {
+		inflight_clear(tag);
+	}
+	retries[tag] = 0;
+	atomic_clear_bit(backoff, tag);
+	multicast_clear(TAG_SUBEVENT(tag), BIT(TAG_RSP_SLOT(tag)), false, 0);
+	k_spin_unlock(&lock, key);
+}
+
+void downlink_report(uint16_t tag)
+{
+	uint8_t subevent;
+	uint8_t slot;
+	uint16_t event;
+
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	subevent = TAG_SUBEVENT(tag);
+	slot = TAG_RSP_SLOT(tag);
+
+	if (slot <= rsp_slot[subevent]) {
+		event = rsp_event[subevent] + 1;
+
+		/* Back in step after an event that was not reported, or one
+		 * reported before its data was asked for
+		 */
+		if (event_before(subevent_event[subevent], event)) {
+			event = subevent_event[subevent];
+		} else if (event_before(event, subevent_event[subevent] - 1)) {
+			event = subevent_event[subevent] - 1;
+		}
+
+		rsp_event[subevent] = event;
+	}
+
+	rsp_slot[subevent] = slot;
+}
+
+void downlink_ack(uint16_t tag)
+{
+	k_spinlock_key_t key;
+	uint16_t event;
+
+	/* Called for every response, most tags have nothing in flight */
+	if (tag >= MAX_SYNCS ||
+	    (!inflight_count[tag] && sys_slist_is_empty(&multicast[TAG_SUBEVENT(tag)]) &&
+	     burst_of[tag] == ESL_SUBEVENT_NONE)) {
+		return;
+	}
+
+	event = rsp_event[TAG_SUBEVENT(tag)];
+
+	key = k_spin_lock(&lock);
+	/* An answer to an event before the commands went out says nothing
+	 * about them
+	 */
+	if (inflight_count[tag] && !event_before(event, sent_event[tag])) {
+		if (burst_of[tag] != ESL_SUBEVENT_NONE) {
+			burst_ack(burst_of[tag]);
+		}
+		stats.acked += inflight_count[tag];
+		retries[tag] = 0;
+		atomic_clear_bit(backoff, tag);
+		inflight_clear(tag);
+	}
+	multicast_clear(TAG_SUBEVENT(tag), BIT(TAG_RSP_SLOT(tag)), true, event);
+	k_spin_unlock(&lock, key);
+}
+
+void downlink_ingest(uint16_t tag, const struct net_buf_simple *buf)
+{
+	struct esl_burst_status status = { .subevent = ESL_SUBEVENT_NONE };
+	const uint8_t *record;
+	k_spinlock_key_t key;
+	uint8_t lent;
+	uint8_t len;
+
+	/* Called for every response, most tags have no subevent lent */
+	if (tag >= MAX_SYNCS || burst_of[tag] == ESL_SUBEVENT_NONE) {
+		return;
+	}
+
+	record = esl_rsp_find(buf, ESL_RSP_BURST, &len);
+	if (record && len >= sizeof(status)) {
+		memcpy(&status, record, sizeof(status));
+	}
+
+	key = k_spin_lock(&lock);
+
+	lent = burst_of[tag];
+	if (lent == ESL_SUBEVENT_NONE || burst[lent].state != BURST_ACTIVE) {
+		k_spin_unlock(&lock, key);
+		return;
+	}
+
+	/* The tag reports the subevent within its train, as it was told */
+	if (status.subevent != SUBEVENT_LOCAL(lent)) {
+		/* The tag gave the subevent up, or never took it */
+		burst_end(lent);
+	} else if (status.batches != burst[lent].batches) {
+		burst[lent].batches = status.batches;
+		if (burst[lent].count) {
+			free_list(&burst[lent].inflight);
+			stats.acked += burst[lent].count;
+			burst[lent].count = 0;
+			burst[lent].misses = 0;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void downlink_nack(uint16_t tag)
+{
+	k_spinlock_key_t key;
+
+	if (tag >= MAX_SYNCS || !inflight_count[tag]) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	/* A miss before the commands went out is no reason to resend them */
+	if (inflight_count[tag] &&
+	    !event_before(rsp_event[TAG_SUBEVENT(tag)], sent_event[tag])) {
+		retry(tag, subevent_event[TAG_SUBEVENT(tag)] + 1);
+	}
+	k_spin_unlock(&lock, key);
+}
+
+int downlink_announce(uint8_t type, const void *data, uint8_t len, uint8_t events)
+{
+	k_spinlock_key_t key;
+	uint8_t count = events;
+
+	if (len == 0 || len > DOWNLINK_CMD_DATA_MAX || !data || events == 0) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&lock);
+
+	if (downlink_announcing()) {
+		k_spin_unlock(&lock, key);
+		return -EBUSY;
+	}
+
+	announcement.type = type;
+	announcement.len = len;
+	memcpy(announcement.data, data, len);
+
+	/* Tags asleep since the last hint listen again for the next one, which
+	 * has to carry a copy too. The count is the same in every subevent so
+	 * the countdowns all end in the same event.
+	 */
+	for (uint8_t i = 0; i < NUM_SUBEVENTS; i++) {
+		int16_t to_hint = hint_event[i] - subevent_event[i];
+
+		if (pawr_params_subevent_active(i) && awake[i] != BIT_MASK(NUM_RSP_SLOTS) &&
+		    to_hint > count) {
+			count = to_hint;
+		}
+	}
+
+	for (uint8_t i = 0; i < NUM_SUBEVENTS; i++) {
+		if (pawr_params_subevent_active(i)) {
+			announce_left[i] = count;
+		}
+	}
+
+	k_spin_unlock(&lock, key);
+
+	return 0;
+}
+
+bool downlink_announcing(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(announce_left); i++) {
+		if (announce_left[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void add_announcement(uint8_t subevent, struct net_buf_simple *buf)
+{
+	uint8_t data[DOWNLINK_CMD_DATA_MAX];
+
+	memcpy(data, announcement.data, announcement.len);
+	data[announcement.len - 1] = --announce_left[subevent];
+
+	/* Goes first in an empty frame, where the size check guarantees a fit */
+	(void)esl_frame_add(buf, ESL_ADDR_BROADCAST, announcement.type, data, announcement.len);
+}
+
+/* Must be called with the lock held. Tags that need to be listening until the
+ * next hint.
+ */
+static uint16_t pending_slots(uint8_t subevent)
+{
+	uint16_t slots = 0;
+	sys_snode_t *node;
+
+	for (uint8_t slot = 0; slot < NUM_RSP_SLOTS; slot++) {
+		uint16_t tag = TAG_ID(subevent, slot);
+
+		/* Tags with commands in flight still have to answer */
+		if (depth[tag] || inflight_count[tag] || burst_of[tag] != ESL_SUBEVENT_NONE) {
+			slots |= BIT(slot);
+		}
+	}
+
+	SYS_SLIST_FOR_EACH_NODE(&multicast[subevent], node) {
+		slots |= CONTAINER_OF(node, struct downlink_cmd, node)->members;
+	}
+
+	return slots;
+}
+
+/* Must be called with the lock held */
+static void add_hint(uint8_t subevent, uint16_t event, struct net_buf_simple *buf)
+{
+	struct esl_cmd_pending hint = {
+		.events = DOWNLINK_HINT_EVENTS,
+	};
+
+	awake[subevent] = pending_slots(subevent);
+	hint_event[subevent] = event + DOWNLINK_HINT_EVENTS;
+	hint.slots = sys_cpu_to_le16(awake[subevent]);
+
+	/* Goes right after the announcement in an empty frame, always fits */
+	(void)esl_frame_add(buf, ESL_ADDR_BROADCAST, ESL_CMD_PENDING, &hint, sizeof(hint));
+	stats.hints++;
+}
+
+/* Must be called with the lock held */
+static void add_multicast(uint8_t subevent, uint16_t event, struct net_buf_simple *buf)
+{
+	sys_snode_t *node;
+	sys_snode_t *tmp;
+	sys_snode_t *prev = NULL;
+
+	SYS_SLIST_FOR_EACH_NODE_SAFE(&multicast[subevent], node, tmp) {
+		struct downlink_cmd *cmd = CONTAINER_OF(node, struct downlink_cmd, node);
+
+		/* Same slack as for tag commands before a member counts as missed */
+		if (cmd->sent && !event_before(event, cmd->sent_event + 2)) {
+			cmd->sent = false;
+			stats.retried++;
+
+			if (++cmd->retries > DOWNLINK_MAX_RETRIES) {
+				sys_slist_remove(&multicast[subevent], prev, node);
+				esl_pool_free(&downlink_cmd_pool, cmd);
+				stats.expired++;
+				continue;
+			}
+		}
+
+		prev = node;
+
+		/* Held until every member is awake */
+		if (cmd->sent || (cmd->members & ~awake[subevent])) {
+			continue;
+		}
+
+		if (esl_frame_add(buf, cmd->addr, cmd->type, cmd->data, cmd->len)) {
+			break;
+		}
+
+		cmd->sent = true;
+		cmd->sent_event = event;
+		stats.sent++;
+	}
+}
+
+/* Must be called with the lock held */
+static void burst_check(uint8_t subevent, uint16_t event)
+{
+	uint8_t count = burst[subevent].count;
+
+	/* Same slack as for the home subevent */
+	if (!count || event_before(event, burst[subevent].sent_event + 2)) {
+		return;
+	}
+
+	requeue(burst[subevent].tag, &burst[subevent].inflight, count);
+	burst[subevent].count = 0;
+	stats.retried += count;
+
+	/* The tag has most likely stopped listening, its home subevent carries
+	 * the rest.
+	 */
+	if (++burst[subevent].misses > 1) {
+		burst_end(subevent);
+	}
+}
+
+/* Must be called with the lock held */
+static bool burst_ready(uint8_t subevent)
+{
+	return burst[subevent].state == BURST_ACTIVE && !burst[subevent].count &&
+	       depth[burst[subevent].tag];
+}
+
+/* Must be called with the lock held. Counts an event the tag was sent nothing
+ * in, the same way the tag does.
+ */
+static void burst_idle(uint8_t subevent)
+{
+	if (burst[subevent].state != BURST_ACTIVE) {
+		return;
+	}
+
+	if (++burst[subevent].idle >= DOWNLINK_BURST_IDLE && !burst[subevent].count) {
+		burst_end(subevent);
+	}
+}
+
+/* Must be called with the lock held. Fills what the subevent's own tags left
+ * from the queue of the tag it is lent to.
+ */
+static void add_burst(uint8_t subevent, uint16_t event, struct net_buf_simple *buf)
+{
+	uint16_t tag = burst[subevent].tag;
+	sys_snode_t *node;
+
+	if (!burst_ready(subevent)) {
+		burst_idle(subevent);
+		return;
+	}
+
+	while ((node = sys_slist_peek_head(&queues[tag])) != NULL) {
+		struct downlink_cmd *cmd = CONTAINER_OF(node, struct downlink_cmd, node);
+
+		if (esl_frame_add(buf, ESL_ADDR_BURST, cmd->type, cmd->data, cmd->len)) {
+			break;
+		}
+
+		sys_slist_get(&queues[tag]);
+		sys_slist_append(&burst[subevent].inflight, node);
+		burst[subevent].count++;
+		depth[tag]--;
+		subevent_pending[TAG_SUBEVENT(tag)]--;
+		stats.queue_depth--;
+		stats.sent++;
+		stats.burst_sent++;
+	}
+
+	if (!burst[subevent].count) {
+		burst_idle(subevent);
+		return;
+	}
+
+	burst[subevent].idle = 0;
+	burst[subevent].sent_event = event;
+}
+
+void downlink_build_subevent(uint8_t subevent, struct net_buf_simple *buf)
+{
+	struct downlink_subevent_stats *se_stats;
+	k_spinlock_key_t key;
+	uint16_t event;
+	uint8_t slot;
+	bool full = false;
+	bool hint;
+
+	if (subevent >= NUM_SUBEVENTS) {
+		return;
+	}
+
+	se_stats = &stats.subevent[subevent];
+
+	key = k_spin_lock(&lock);
+
+	event = ++subevent_event[subevent];
+
+	/* Commands sent two or more events ago without any response from the
+	 * tag are lost. One event of slack allows for the controller asking for
+	 * data before the previous event's responses have been reported.
+	 */
+	for (uint8_t i = 0; subevent_inflight[subevent] && i < NUM_RSP_SLOTS; i++) {
+		uint16_t tag = TAG_ID(subevent, i);
+
+		if (inflight_count[tag] && !event_before(event, sent_event[tag] + 2)) {
+			retry(tag, event);
+		}
+	}
+
+	if (burst[subevent].state == BURST_ACTIVE) {
+		burst_check(subevent, event);
+	}
+
+	hint = !event_before(event, hint_event[subevent]);
+
+	if ((!subevent_pending[subevent] && !announce_left[subevent] && !hint &&
+	     sys_slist_is_empty(&multicast[subevent]) && !burst_ready(subevent)) ||
+	    net_buf_simple_tailroom(buf) <= ESL_FRAME_HDR_LEN) {
+		burst_idle(subevent);
+		se_stats->bytes_last = 0;
+		se_stats->events_empty++;
+		k_spin_unlock(&lock, key);
+		return;
+	}
+
+	esl_frame_init(buf);
+
+	if (announce_left[subevent]) {
+		add_announcement(subevent, buf);
+	}
+
+	if (hint) {
+		add_hint(subevent, event, buf);
+	}
+
+	add_multicast(subevent, event, buf);
+
+	slot = next_slot[subevent];
+	for (size_t i = 0; i < NUM_RSP_SLOTS; i++) {
+		uint16_t tag = TAG_ID(subevent, slot);
+		sys_snode_t *node;
+
+		if (atomic_test_bit(backoff, tag) && !event_before(event, retry_event[tag])) {
+			atomic_clear_bit(backoff, tag);
+		}
+
+		/* Stop and wait: nothing new until the last event is acknowledged */
+		if (inflight_count[tag] || atomic_test_bit(backoff, tag) ||
+		    !(awake[subevent] & BIT(slot))) {
+			slot = (slot + 1) % NUM_RSP_SLOTS;
+			continue;
+		}
+
+		while ((node = sys_slist_peek_head(&queues[tag])) != NULL) {
+			struct downlink_cmd *cmd = CONTAINER_OF(node, struct downlink_cmd, node);
+
+			if (esl_frame_add(buf, slot, cmd->type, cmd->data, cmd->len)) {
+				full = true;
+				break;
+			}
+
+			sys_slist_get(&queues[tag]);
+			sys_slist_append(&inflight[tag], node);
+			if (inflight_count[tag]++ == 0) {
+				subevent_inflight[subevent]++;
+			}
+			sent_event[tag] = event;
+			balance_count(tag, sizeof(struct esl_cmd_hdr) + cmd->len);
+			depth[tag]--;
+			subevent_pending[subevent]--;
+			stats.queue_depth--;
+			stats.sent++;
+
+			if (cmd->type == ESL_CMD_LISTEN && burst_of[tag] != ESL_SUBEVENT_NONE &&
+			    burst[burst_of[tag]].state == BURST_REQUESTED) {
+				burst[burst_of[tag]].state = BURST_LISTEN_SENT;
+			}
+		}
+
+		if (full) {
+			/* Resume with this tag next time */
+			break;
+		}
+
+		slot = (slot + 1) % NUM_RSP_SLOTS;
+	}
+	next_slot[subevent] = slot;
+
+	if (full) {
+		burst_idle(subevent);
+	} else {
+		add_burst(subevent, event, buf);
+	}
+
+	if (esl_frame_is_empty(buf)) {
+		/* Nothing eligible or the head of the queue did not fit, send
+		 * nothing rather than a bare header.
+		 */
+		net_buf_simple_reset(buf);
+	}
+
+	se_stats->bytes_last = buf->len;
+	se_stats->bytes_total += buf->len;
+	if (buf->len) {
+		se_stats->events_used++;
+	} else {
+		se_stats->events_empty++;
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+bool downlink_idle(void)
+{
+	if (stats.queue_depth) {
+		return false;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(subevent_inflight); i++) {
+		if (subevent_inflight[i] || !sys_slist_is_empty(&multicast[i]) || burst[i].count) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool downlink_subevent_pending(uint8_t subevent)
+{
+	return subevent < NUM_SUBEVENTS &&
+	       (subevent_pending[subevent] != 0 || !sys_slist_is_empty(&multicast[subevent]) ||
+		burst_ready(subevent));
+}
+
+bool downlink_asleep(uint16_t tag)
+{
+	return tag < MAX_SYNCS && !(awake[TAG_SUBEVENT(tag)] & BIT(TAG_RSP_SLOT(tag)));
+}
+
+uint8_t downlink_queue_depth(uint16_t tag)
+{
+	return tag < MAX_SYNCS ? depth[tag] : 0;
+}
+
+uint8_t downlink_inflight(uint16_t tag)
+{
+	if (tag >= MAX_SYNCS) {
+		return 0;
+	}
+
+	if (burst_of[tag] != ESL_SUBEVENT_NONE) {
+		return inflight_count[tag] + burst[burst_of[tag]].count;
+	}
+
+	return inflight_count[tag];
+}
+
+void downlink_get_stats(struct downlink_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
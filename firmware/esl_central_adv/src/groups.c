@@ -0,0 +1,160 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(groups, LOG_LEVEL_INF);
+
+#include "groups.h"
+#include "downlink.h"
+#include "registry.h"
+
+/* Marks a tag that has a slot but is in no group */
+#define NO_SLOT 0xFE
+
+BUILD_ASSERT(ESL_GROUP_COUNT <= NO_SLOT, "Group ids collide with NO_SLOT");
+
+static struct k_spinlock lock;
+/* Group of each tag, ESL_GROUP_NONE or NO_SLOT otherwise */
+static uint8_t group_of[MAX_SYNCS] = {[0 ... MAX_SYNCS - 1] = NO_SLOT};
+
+void groups_assign(uint16_t tag, uint8_t group)
+{
+	k_spinlock_key_t key;
+
+	if (tag >= MAX_SYNCS || (group >= ESL_GROUP_COUNT && group != ESL_GROUP_NONE)) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	group_of[tag] = group;
+	k_spin_unlock(&lock, key);
+}
+
+void groups_release(uint16_t tag)
+{
+	k_spinlock_key_t key;
+
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	group_of[tag] = NO_SLOT;
+	k_spin_unlock(&lock, key);
+}
+
+void groups_reset(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	memset(group_of, NO_SLOT, sizeof(group_of));
+	k_spin_unlock(&lock, key);
+}
+
+uint8_t groups_get(uint16_t tag)
+{
+	if (tag >= MAX_SYNCS || group_of[tag] == NO_SLOT) {
+		return ESL_GROUP_NONE;
+	}
+
+	return group_of[tag];
+}
+
+/* Members of a group, or every tag with a slot for ESL_GROUP_NONE */
+static uint16_t members(uint8_t group, uint8_t subevent)
+{
+	uint16_t slots = 0;
+
+	for (uint8_t slot = 0; slot < NUM_RSP_SLOTS; slot++) {
+		uint8_t g = group_of[TAG_ID(subevent, slot)];
+
+		if (group == ESL_GROUP_NONE ? g != NO_SLOT : g == group) {
+			slots |= BIT(slot);
+		}
+	}
+
+	return slots;
+}
+
+uint16_t groups_members(uint8_t group, uint8_t subevent)
+{
+	k_spinlock_key_t key;
+	uint16_t slots;
+
+	if (group >= ESL_GROUP_COUNT || subevent >= NUM_SUBEVENTS) {
+		return 0;
+	}
+
+	key = k_spin_lock(&lock);
+	slots = members(group, subevent);
+	k_spin_unlock(&lock, key);
+
+	return slots;
+}
+
+int groups_move(uint16_t tag, uint8_t group)
+{
+	struct esl_cmd_set_group cmd = { .group = group };
+	int err;
+
+	if (tag >= MAX_SYNCS || (group >= ESL_GROUP_COUNT && group != ESL_GROUP_NONE)) {
+		return -EINVAL;
+	}
+
+	if (group_of[tag] == NO_SLOT) {
+		return -ENOENT;
+	}
+
+	err = downlink_enqueue(tag, ESL_CMD_SET_GROUP, &cmd, sizeof(cmd));
+	if (err) {
+		return err;
+	}
+
+	/* Group commands sent from now on count the tag in its new group, even
+	 * before it has been told.
+	 */
+	groups_assign(tag, group);
+	registry_set_group(tag, group);
+	LOG_INF("Tag %d moved to group %d", tag, group);
+
+	return 0;
+}
+
+static int send(uint8_t group, uint8_t addr, uint8_t type, const void *data, uint8_t len)
+{
+	int queued = 0;
+
+	for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+		k_spinlock_key_t key = k_spin_lock(&lock);
+		uint16_t slots = members(group, subevent);
+		int err;
+
+		k_spin_unlock(&lock, key);
+
+		if (!slots) {
+			continue;
+		}
+
+		err = downlink_enqueue_multicast(subevent, addr, slots, type, data, len);
+		if (err) {
+			return err;
+		}
+
+		queued++;
+	}
+
+	return queued ? queued : -ENOENT;
+}
+
+int groups_send(uint8_t group, uint8_t type, const void *data, uint8_t len)
+{
+	if (group >= ESL_GROUP_COUNT) {
+		return -EINVAL;
+	}
+
+	return send(group, ESL_ADDR_GROUP(group), type, data, len);
+}
+
+int groups_broadcast(uint8_t type, const void *data, uint8_t len)
+{
+	return send(ESL_GROUP_NONE, ESL_ADDR_BROADCAST, type, data, len);
+}
@@ -0,0 +1,520 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(image_xfer, LOG_LEVEL_INF);
+
+#include "image_xfer.h"
+#include "downlink.h"
+#include "esl_packets.h"
+#include "esl_image.h"
+#include "pawr_params.h"
+
+#define BITMAP_LEN ((ESL_IMG_MAX_CHUNKS + 7) / 8)
+
+struct xfer {
+	const uint8_t *image;
+	/* Frame the tag shows, for ESL_IMG_ENC_DELTA */
+	const uint8_t *base;
+	uint16_t tag;
+	uint16_t size;
+	uint8_t id;
+	/* esl_img_crc() of the image, tells this transfer from an old one with the same id */
+	uint16_t crc;
+	uint8_t encoding;
+	uint8_t num_chunks;
+	/* Bytes of chunk data over the air for one round */
+	uint16_t coded_size;
+	/* Frame offset each coded chunk starts at */
+	uint16_t chunk_offset[ESL_IMG_MAX_CHUNKS];
+	/* Next chunk to look at in this round */
+	uint8_t cursor;
+	uint8_t round;
+	uint8_t received;
+	bool active;
+	/* The tag has reported on this transfer since the round started */
+	bool status_seen;
+	/* The last chunk of the round was acknowledged, see pump() */
+	bool settled;
+	/* Chunks still to send in this round */
+	uint8_t pending[BITMAP_LEN];
+	/* Chunks the tag last reported missing */
+	uint8_t missing[BITMAP_LEN];
+	int64_t start_ms;
+	/* Start, or the last response from the tag */
+	int64_t seen_ms;
+};
+
+static struct k_spinlock lock;
+static struct xfer xfers[IMAGE_XFER_MAX];
+static uint8_t next_id;
+static struct image_xfer_stats stats;
+
+static void expire_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(expire_work, expire_handler);
+
+static struct xfer *xfer_find(uint16_t tag)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(xfers); i++) {
+		if (xfers[i].active && xfers[i].tag == tag) {
+			return &xfers[i];
+		}
+	}
+
+	return NULL;
+}
+
+static void set_all(uint8_t *bitmap, uint8_t count)
+{
+	memset(bitmap, 0, BITMAP_LEN);
+	for (uint8_t i = 0; i < count; i++) {
+		WRITE_BIT(bitmap[i / 8], i % 8, 1);
+	}
+}
+
+/* Code chunk i of a coded transfer, the result is the same every time */
+static size_t encode_chunk(const struct xfer *x, uint8_t i, uint8_t *out, size_t *consumed)
+{
+	uint16_t offset = x->chunk_offset[i];
+	const uint8_t *base = x->encoding == ESL_IMG_ENC_DELTA ? &x->base[offset] : NULL;
+
+	return esl_rle_encode(&x->image[offset], base, x->size - offset, out, ESL_IMG_RLE_LEN,
+			      consumed);
+}
+
+/* Lay out the chunks of a coded transfer, fails if coding saves no chunk */
+static bool layout(struct xfer *x, uint8_t encoding)
+{
+	uint8_t raw_chunks = DIV_ROUND_UP(x->size, ESL_IMG_CHUNK_LEN);
+	uint8_t out[ESL_IMG_RLE_LEN];
+	uint16_t offset = 0;
+	size_t consumed;
+
+	x->encoding = encoding;
+	x->num_chunks = 0;
+	x->coded_size = 0;
+
+	while (offset < x->size) {
+		if (x->num_chunks >= raw_chunks) {
+			return false;
+		}
+
+		x->chunk_offset[x->num_chunks] = offset;
+		x->coded_size += encode_chunk(x, x->num_chunks, out, &consumed);
+		offset += consumed;
+		x->num_chunks++;
+	}
+
+	return true;
+}
+
+/* Pick the encoding with the fewest chunks */
+static void plan(struct xfer *x)
+{
+	if (x->base && layout(x, ESL_IMG_ENC_DELTA)) {
+		return;
+	}
+
+	if (layout(x, ESL_IMG_ENC_RLE)) {
+		return;
+	}
+
+	x->encoding = ESL_IMG_ENC_RAW;
+	x->num_chunks = DIV_ROUND_UP(x->size, ESL_IMG_CHUNK_LEN);
+	x->coded_size = x->size;
+}
+
+static int send_start(struct xfer *x)
+{
+	struct esl_img_start start = {
+		.image_id = x->id,
+		.size = sys_cpu_to_le16(x->size),
+		.chunk_len = ESL_IMG_CHUNK_LEN,
+		.encoding = x->encoding,
+		.num_chunks = x->num_chunks,
+		.base_crc = sys_cpu_to_le16(x->base ? esl_img_crc(x->base, x->size) : 0),
+		.crc = sys_cpu_to_le16(x->crc),
+	};
+
+	return downlink_enqueue(x->tag, ESL_CMD_IMG_START, &start, sizeof(start));
+}
+
+static void finish(struct xfer *x, bool ok)
+{
+	uint32_t elapsed_ms = k_uptime_get() - x->start_ms;
+
+	x->active = false;
+
+	if (ok) {
+		stats.completed++;
+		stats.last_ms = elapsed_ms;
+		stats.total_ms += elapsed_ms;
+		LOG_INF("Image %d to tag %d done in %u ms, %d rounds", x->id, x->tag, elapsed_ms,
+			x->round + 1);
+	} else {
+		stats.failed++;
+		LOG_WRN("Image %d to tag %d failed, %d of %d chunks", x->id, x->tag, x->received,
+			x->num_chunks);
+	}
+}
+
+/* Must be called with the lock held */
+static void pump(struct xfer *x)
+{
+	uint8_t chunk[DOWNLINK_CMD_DATA_MAX];
+	struct esl_img_chunk *hdr = (struct esl_img_chunk *)chunk;
+	struct esl_img_rle_chunk *rle = (struct esl_img_rle_chunk *)chunk;
+
+	BUILD_ASSERT(sizeof(struct esl_img_rle_chunk) + ESL_IMG_RLE_LEN <= DOWNLINK_CMD_DATA_MAX);
+
+	while (downlink_queue_depth(x->tag) + downlink_inflight(x->tag) < IMAGE_XFER_WINDOW) {
+		uint16_t offset;
+		size_t consumed;
+		uint8_t len;
+		uint8_t i = x->cursor;
+
+		while (i < x->num_chunks && !(x->pending[i / 8] & BIT(i % 8))) {
+			i++;
+		}
+
+		x->cursor = i;
+		if (i == x->num_chunks) {
+			break;
+		}
+
+		if (x->encoding == ESL_IMG_ENC_RAW) {
+			offset = i * ESL_IMG_CHUNK_LEN;
+			len = MIN(ESL_IMG_CHUNK_LEN, x->size - offset);
+
+			hdr->image_id = x->id;
+			hdr->index = i;
+			memcpy(&chunk[sizeof(*hdr)], &x->image[offset], len);
+			len += sizeof(*hdr);
+		} else {
+			rle->image_id = x->id;
+			rle->index = i;
+			rle->offset = sys_cpu_to_le16(x->chunk_offset[i]);
+			len = encode_chunk(x, i, &chunk[sizeof(*rle)], &consumed) + sizeof(*rle);
+		}
+
+		if (downlink_enqueue(x->tag, ESL_CMD_IMG_CHUNK, chunk, len)) {
+			/* Pool is busy, try again on the next response */
+			break;
+		}
+
+		WRITE_BIT(x->pending[i / 8], i % 8, 0);
+		x->cursor = i + 1;
+		stats.chunks_sent++;
+		if (x->round) {
+			stats.chunks_resent++;
+		}
+	}
+
+	if (x->cursor < x->num_chunks || downlink_queue_depth(x->tag) ||
+	    downlink_inflight(x->tag)) {
+		return;
+	}
+
+	/* Tags encode their response ahead of the event, the status that came
+	 * with the acknowledgement misses the chunks it acknowledged. The next
+	 * one has them.
+	 */
+	if (!x->settled) {
+		x->settled = true;
+		return;
+	}
+
+	/* Everything in this round went out and was acknowledged, and the tag
+	 * still misses some of it.
+	 */
+	if (++x->round >= IMAGE_XFER_MAX_ROUNDS) {
+		finish(x, false);
+		return;
+	}
+
+	if (x->status_seen) {
+		memcpy(x->pending, x->missing, sizeof(x->pending));
+	} else {
+		/* The tag never heard the start, begin again */
+		set_all(x->pending, x->num_chunks);
+		(void)send_start(x);
+	}
+
+	x->cursor = 0;
+	x->status_seen = false;
+	x->settled = false;
+}
+
+/* Must be called with the lock held */
+static void restart_full(struct xfer *x)
+{
+	/* Chunks of the delta still queued carry the old id and are ignored */
+	x->base = NULL;
+	x->id = next_id++;
+	plan(x);
+	x->cursor = 0;
+	x->round = 0;
+	x->received = 0;
+	x->status_seen = false;
+	x->settled = false;
+	set_all(x->pending, x->num_chunks);
+	set_all(x->missing, x->num_chunks);
+	stats.rejected++;
+	stats.coded_bytes += x->coded_size;
+
+	LOG_INF("Tag %d does not show the delta base, resending as image %d", x->tag, x->id);
+
+	(void)send_start(x);
+}
+
+int image_xfer_start(uint16_t tag, const uint8_t *image, const uint8_t *base, uint16_t size)
+{
+	struct xfer *x = NULL;
+	k_spinlock_key_t key;
+	int err;
+
+	if (tag >= MAX_SYNCS || !image || size == 0 || size > ESL_IMG_SIZE) {
+		return -EINVAL;
+	}
+
+	key = k_spin_lock(&lock);
+
+	if (xfer_find(tag)) {
+		k_spin_unlock(&lock, key);
+		return -EBUSY;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(xfers); i++) {
+		if (!xfers[i].active) {
+			x = &xfers[i];
+			break;
+		}
+	}
+
+	if (!x) {
+		k_spin_unlock(&lock, key);
+		return -ENOMEM;
+	}
+
+	memset(x, 0, sizeof(*x));
+	x->image = image;
+	x->base = base;
+	x->tag = tag;
+	x->size = size;
+	x->id = next_id++;
+	x->crc = esl_img_crc(image, size);
+	plan(x);
+	x->start_ms = k_uptime_get();
+	x->seen_ms = x->start_ms;
+	set_all(x->pending, x->num_chunks);
+	set_all(x->missing, x->num_chunks);
+
+	err = send_start(x);
+	if (err) {
+		k_spin_unlock(&lock, key);
+		return err;
+	}
+
+	x->active = true;
+	stats.started++;
+	stats.image_bytes += size;
+	stats.coded_bytes += x->coded_size;
+
+	if (x->num_chunks > IMAGE_XFER_BURST_CHUNKS) {
+		/* Best effort, the home subevent alone still gets it there */
+		(void)downlink_burst(tag);
+	}
+
+	pump(x);
+
+	k_spin_unlock(&lock, key);
+
+	(void)k_work_schedule(&expire_work, K_MSEC(pawr_params_sync_timeout_ms()));
+
+	LOG_INF("Image %d to tag %d: %d bytes in %d chunks, encoding %d", x->id, tag, size,
+		x->num_chunks, x->encoding);
+
+	return 0;
+}
+
+/* A tag that lost sync never reports again, nothing else ends its transfer */
+static void expire_handler(struct k_work *work)
+{
+	uint32_t timeout_ms = pawr_params_sync_timeout_ms();
+	int64_t now = k_uptime_get();
+	bool active = false;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lock);
+
+	for (size_t i = 0; i < ARRAY_SIZE(xfers); i++) {
+		struct xfer *x = &xfers[i];
+
+		if (!x->active) {
+			continue;
+		}
+
+		if (now - x->seen_ms >= (int64_t)IMAGE_XFER_LOST_TIMEOUTS * timeout_ms) {
+			LOG_WRN("Tag %d stopped responding", x->tag);
+			finish(x, false);
+			continue;
+		}
+
+		active = true;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	if (active) {
+		(void)k_work_schedule(&expire_work, K_MSEC(timeout_ms));
+	}
+}
+
+void image_xfer_abort(uint16_t tag)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	struct xfer *x = xfer_find(tag);
+
+	if (x) {
+		finish(x, false);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+void image_xfer_ingest(uint16_t tag, const struct net_buf_simple *buf)
+{
+	struct esl_img_status status;
+	const uint8_t *record;
+	k_spinlock_key_t key;
+	struct xfer *x;
+	uint8_t len;
+
+	key = k_spin_lock(&lock);
+
+	x = xfer_find(tag);
+	if (!x) {
+		k_spin_unlock(&lock, key);
+		return;
+	}
+
+	x->seen_ms = k_uptime_get();
+
+	record = esl_rsp_find(buf, ESL_RSP_IMG_STATUS, &len);
+	if (record && len >= sizeof(status)) {
+		memcpy(&status, record, sizeof(status));
+
+		/* Ids repeat, a status of an earlier transfer has another crc */
+		if (status.image_id == x->id && sys_le16_to_cpu(status.crc) == x->crc) {
+			if (status.flags & ESL_IMG_STATUS_REJECTED) {
+				restart_full(x);
+			} else if (status.flags & ESL_IMG_STATUS_CRC_FAILED) {
+				LOG_WRN("Tag %d got image %d, it does not match its crc", tag, x->id);
+				finish(x, false);
+			} else {
+				x->received = status.received;
+				x->status_seen = true;
+				memcpy(x->missing, status.missing, sizeof(x->missing));
+			}
+		}
+	}
+
+	if (!x->active) {
+		/* Failed on the status above */
+	} else if (x->received >= x->num_chunks) {
+		finish(x, true);
+	} else {
+		pump(x);
+	}
+
+	k_spin_unlock(&lock, key);
+}
+
+/* Pack part of the frame into ESL_IMG_* rows starting at bit 0 */
+static void pack_area(const uint8_t *image, uint8_t x, uint8_t y, uint8_t width, uint8_t height,
+		      uint8_t *out)
+{
+	size_t stride = DIV_ROUND_UP(width, 8);
+
+	memset(out, 0, stride * height);
+
+	for (size_t row = 0; row < height; row++) {
+		for (size_t col = 0; col < width; col++) {
+			size_t src = (y + row) * ESL_IMG_STRIDE + (x + col) / 8;
+
+			if (image[src] & BIT(7 - (x + col) % 8)) {
+				out[row * stride + col / 8] |= BIT(7 - col % 8);
+			}
+		}
+	}
+}
+
+int image_xfer_send_rect(uint16_t tag, const uint8_t *image, uint8_t x, uint8_t y,
+			 uint8_t width, uint8_t height)
+{
+	uint8_t cmd[sizeof(struct esl_cmd_rect) + ESL_RECT_PIXELS_MAX];
+	struct esl_cmd_rect *rect = (struct esl_cmd_rect *)cmd;
+	/* Widest piece that still fits ESL_RECT_ALIGN rows */
+	uint8_t piece_width = MIN(width, (ESL_RECT_PIXELS_MAX / ESL_RECT_ALIGN) * 8);
+	uint8_t piece_height = MIN(height, ROUND_DOWN(ESL_RECT_PIXELS_MAX /
+						      DIV_ROUND_UP(piece_width, 8),
+						      ESL_RECT_ALIGN));
+	int err;
+
+	if (tag >= MAX_SYNCS || !image || width == 0 || height == 0 ||
+	    x + width > ESL_IMG_WIDTH || y + height > ESL_IMG_HEIGHT ||
+	    y % ESL_RECT_ALIGN || height % ESL_RECT_ALIGN) {
+		return -EINVAL;
+	}
+
+	for (uint16_t row = 0; row < height; row += piece_height) {
+		for (uint16_t col = 0; col < width; col += piece_width) {
+			rect->x = x + col;
+			rect->y = y + row;
+			rect->width = MIN(piece_width, width - col);
+			rect->height = MIN(piece_height, height - row);
+
+			pack_area(image, rect->x, rect->y, rect->width, rect->height,
+				  &cmd[sizeof(*rect)]);
+
+			err = downlink_enqueue(tag, ESL_CMD_RECT, cmd,
+					       sizeof(*rect) +
+					       DIV_ROUND_UP(rect->width, 8) * rect->height);
+			if (err) {
+				return err;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int image_xfer_get_progress(uint16_t tag, struct image_xfer_progress *progress)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	struct xfer *x = xfer_find(tag);
+
+	if (!x) {
+		k_spin_unlock(&lock, key);
+		return -ENOENT;
+	}
+
+	progress->image_id = x->id;
+	progress->received = x->received;
+	progress->num_chunks = x->num_chunks;
+	progress->round = x->round;
+	progress->elapsed_ms = k_uptime_get() - x->start_ms;
+
+	k_spin_unlock(&lock, key);
+
+	return 0;
+}
+
+void image_xfer_get_stats(struct image_xfer_stats *out)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	*out = stats;
+	k_spin_unlock(&lock, key);
+}
@@ -4,312 +4,189 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
-#include <zephyr/bluetooth/att.h>
 #include <zephyr/bluetooth/bluetooth.h>
-#include <zephyr/bluetooth/conn.h>
-#include <zephyr/bluetooth/gatt.h>
-#include <zephyr/bluetooth/hci.h>
 #include <zephyr/logging/log.h>
 
 LOG_MODULE_REGISTER(main, LOG_LEVEL_DBG);
 
-#define NUM_RSP_SLOTS 10
-#define NUM_SUBEVENTS 10
-#define PACKET_SIZE   32
-#define NAME_LEN      30
-
-static K_SEM_DEFINE(sem_connected, 0, 1);
-static K_SEM_DEFINE(sem_discovered, 0, 1);
-static K_SEM_DEFINE(sem_written, 0, 1);
-static K_SEM_DEFINE(sem_disconnected, 0, 1);
-
-struct k_poll_event events[] = {
-	K_POLL_EVENT_STATIC_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY,
-					&sem_connected, 0),
-	K_POLL_EVENT_STATIC_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY,
-					&sem_disconnected, 0),
-};
-
-static struct bt_uuid_128 pawr_char_uuid =
-    BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x12345678, 0x1234, 0x5678, 0x1234, 0x56789abcdef1));
-static uint16_t pawr_attr_handle;
-
-/* Periodic advertising interval in 1.25ms units */
-#define PER_ADV_INT_MIN 0x1F40
-/* Periodic advertising interval in 1.25ms units */
-#define PER_ADV_INT_MAX 0x1F40
-/* Periodic advertising subevent interval in 1.25ms units */
-#define SUBEVENT_INTERVAL 0xFF
-/* Periodic advertising subevent response delay in 1.25ms units */
-#define RESPONSE_SLOT_DELAY 0x7C
-/* Periodic advertising response slot spacing in 0.125ms units */
-#define RESPONSE_SLOT_SPACING 0x10
-
-/* Validate interval range overlap with Controller */
-BUILD_ASSERT(PER_ADV_INT_MAX >= BT_GAP_PER_ADV_MIN_INTERVAL,
-            "Periodic advertising maximum interval must overlap with Controller's minimum.");
-BUILD_ASSERT(PER_ADV_INT_MIN <= BT_GAP_PER_ADV_MAX_INTERVAL,
-            "Periodic advertising minimum interval must overlap with Controller's maximum.");
-
-/* Validate that interval min <= max */
-BUILD_ASSERT(PER_ADV_INT_MIN <= PER_ADV_INT_MAX,
-            "Periodic advertising minimum interval must not exceed maximum interval");
-
-/* If num_subevents is not 0, validate subevent interval */
-#if (NUM_SUBEVENTS > 0)
-BUILD_ASSERT(SUBEVENT_INTERVAL <= (PER_ADV_INT_MIN / NUM_SUBEVENTS),
-            "Subevent interval must be <= periodic advertising interval min divided by num subevents");
-#endif
-
-/* Validate response slot delay against subevent interval */
-#if (NUM_SUBEVENTS > 0)
-BUILD_ASSERT(RESPONSE_SLOT_DELAY < SUBEVENT_INTERVAL,
-            "Response slot delay must be less than subevent interval");
-#endif
-
-/* Validate response slot spacing when multiple response slots are used */
-#if (NUM_RSP_SLOTS > 1)
-BUILD_ASSERT(RESPONSE_SLOT_SPACING <= (10 * (SUBEVENT_INTERVAL - RESPONSE_SLOT_DELAY) / NUM_RSP_SLOTS),
-            "Response slot spacing exceeds maximum allowed value");
-#endif
-
-/* Range checks for individual parameters */
-#if (NUM_SUBEVENTS > 0)
-BUILD_ASSERT(SUBEVENT_INTERVAL >= 0x6 && SUBEVENT_INTERVAL <= 0xFF,
-            "Subevent interval not in valid range (0x6 to 0xFF)");
-#endif
-
-#if (NUM_RSP_SLOTS > 0)
-BUILD_ASSERT(RESPONSE_SLOT_DELAY >= 0x1 && RESPONSE_SLOT_DELAY <= 0xFE,
-            "Response slot delay not in valid range (0x1 to 0xFE)");
-
-BUILD_ASSERT(RESPONSE_SLOT_SPACING >= 0x2 && RESPONSE_SLOT_SPACING <= 0xFF,
-            "Response slot spacing not in valid range (0x2 to 0xFF)");
-#endif
-
-static const struct bt_le_per_adv_param per_adv_params = {
-    .interval_min = PER_ADV_INT_MIN,
-    .interval_max = PER_ADV_INT_MAX,
-    .options = 0,
-    .num_subevents = NUM_SUBEVENTS,
-    .subevent_interval = SUBEVENT_INTERVAL,
-    .response_slot_delay = RESPONSE_SLOT_DELAY,
-    .response_slot_spacing = RESPONSE_SLOT_SPACING,
-    .num_response_slots = NUM_RSP_SLOTS,
-};
+#include "pawr_params.h"
+#include "adaptive.h"
+#include "balance.h"
+#include "coord.h"
+#include "downlink.h"
+#include "onboarding.h"
+#include "registry.h"
+#include "telemetry.h"
+#include "image_xfer.h"
+#include "esl_packets.h"
+#include "esl_pool.h"
+
+#define PACKET_SIZE   ESL_PAYLOAD_MAX_LEN
+/* Payload blocks out at once, one per subevent of a request so a batch is only
+ * ever split by the command length. Empty subevents need none and a batch
+ * gives its blocks back once it is handed over; the subevent_pool high-water
+ * mark in esl pool shows how many a load really takes.
+ */
+#define SUBEVENT_BUFS TRAIN_SUBEVENTS
 
-static struct bt_le_per_adv_subevent_data_params subevent_data_params[NUM_SUBEVENTS];
-static struct net_buf_simple bufs[NUM_SUBEVENTS];
-static uint8_t backing_store[NUM_SUBEVENTS][PACKET_SIZE];
+/* Data requests of the trains come in one at a time from the host's RX thread,
+ * so one set of buffers serves them all.
+ */
+static struct bt_le_per_adv_subevent_data_params subevent_data_params[TRAIN_SUBEVENTS];
+static struct net_buf_simple bufs[TRAIN_SUBEVENTS];
+ESL_POOL_DEFINE(subevent_pool, PACKET_SIZE, SUBEVENT_BUFS);
+/* What subevents with nothing queued point to */
+NET_BUF_SIMPLE_DEFINE_STATIC(empty_buf, 1);
 
 BUILD_ASSERT(ARRAY_SIZE(bufs) == ARRAY_SIZE(subevent_data_params));
-BUILD_ASSERT(ARRAY_SIZE(backing_store) == ARRAY_SIZE(subevent_data_params));
 
-static uint8_t counter;
+/* LE Set Periodic Advertising Subevent Data is limited to 255 parameter bytes:
+ * a 2 byte header plus a 5 byte header and the payload for every subevent.
+ */
+#define SUBEVENT_DATA_CMD_MAX  255
+#define SUBEVENT_DATA_CMD_HDR  2
+#define SUBEVENT_DATA_ELEM_HDR 5
 
-static void request_cb(struct bt_le_ext_adv *adv, const struct bt_le_per_adv_data_request *request)
+BUILD_ASSERT(SUBEVENT_DATA_CMD_HDR + SUBEVENT_DATA_ELEM_HDR + PACKET_SIZE <= SUBEVENT_DATA_CMD_MAX,
+	     "A full subevent payload must fit in one HCI command");
+
+static void set_subevent_data(struct bt_le_ext_adv *adv, uint8_t count,
+			      const struct bt_le_per_adv_subevent_data_params *params)
 {
 	int err;
-	uint8_t to_send;
-	struct net_buf_simple *buf;
 
-	to_send = MIN(request->count, ARRAY_SIZE(subevent_data_params));
-
-	for (size_t i = 0; i < to_send; i++) {
-		buf = &bufs[i];
-		buf->data[buf->len - 1] = counter++;
-
-		subevent_data_params[i].subevent =
-			(request->start + i) % per_adv_params.num_subevents;
-		subevent_data_params[i].response_slot_start = 0;
-		subevent_data_params[i].response_slot_count = NUM_RSP_SLOTS;
-		subevent_data_params[i].data = buf;
+	if (count == 0) {
+		return;
 	}
 
-	err = bt_le_per_adv_set_subevent_data(adv, to_send, subevent_data_params);
+	err = bt_le_per_adv_set_subevent_data(adv, count, params);
 	if (err) {
 		LOG_ERR("Failed to set subevent data (err %d)", err);
 	}
 }
 
-static bool print_ad_field(struct bt_data *data, void *user_data)
+/* Hand a batch to the controller, which copies it, and give its blocks back */
+static void send_batch(struct bt_le_ext_adv *adv, size_t start, size_t end)
 {
-	ARG_UNUSED(user_data);
-
-	char data_type[6];
-	snprintf(data_type, 6, "0x%02X:", data->type);
-	LOG_HEXDUMP_DBG(data->data, data->data_len, data_type);
+	set_subevent_data(adv, end - start, &subevent_data_params[start]);
 
-	return true;
-}
-
-static struct bt_conn *default_conn;
-
-static void response_cb(struct bt_le_ext_adv *adv, struct bt_le_per_adv_response_info *info,
-		     struct net_buf_simple *buf)
-{
-	if (buf) {
-		LOG_INF("Response: subevent %d, slot %d", info->subevent, info->response_slot);
-		bt_data_parse(buf, print_ad_field, NULL);
+	for (size_t i = start; i < end; i++) {
+		if (bufs[i].__buf) {
+			esl_pool_buf_free(&subevent_pool, &bufs[i]);
+		}
 	}
 }
 
-static const struct bt_le_ext_adv_cb adv_cb = {
-	.pawr_data_request = request_cb,
-	.pawr_response = response_cb,
-};
-
-void connected_cb(struct bt_conn *conn, uint8_t err)
+static void request_cb(struct bt_le_ext_adv *adv, const struct bt_le_per_adv_data_request *request)
 {
-	LOG_INF("Connected (err 0x%02X)", err);
-
-	__ASSERT(conn == default_conn, "Unexpected connected callback");
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	int train = pawr_params_train(adv);
+	uint8_t to_send;
+	uint8_t subevent;
+	uint8_t local;
+	size_t batch_start = 0;
+	size_t cmd_len = SUBEVENT_DATA_CMD_HDR;
+	struct net_buf_simple *buf;
 
-	if (err) {
-		bt_conn_unref(default_conn);
-		default_conn = NULL;
+	if (train < 0) {
+		return;
 	}
-}
-
-void disconnected_cb(struct bt_conn *conn, uint8_t reason)
-{
-	LOG_INF("Disconnected, reason 0x%02X %s", reason, bt_hci_err_to_str(reason));
-
-	k_sem_give(&sem_disconnected);
-}
 
-void remote_info_available_cb(struct bt_conn *conn, struct bt_conn_remote_info *remote_info)
-{
-	/* Need to wait for remote info before initiating PAST */
-	k_sem_give(&sem_connected);
-}
-
-BT_CONN_CB_DEFINE(conn_cb) = {
-	.connected = connected_cb,
-	.disconnected = disconnected_cb,
-	.remote_info_available = remote_info_available_cb,
-};
-
-static bool data_cb(struct bt_data *data, void *user_data)
-{
-	char *name = user_data;
-	uint8_t len;
-
-	switch (data->type) {
-	case BT_DATA_NAME_SHORTENED:
-	case BT_DATA_NAME_COMPLETE:
-		len = MIN(data->data_len, NAME_LEN - 1);
-		memcpy(name, data->data, len);
-		name[len] = '\0';
-		return false;
-	default:
-		return true;
-	}
-}
+	to_send = MIN(request->count, ARRAY_SIZE(subevent_data_params));
 
-static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
-			 struct net_buf_simple *ad)
-{
-	char addr_str[BT_ADDR_LE_STR_LEN];
-	char name[NAME_LEN];
-	int err;
+	for (size_t i = 0; i < to_send; i++) {
+		local = (request->start + i) % param->num_subevents;
+		subevent = SUBEVENT_ID(train, local);
 
-	if (default_conn) {
-		return;
-	}
+		/* Out of blocks, every one of them is in this batch */
+		buf = &bufs[i];
+		if (esl_pool_buf_alloc(&subevent_pool, buf)) {
+			send_batch(adv, batch_start, i);
+			batch_start = i;
+			cmd_len = SUBEVENT_DATA_CMD_HDR;
+			if (esl_pool_buf_alloc(&subevent_pool, buf)) {
+				buf = &empty_buf;
+			}
+		}
 
-	/* We're only interested in connectable events */
-	if (type != BT_GAP_ADV_TYPE_ADV_IND && type != BT_GAP_ADV_TYPE_ADV_DIRECT_IND) {
-		return;
-	}
+		/* Also for empty_buf, which it leaves empty, so the events of
+		 * the subevent are counted
+		 */
+		downlink_build_subevent(subevent, buf);
+		telemetry_subevent_event(subevent);
 
-	(void)memset(name, 0, sizeof(name));
-	bt_data_parse(ad, data_cb, name);
+		/* Subevents with nothing queued go out as empty PDUs, which keeps
+		 * the response slots open for uplink without spending airtime on
+		 * a payload nobody needs.
+		 */
+		if (buf->len == 0 && buf != &empty_buf) {
+			esl_pool_buf_free(&subevent_pool, buf);
+			buf = &empty_buf;
+		}
 
-	if (strcmp(name, "PAwR sync sample")) {
-		return;
-	}
+		/* Full payloads for every subevent do not fit in one command,
+		 * hand over what has been built so far and start a new batch.
+		 */
+		if (cmd_len + SUBEVENT_DATA_ELEM_HDR + buf->len > SUBEVENT_DATA_CMD_MAX) {
+			send_batch(adv, batch_start, i);
+			batch_start = i;
+			cmd_len = SUBEVENT_DATA_CMD_HDR;
+		}
+		cmd_len += SUBEVENT_DATA_ELEM_HDR + buf->len;
 
-	if (bt_le_scan_stop()) {
-		return;
+		subevent_data_params[i].subevent = local;
+		subevent_data_params[i].response_slot_start = 0;
+		subevent_data_params[i].response_slot_count = param->num_response_slots;
+		subevent_data_params[i].data = buf;
 	}
 
-	err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN, BT_LE_CONN_PARAM_DEFAULT,
-				&default_conn);
-	if (err) {
-		LOG_ERR("Create conn to %s failed (%u)", addr_str, err);
-	}
+	send_batch(adv, batch_start, to_send);
 }
 
-static uint8_t discover_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
-			     struct bt_gatt_discover_params *params)
+static void response_cb(struct bt_le_ext_adv *adv, struct bt_le_per_adv_response_info *info,
+		     struct net_buf_simple *buf)
 {
-	struct bt_gatt_chrc *chrc;
-	char str[BT_UUID_STR_LEN];
+	int train = pawr_params_train(adv);
+	uint16_t tag;
 
-	LOG_INF("Discovery: attr %p", attr);
-
-	if (!attr) {
-		return BT_GATT_ITER_STOP;
-	}
-
-	chrc = (struct bt_gatt_chrc *)attr->user_data;
-
-	bt_uuid_to_str(chrc->uuid, str, sizeof(str));
-	LOG_INF("UUID %s", str);
-
-	if (!bt_uuid_cmp(chrc->uuid, &pawr_char_uuid.uuid)) {
-		pawr_attr_handle = chrc->value_handle;
-
-		LOG_INF("Characteristic handle: %d", pawr_attr_handle);
-
-		k_sem_give(&sem_discovered);
+	if (train < 0 || info->subevent >= TRAIN_SUBEVENTS ||
+	    info->response_slot >= NUM_RSP_SLOTS) {
+		return;
 	}
 
-	return BT_GATT_ITER_STOP;
-}
-
-static void write_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
-{
-	if (err) {
-		LOG_ERR("Write failed (err %d)", err);
+	tag = TAG_ID(SUBEVENT_ID(train, info->subevent), info->response_slot);
+	downlink_report(tag);
 
+	/* Nobody answers in a free slot, and a tag sleeping until the next hint
+	 * is not missing
+	 */
+	if (!buf && (!onboarding_slot_assigned(tag) || downlink_asleep(tag))) {
 		return;
 	}
 
-	k_sem_give(&sem_written);
-}
+	/* Runs for every response slot, so no logging here */
+	telemetry_ingest(tag, info, buf);
 
-void init_bufs(void)
-{
-	for (size_t i = 0; i < ARRAY_SIZE(backing_store); i++) {
-		backing_store[i][0] = ARRAY_SIZE(backing_store[i]) - 1;
-		backing_store[i][1] = BT_DATA_MANUFACTURER_DATA;
-		backing_store[i][2] = 0x59; /* Nordic */
-		backing_store[i][3] = 0x00;
-
-		net_buf_simple_init_with_data(&bufs[i], &backing_store[i],
-					      ARRAY_SIZE(backing_store[i]));
+	if (buf) {
+		balance_count(tag, buf->len);
+		downlink_ack(tag);
+		downlink_ingest(tag, buf);
+		onboarding_tag_responded(tag);
+		image_xfer_ingest(tag, buf);
+	} else {
+		downlink_nack(tag);
 	}
 }
 
-#define MAX_SYNCS (NUM_SUBEVENTS * NUM_RSP_SLOTS)
-struct pawr_timing {
-	uint8_t subevent;
-	uint8_t response_slot;
-} __packed;
-
-static uint8_t num_synced;
+static const struct bt_le_ext_adv_cb adv_cb = {
+	.pawr_data_request = request_cb,
+	.pawr_response = response_cb,
+};
 
 int main(void)
 {
 	int err;
-	struct bt_le_ext_adv *pawr_adv;
-	struct bt_gatt_discover_params discover_params;
-	struct bt_gatt_write_params write_params;
-	struct pawr_timing sync_config;
-
-	init_bufs();
+	struct bt_le_ext_adv *pawr_adv[NUM_TRAINS];
 
 	LOG_INF("Starting Periodic Advertising Demo");
 
@@ -320,138 +197,51 @@ int main(void)
 		return 0;
 	}
 
-	/* Create a non-connectable advertising set */
-	err = bt_le_ext_adv_create(BT_LE_EXT_ADV_NCONN, &adv_cb, &pawr_adv);
-	if (err) {
-		LOG_ERR("Failed to create advertising set (err %d)", err);
-		return 0;
+	/* Create a non-connectable advertising set per train. They use the
+	 * identity address rather than a fresh private one, so registered tags
+	 * find their train again after a restart, and each train gets its own
+	 * SID to tell them apart.
+	 */
+	for (uint8_t train = 0; train < NUM_TRAINS; train++) {
+		struct bt_le_adv_param param = BT_LE_ADV_PARAM_INIT(
+			BT_LE_ADV_OPT_EXT_ADV | BT_LE_ADV_OPT_USE_IDENTITY,
+			BT_GAP_ADV_FAST_INT_MIN_2, BT_GAP_ADV_FAST_INT_MAX_2, NULL);
+
+		param.sid = train;
+
+		err = bt_le_ext_adv_create(&param, &adv_cb, &pawr_adv[train]);
+		if (err) {
+			LOG_ERR("Failed to create advertising set %d (err %d)", train, err);
+			return 0;
+		}
 	}
 
 	/* Set periodic advertising parameters */
-	err = bt_le_per_adv_set_param(pawr_adv, &per_adv_params);
+	err = pawr_params_init(pawr_adv);
 	if (err) {
 		LOG_ERR("Failed to set periodic advertising parameters (err %d)", err);
 		return 0;
 	}
 
-	/* Enable Periodic Advertising */
-	LOG_INF("Start Periodic Advertising");
-	err = bt_le_per_adv_start(pawr_adv);
+	/* Enable Periodic and Extended Advertising, staggered per train */
+	LOG_INF("Start Periodic Advertising on %d trains", NUM_TRAINS);
+	err = pawr_params_start();
 	if (err) {
 		LOG_ERR("Failed to enable periodic advertising (err %d)", err);
 		return 0;
 	}
 
-	LOG_INF("Start Extended Advertising");
-	err = bt_le_ext_adv_start(pawr_adv, BT_LE_EXT_ADV_START_DEFAULT);
-	if (err) {
-		LOG_ERR("Failed to start extended advertising (err %d)", err);
-		return 0;
-	}
+	adaptive_start();
+	balance_start();
 
-	while (num_synced < MAX_SYNCS) {
-		/* Enable continuous scanning */
-		err = bt_le_scan_start(BT_LE_SCAN_PASSIVE_CONTINUOUS, device_found);
-		if (err) {
-			LOG_ERR("Scanning failed to start (err %d)", err);
-			return 0;
-		}
-
-		LOG_INF("Scanning successfully started");
+	/* Without it tags are still onboarded, into new slots after a restart */
+	(void)registry_init();
 
-		/* Wait for either remote info available or involuntary disconnect */
-		k_poll(events, ARRAY_SIZE(events), K_FOREVER);
-		err = k_sem_take(&sem_connected, K_NO_WAIT);
-		if (err) {
-			LOG_ERR("Disconnected before remote info available");
+	/* Works on its own without a link to other centrals */
+	(void)coord_start();
 
-			goto disconnected;
-		}
-
-		err = bt_le_per_adv_set_info_transfer(pawr_adv, default_conn, 0);
-		if (err) {
-			LOG_ERR("Failed to send PAST (err %d)", err);
-
-			goto disconnect;
-		}
-
-		LOG_INF("PAST sent");
-
-		discover_params.uuid = &pawr_char_uuid.uuid;
-		discover_params.func = discover_func;
-		discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
-		discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
-		discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
-		err = bt_gatt_discover(default_conn, &discover_params);
-		if (err) {
-			LOG_ERR("Discovery failed (err %d)", err);
-
-			goto disconnect;
-		}
-
-		LOG_INF("Discovery started");
-
-		err = k_sem_take(&sem_discovered, K_SECONDS(10));
-		if (err) {
-			LOG_ERR("Timed out during GATT discovery");
-
-			goto disconnect;
-		}
-
-		sync_config.subevent = num_synced % NUM_SUBEVENTS;
-		sync_config.response_slot = num_synced / NUM_SUBEVENTS;
-		num_synced++;
-
-		write_params.func = write_func;
-		write_params.handle = pawr_attr_handle;
-		write_params.offset = 0;
-		write_params.data = &sync_config;
-		write_params.length = sizeof(sync_config);
-
-		err = bt_gatt_write(default_conn, &write_params);
-		if (err) {
-			LOG_ERR("Write failed (err %d)", err);
-			num_synced--;
-
-			goto disconnect;
-		}
-
-		LOG_INF("Write started");
-
-		err = k_sem_take(&sem_written, K_SECONDS(10));
-		if (err) {
-			LOG_ERR("Timed out during GATT write");
-			num_synced--;
-
-			goto disconnect;
-		}
-
-		LOG_INF("PAwR config written to sync %d, disconnecting", num_synced - 1);
-
-disconnect:
-		/* Adding delay (2ms * interval value, using 2ms intead of the 1.25ms
-		 * used by controller) to ensure sync is established before
-		 * disconnection.
-		 */
-		k_sleep(K_MSEC(per_adv_params.interval_max * 2));
-
-		err = bt_conn_disconnect(default_conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
-		if (err != 0 && err != -ENOTCONN) {
-			return 0;
-		}
-
-disconnected:
-		k_sem_take(&sem_disconnected, K_FOREVER);
-
-		bt_conn_unref(default_conn);
-		default_conn = NULL;
-	}
-
-	LOG_INF("Maximum numnber of syncs onboarded");
-
-	while (true) {
-		k_sleep(K_SECONDS(1));
-	}
+	/* Does not return, keeps onboarding tags as slots free up */
+	onboarding_run();
 
 	return 0;
 }
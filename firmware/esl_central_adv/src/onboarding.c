@@ -0,0 +1,1220 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/bluetooth/att.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <zephyr/bluetooth/hci.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(onboarding, LOG_LEVEL_INF);
+
+#include "onboarding.h"
+#include "pawr_params.h"
+#include "groups.h"
+#include "registry.h"
+#include "telemetry.h"
+#include "balance.h"
+#include "coord.h"
+#include "downlink.h"
+#include "image_xfer.h"
+#include "esl_packets.h"
+
+#define NAME_LEN           30
+#define NUM_CTX            CONFIG_BT_MAX_CONN
+#define CONNECT_TIMEOUT_MS 5000
+#define GATT_TIMEOUT_MS    10000
+#define HANDLE_CACHE_SIZE  4
+/* Events without a response before a registered tag counts as lost */
+#define LOST_EVENTS        32
+/* How often to look for lost tags while no slot is free */
+#define LOST_CHECK_MS      5000
+/* Sync timeouts to wait for a moved tag in its new slot, covers the retries */
+#define MOVE_TIMEOUTS      16
+
+static struct bt_uuid_128 pawr_char_uuid =
+	BT_UUID_INIT_128(BT_UUID_128_ENCODE(0x12345678, 0x1234, 0x5678, 0x1234, 0x56789abcdef1));
+
+/* Tags with the same firmware version have the same attribute layout, so the
+ * characteristic handle is discovered once per version and written directly
+ * on every later tag. Tags that do not advertise a version are always
+ * discovered.
+ */
+struct handle_cache_entry {
+	uint16_t fw_version;
+	uint16_t handle;
+	uint32_t last_used;
+};
+
+static struct handle_cache_entry handle_cache[HANDLE_CACHE_SIZE];
+static uint32_t handle_cache_seq;
+
+enum onboard_state {
+	ONBOARD_IDLE,
+	ONBOARD_CONNECTING,
+	ONBOARD_REMOTE_INFO,
+	ONBOARD_DISCOVERING,
+	ONBOARD_WRITING,
+	ONBOARD_WAIT_SYNC,
+	ONBOARD_DISCONNECTING,
+};
+
+struct onboard_ctx {
+	struct bt_conn *conn;
+	enum onboard_state state;
+	struct pawr_timing timing;
+	bt_addr_le_t addr;
+	uint16_t tag;
+	/* The tag came back to the slot the registry holds for it */
+	bool registered;
+	uint16_t fw_version;
+	uint16_t attr_handle;
+	/* attr_handle came from the cache rather than discovery on this link */
+	bool cached_handle;
+	/* Timing was written, the slot stays assigned even if the link drops */
+	bool configured;
+	bool confirmed;
+	/* Timing changed while the tag was being worked on, its slot is gone */
+	bool stale;
+	int64_t started;
+	int64_t deadline;
+	struct bt_gatt_discover_params discover_params;
+	struct bt_gatt_write_params write_params;
+	struct bt_gatt_subscribe_params subscribe_params;
+};
+
+enum onboard_evt_type {
+	EVT_FOUND,
+	EVT_CONNECTED,
+	EVT_REMOTE_INFO,
+	EVT_DISCOVERED,
+	EVT_WRITTEN,
+	EVT_SYNCED,
+	EVT_DISCONNECTED,
+	EVT_RESET,
+	EVT_FORGET,
+	EVT_MOVE,
+	/* Only wakes the thread to update scanning, see onboarding_resume() */
+	EVT_RESUME,
+};
+
+struct onboard_evt {
+	uint8_t type;
+	uint8_t ctx;
+	uint8_t err;
+	uint16_t value;
+	/* Target subevent of EVT_MOVE */
+	uint8_t subevent;
+	bt_addr_le_t addr;
+};
+
+K_MSGQ_DEFINE(evt_q, sizeof(struct onboard_evt), 16, 4);
+
+static struct onboard_ctx ctxs[NUM_CTX];
+/* Every slot of the current timing has been handed out */
+static bool complete;
+
+/* Slots handed out to tags */
+static ATOMIC_DEFINE(assigned, MAX_SYNCS);
+/* Tags configured but not yet seen in their response slot */
+static ATOMIC_DEFINE(awaiting_sync, MAX_SYNCS);
+/* Set while a found device is queued or a connection is being created */
+static atomic_t connecting;
+/* Nesting count of onboarding_pause() */
+static atomic_t paused;
+/* Group given to tags onboarded from now on */
+static uint8_t onboard_group = ESL_GROUP_NONE;
+
+/* Tag told to move with ESL_CMD_MOVE, one at a time */
+static struct {
+	uint16_t from;
+	uint16_t to;
+	int64_t deadline;
+} move;
+
+static struct onboarding_stats stats;
+
+struct adv_info {
+	char name[NAME_LEN];
+	uint16_t fw_version;
+};
+
+static uint16_t handle_cache_lookup(uint16_t fw_version)
+{
+	if (fw_version == 0) {
+		return 0;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(handle_cache); i++) {
+		if (handle_cache[i].handle && handle_cache[i].fw_version == fw_version) {
+			handle_cache[i].last_used = ++handle_cache_seq;
+			return handle_cache[i].handle;
+		}
+	}
+
+	return 0;
+}
+
+static void handle_cache_store(uint16_t fw_version, uint16_t handle)
+{
+	struct handle_cache_entry *entry = NULL;
+
+	if (fw_version == 0) {
+		return;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(handle_cache); i++) {
+		if (handle_cache[i].fw_version == fw_version) {
+			entry = &handle_cache[i];
+			break;
+		}
+	}
+
+	/* Otherwise take an empty or the least recently used entry */
+	for (size_t i = 0; !entry && i < ARRAY_SIZE(handle_cache); i++) {
+		if (!handle_cache[i].handle) {
+			entry = &handle_cache[i];
+		}
+	}
+
+	if (!entry) {
+		entry = &handle_cache[0];
+		for (size_t i = 1; i < ARRAY_SIZE(handle_cache); i++) {
+			if (handle_cache[i].last_used < entry->last_used) {
+				entry = &handle_cache[i];
+			}
+		}
+	}
+
+	entry->fw_version = fw_version;
+	entry->handle = handle;
+	entry->last_used = ++handle_cache_seq;
+}
+
+static void handle_cache_invalidate(uint16_t fw_version)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(handle_cache); i++) {
+		if (handle_cache[i].fw_version == fw_version) {
+			handle_cache[i].handle = 0;
+		}
+	}
+}
+
+static void post(uint8_t type, struct onboard_ctx *ctx, uint8_t err, uint16_t value)
+{
+	struct onboard_evt evt = {
+		.type = type,
+		.ctx = ctx - ctxs,
+		.err = err,
+		.value = value,
+	};
+
+	if (k_msgq_put(&evt_q, &evt, K_NO_WAIT)) {
+		LOG_ERR("Onboarding event queue full, dropping event %d", type);
+	}
+}
+
+static struct onboard_ctx *ctx_from_conn(struct bt_conn *conn)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (ctxs[i].conn == conn) {
+			return &ctxs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct onboard_ctx *ctx_free(void)
+{
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (ctxs[i].state == ONBOARD_IDLE) {
+			return &ctxs[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int subevent_slot_alloc(uint8_t subevent)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+
+	for (uint8_t slot = 0; slot < param->num_response_slots; slot++) {
+		if (!atomic_test_and_set_bit(assigned, TAG_ID(subevent, slot))) {
+			return TAG_ID(subevent, slot);
+		}
+	}
+
+	return -ENOMEM;
+}
+
+static bool subevent_empty(uint8_t subevent)
+{
+	for (uint8_t slot = 0; slot < NUM_RSP_SLOTS; slot++) {
+		if (atomic_test_bit(assigned, TAG_ID(subevent, slot))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint8_t subevent_tags(uint8_t subevent)
+{
+	uint8_t tags = 0;
+
+	for (uint8_t slot = 0; slot < NUM_RSP_SLOTS; slot++) {
+		tags += atomic_test_bit(assigned, TAG_ID(subevent, slot));
+	}
+
+	return tags;
+}
+
+static int slot_alloc(uint8_t group)
+{
+	const struct bt_le_per_adv_param *param = pawr_params_get();
+	uint32_t total_load = 0;
+	uint32_t total_tags = 0;
+	uint32_t avg_load;
+	uint32_t best_score = 0;
+	uint8_t best_tags = 0;
+	uint8_t best;
+	int tag;
+
+	/* Members of a group share subevents where they can, so one transmission
+	 * reaches all of them: next to other members first, then in a subevent of
+	 * their own.
+	 */
+	if (group != ESL_GROUP_NONE) {
+		for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+			if (pawr_params_subevent_active(subevent) &&
+			    groups_members(group, subevent)) {
+				tag = subevent_slot_alloc(subevent);
+				if (tag >= 0) {
+					return tag;
+				}
+			}
+		}
+
+		for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+			if (pawr_params_subevent_active(subevent) && subevent_empty(subevent)) {
+				return subevent_slot_alloc(subevent);
+			}
+		}
+	}
+
+	/* The subevent with room whose load grows least, counting a new tag as an
+	 * average one until its own traffic shows, then the one with fewest tags.
+	 * Without traffic yet that fills subevents breadth first.
+	 */
+	for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+		if (!pawr_params_subevent_active(subevent)) {
+			continue;
+		}
+
+		total_load += balance_subevent_load(subevent);
+		total_tags += subevent_tags(subevent);
+	}
+	avg_load = total_tags ? total_load / total_tags : 0;
+
+	best = ESL_SUBEVENT_NONE;
+	for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+		uint8_t tags = subevent_tags(subevent);
+		uint32_t score = balance_subevent_load(subevent) + tags * avg_load;
+
+		if (!pawr_params_subevent_active(subevent) || tags >= param->num_response_slots) {
+			continue;
+		}
+
+		if (best == ESL_SUBEVENT_NONE || score < best_score ||
+		    (score == best_score && tags < best_tags)) {
+			best = subevent;
+			best_score = score;
+			best_tags = tags;
+		}
+	}
+
+	if (best == ESL_SUBEVENT_NONE) {
+		return -ENOMEM;
+	}
+
+	return subevent_slot_alloc(best);
+}
+
+static void slot_free(uint16_t tag)
+{
+	atomic_clear_bit(assigned, tag);
+	groups_release(tag);
+}
+
+/* Registered tags keep their slots, they come back to them after losing sync */
+static void slots_restore(void)
+{
+	struct registry_entry entry;
+
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		if (registry_get(tag, &entry)) {
+			continue;
+		}
+
+		/* The timing has fewer slots now, the tag gets a new one */
+		if (!pawr_params_tag_active(tag)) {
+			registry_remove(tag);
+			continue;
+		}
+
+		atomic_set_bit(assigned, tag);
+		groups_assign(tag, entry.group);
+	}
+}
+
+static bool slots_available(void)
+{
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		if (pawr_params_tag_active(tag) && !atomic_test_bit(assigned, tag)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* A registered tag stopped responding, it comes back advertising */
+static bool tags_lost(void)
+{
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		if (registry_known(tag) && pawr_params_tag_active(tag) &&
+		    telemetry_age(tag) >= LOST_EVENTS) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void connected_cb(struct bt_conn *conn, uint8_t err)
+{
+	struct onboard_ctx *ctx = ctx_from_conn(conn);
+
+	LOG_INF("Connected (err 0x%02X)", err);
+
+	if (ctx) {
+		post(EVT_CONNECTED, ctx, err, 0);
+	}
+}
+
+static void disconnected_cb(struct bt_conn *conn, uint8_t reason)
+{
+	struct onboard_ctx *ctx = ctx_from_conn(conn);
+
+	LOG_INF("Disconnected, reason 0x%02X %s", reason, bt_hci_err_to_str(reason));
+
+	if (ctx) {
+		post(EVT_DISCONNECTED, ctx, reason, 0);
+	}
+}
+
+static void remote_info_available_cb(struct bt_conn *conn, struct bt_conn_remote_info *remote_info)
+{
+	struct onboard_ctx *ctx = ctx_from_conn(conn);
+
+	/* Need to wait for remote info before initiating PAST */
+	if (ctx) {
+		post(EVT_REMOTE_INFO, ctx, 0, 0);
+	}
+}
+
+BT_CONN_CB_DEFINE(conn_cb) = {
+	.connected = connected_cb,
+	.disconnected = disconnected_cb,
+	.remote_info_available = remote_info_available_cb,
+};
+
+static bool data_cb(struct bt_data *data, void *user_data)
+{
+	struct adv_info *info = user_data;
+	uint8_t len;
+
+	switch (data->type) {
+	case BT_DATA_NAME_SHORTENED:
+	case BT_DATA_NAME_COMPLETE:
+		len = MIN(data->data_len, NAME_LEN - 1);
+		memcpy(info->name, data->data, len);
+		info->name[len] = '\0';
+		return true;
+	case BT_DATA_MANUFACTURER_DATA:
+		if (data->data_len >= sizeof(struct esl_adv_info) &&
+		    sys_get_le16(data->data) == ESL_COMPANY_ID) {
+			info->fw_version = sys_get_le16(&data->data[2]);
+		}
+		return true;
+	default:
+		return true;
+	}
+}
+
+static void device_found(const bt_addr_le_t *addr, int8_t rssi, uint8_t type,
+			 struct net_buf_simple *ad)
+{
+	struct onboard_evt evt = {
+		.type = EVT_FOUND,
+	};
+	struct adv_info info;
+	bool registered;
+
+	/* We're only interested in connectable events */
+	if (type != BT_GAP_ADV_TYPE_ADV_IND && type != BT_GAP_ADV_TYPE_ADV_DIRECT_IND) {
+		return;
+	}
+
+	(void)memset(&info, 0, sizeof(info));
+	bt_data_parse(ad, data_cb, &info);
+
+	if (strcmp(info.name, "PAwR sync sample")) {
+		return;
+	}
+
+	/* Another central may hear it better, see coord.h */
+	registered = registry_lookup(addr) >= 0;
+	if ((!registered && !slots_available()) || coord_claim(addr, rssi, registered)) {
+		return;
+	}
+
+	/* Only one connection can be created at a time */
+	if (!atomic_cas(&connecting, 0, 1)) {
+		return;
+	}
+
+	bt_addr_le_copy(&evt.addr, addr);
+	evt.value = info.fw_version;
+	if (k_msgq_put(&evt_q, &evt, K_NO_WAIT)) {
+		atomic_clear(&connecting);
+	}
+}
+
+static uint8_t discover_func(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+			     struct bt_gatt_discover_params *params)
+{
+	struct onboard_ctx *ctx = CONTAINER_OF(params, struct onboard_ctx, discover_params);
+	struct bt_gatt_chrc *chrc;
+
+	if (!attr) {
+		post(EVT_DISCOVERED, ctx, BT_ATT_ERR_ATTRIBUTE_NOT_FOUND, 0);
+		return BT_GATT_ITER_STOP;
+	}
+
+	chrc = (struct bt_gatt_chrc *)attr->user_data;
+
+	if (!bt_uuid_cmp(chrc->uuid, &pawr_char_uuid.uuid)) {
+		post(EVT_DISCOVERED, ctx, 0, chrc->value_handle);
+		return BT_GATT_ITER_STOP;
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+static uint8_t sync_notify_func(struct bt_conn *conn, struct bt_gatt_subscribe_params *params,
+				const void *data, uint16_t length)
+{
+	struct onboard_ctx *ctx = CONTAINER_OF(params, struct onboard_ctx, subscribe_params);
+	const struct esl_sync_status *status = data;
+
+	if (!data) {
+		/* Unsubscribed, e.g. on disconnect */
+		return BT_GATT_ITER_STOP;
+	}
+
+	if (length >= sizeof(*status) && status->synced) {
+		post(EVT_SYNCED, ctx, 0, ctx->tag);
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+static void write_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params)
+{
+	struct onboard_ctx *ctx = CONTAINER_OF(params, struct onboard_ctx, write_params);
+
+	post(EVT_WRITTEN, ctx, err, 0);
+}
+
+void onboarding_tag_responded(uint16_t tag)
+{
+	struct onboard_evt evt = {
+		.type = EVT_SYNCED,
+		.value = tag,
+	};
+
+	/* Called for every response, keep it to a single bit test when idle */
+	if (tag < MAX_SYNCS && atomic_test_and_clear_bit(awaiting_sync, tag)) {
+		(void)k_msgq_put(&evt_q, &evt, K_NO_WAIT);
+	}
+}
+
+bool onboarding_slot_assigned(uint16_t tag)
+{
+	return tag < MAX_SYNCS && atomic_test_bit(assigned, tag);
+}
+
+static void scan_update(void)
+{
+	bool want = !atomic_get(&connecting) && !atomic_get(&paused) && ctx_free() &&
+		    (slots_available() || tags_lost() || coord_claims_pending());
+	int err;
+
+	if (want) {
+		err = bt_le_scan_start(BT_LE_SCAN_PASSIVE_CONTINUOUS, device_found);
+		if (err && err != -EALREADY) {
+			LOG_ERR("Scanning failed to start (err %d)", err);
+		}
+	} else {
+		err = bt_le_scan_stop();
+		if (err && err != -EALREADY) {
+			LOG_ERR("Scanning failed to stop (err %d)", err);
+		}
+	}
+}
+
+static void disconnect(struct onboard_ctx *ctx)
+{
+	int err;
+
+	ctx->state = ONBOARD_DISCONNECTING;
+	ctx->deadline = 0;
+
+	err = bt_conn_disconnect(ctx->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	if (err && err != -ENOTCONN) {
+		LOG_ERR("Disconnect failed (err %d)", err);
+	}
+}
+
+static void ctx_release(struct onboard_ctx *ctx)
+{
+	int64_t now = k_uptime_get();
+
+	if (ctx->stale) {
+		/* Slots were reset after this tag was taken on, nothing to undo */
+	} else if (ctx->configured) {
+		if (ctx->confirmed) {
+			stats.onboarded++;
+		} else {
+			stats.unconfirmed++;
+		}
+
+		stats.conn_time_ms += now - ctx->started;
+		if (!stats.first_ms) {
+			stats.first_ms = ctx->started;
+		}
+		stats.last_ms = now;
+
+		LOG_INF("Tag %d onboarded in %u ms%s", ctx->tag, (uint32_t)(now - ctx->started),
+			ctx->confirmed ? "" : " (sync not confirmed)");
+	} else {
+		if (!ctx->registered) {
+			slot_free(ctx->tag);
+		}
+		stats.failed++;
+	}
+
+	if (!ctx->stale) {
+		atomic_clear_bit(awaiting_sync, ctx->tag);
+	}
+
+	bt_conn_unref(ctx->conn);
+	ctx->conn = NULL;
+	ctx->state = ONBOARD_IDLE;
+	ctx->deadline = 0;
+	stats.active--;
+}
+
+static void subscribe_sync_status(struct onboard_ctx *ctx)
+{
+	int err;
+
+	/* Tags without the notification just never send it, and the response
+	 * slot or the timeout ends the connection instead.
+	 */
+	ctx->subscribe_params.notify = sync_notify_func;
+	ctx->subscribe_params.value = BT_GATT_CCC_NOTIFY;
+	ctx->subscribe_params.value_handle = ctx->attr_handle;
+	ctx->subscribe_params.ccc_handle = ctx->attr_handle + 1;
+
+	err = bt_gatt_subscribe(ctx->conn, &ctx->subscribe_params);
+	if (err && err != -EALREADY) {
+		LOG_WRN("Failed to subscribe to sync status (err %d)", err);
+	}
+}
+
+static void write_timing(struct onboard_ctx *ctx)
+{
+	int err;
+
+	subscribe_sync_status(ctx);
+
+	ctx->write_params.func = write_func;
+	ctx->write_params.handle = ctx->attr_handle;
+	ctx->write_params.offset = 0;
+	ctx->write_params.data = &ctx->timing;
+	ctx->write_params.length = sizeof(ctx->timing);
+
+	err = bt_gatt_write(ctx->conn, &ctx->write_params);
+	if (err) {
+		LOG_ERR("Write failed (err %d)", err);
+		disconnect(ctx);
+		return;
+	}
+
+	ctx->state = ONBOARD_WRITING;
+	ctx->deadline = k_uptime_get() + GATT_TIMEOUT_MS;
+}
+
+static void discover(struct onboard_ctx *ctx)
+{
+	int err;
+
+	ctx->discover_params.uuid = &pawr_char_uuid.uuid;
+	ctx->discover_params.func = discover_func;
+	ctx->discover_params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	ctx->discover_params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	ctx->discover_params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+
+	err = bt_gatt_discover(ctx->conn, &ctx->discover_params);
+	if (err) {
+		LOG_ERR("Discovery failed (err %d)", err);
+		disconnect(ctx);
+		return;
+	}
+
+	ctx->state = ONBOARD_DISCOVERING;
+	ctx->deadline = k_uptime_get() + GATT_TIMEOUT_MS;
+}
+
+static void handle_found(const bt_addr_le_t *addr, uint16_t fw_version)
+{
+	struct onboard_ctx *ctx = ctx_free();
+	char addr_str[BT_ADDR_LE_STR_LEN];
+	/* The shell may change it meanwhile */
+	uint8_t group = onboard_group;
+	struct registry_entry entry;
+	struct bt_conn *conn;
+	bool registered;
+	int tag;
+	int err;
+
+	/* Still advertising while an earlier connection to it is being torn down */
+	conn = bt_conn_lookup_addr_le(BT_ID_DEFAULT, addr);
+	if (conn) {
+		bt_conn_unref(conn);
+		atomic_clear(&connecting);
+		return;
+	}
+
+	/* Scanning only stops on the next pass of the onboarding thread */
+	if (!ctx || atomic_get(&paused)) {
+		atomic_clear(&connecting);
+		return;
+	}
+
+	/* Tags seen before go back to their slot and group */
+	tag = registry_lookup(addr);
+	registered = tag >= 0 && !registry_get(tag, &entry) && pawr_params_tag_active(tag);
+	if (registered) {
+		group = entry.group;
+	} else {
+		tag = slot_alloc(group);
+	}
+
+	if (tag < 0) {
+		atomic_clear(&connecting);
+		return;
+	}
+
+	/* Counted as a member right away, so tags onboarded in parallel cluster */
+	groups_assign(tag, group);
+
+	err = bt_le_scan_stop();
+	if (err && err != -EALREADY) {
+		LOG_ERR("Scanning failed to stop (err %d)", err);
+	}
+
+	bt_addr_le_to_str(addr, addr_str, sizeof(addr_str));
+
+	err = bt_conn_le_create(addr, BT_CONN_LE_CREATE_CONN, BT_LE_CONN_PARAM_DEFAULT, &ctx->conn);
+	if (err) {
+		LOG_ERR("Create conn to %s failed (%d)", addr_str, err);
+		if (!registered) {
+			slot_free(tag);
+		}
+		atomic_clear(&connecting);
+		return;
+	}
+
+	LOG_INF("Connecting to %s for %s slot %d", addr_str, registered ? "its" : "new", tag);
+
+	bt_addr_le_copy(&ctx->addr, addr);
+	ctx->tag = tag;
+	ctx->registered = registered;
+	ctx->fw_version = fw_version;
+	ctx->attr_handle = 0;
+	ctx->cached_handle = false;
+	/* The tag only ever sees its own train */
+	ctx->timing.subevent = SUBEVENT_LOCAL(TAG_SUBEVENT(tag));
+	ctx->timing.response_slot = TAG_RSP_SLOT(tag);
+	ctx->timing.group = group;
+	ctx->configured = false;
+	ctx->confirmed = false;
+	ctx->stale = false;
+	memset(&ctx->subscribe_params, 0, sizeof(ctx->subscribe_params));
+	ctx->started = k_uptime_get();
+	ctx->deadline = ctx->started + CONNECT_TIMEOUT_MS;
+	ctx->state = ONBOARD_CONNECTING;
+	stats.started++;
+	stats.active++;
+}
+
+static void handle_reset(void)
+{
+	/* Tags synced with the old timing lose sync and come back advertising,
+	 * so every slot is free again. Links still in progress are closed.
+	 */
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (ctxs[i].state == ONBOARD_IDLE) {
+			continue;
+		}
+
+		ctxs[i].stale = true;
+		if (ctxs[i].state != ONBOARD_DISCONNECTING) {
+			disconnect(&ctxs[i]);
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(assigned); i++) {
+		atomic_clear(&assigned[i]);
+		atomic_clear(&awaiting_sync[i]);
+	}
+
+	/* Nothing queued or measured under the old slot mapping carries over,
+	 * whoever gets a slot next starts from scratch
+	 */
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		image_xfer_abort(tag);
+		downlink_flush(tag);
+		telemetry_forget(tag);
+	}
+
+	groups_reset();
+	slots_restore();
+	/* The tag either lost sync too or keeps its old slot */
+	move.deadline = 0;
+
+	complete = false;
+	LOG_INF("Slots reset, %d kept for registered tags", registry_count());
+}
+
+static void handle_forget(uint16_t tag)
+{
+	if (!registry_known(tag)) {
+		return;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (ctxs[i].state != ONBOARD_IDLE && ctxs[i].tag == tag) {
+			LOG_WRN("Tag %d is being onboarded, not forgotten", tag);
+			return;
+		}
+	}
+
+	registry_remove(tag);
+	image_xfer_abort(tag);
+	downlink_flush(tag);
+	slot_free(tag);
+}
+
+static void move_end(void)
+{
+	atomic_clear_bit(awaiting_sync, move.to);
+	move.deadline = 0;
+}
+
+static void handle_move(uint16_t tag, uint8_t subevent)
+{
+	struct esl_cmd_move cmd;
+	int to;
+	int err;
+
+	/* Another train is another sync, which takes a connection for PAST */
+	if (move.deadline || !registry_known(tag) || TAG_SUBEVENT(tag) == subevent ||
+	    SUBEVENT_TRAIN(TAG_SUBEVENT(tag)) != SUBEVENT_TRAIN(subevent) ||
+	    !pawr_params_subevent_active(subevent)) {
+		return;
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (ctxs[i].state != ONBOARD_IDLE && ctxs[i].tag == tag) {
+			return;
+		}
+	}
+
+	to = subevent_slot_alloc(subevent);
+	if (to < 0) {
+		return;
+	}
+
+	cmd.subevent = SUBEVENT_LOCAL(TAG_SUBEVENT(to));
+	cmd.response_slot = TAG_RSP_SLOT(to);
+	err = downlink_enqueue(tag, ESL_CMD_MOVE, &cmd, sizeof(cmd));
+	if (err) {
+		atomic_clear_bit(assigned, to);
+		return;
+	}
+
+	move.from = tag;
+	move.to = to;
+	move.deadline = k_uptime_get() + MOVE_TIMEOUTS * pawr_params_sync_timeout_ms();
+	atomic_set_bit(awaiting_sync, to);
+	LOG_INF("Tag %d told to move to slot %d", tag, to);
+}
+
+/* The tag answered in its new slot */
+static void move_done(void)
+{
+	struct registry_entry entry;
+
+	move_end();
+
+	if (registry_get(move.from, &entry)) {
+		/* Forgotten meanwhile */
+		slot_free(move.to);
+		return;
+	}
+
+	(void)registry_add(move.to, &entry.addr, entry.group);
+	groups_assign(move.to, entry.group);
+	image_xfer_abort(move.from);
+	downlink_flush(move.from);
+	slot_free(move.from);
+	balance_moved(move.from, move.to);
+	LOG_INF("Tag %d moved to slot %d", move.from, move.to);
+}
+
+static void move_timeout(void)
+{
+	LOG_WRN("Tag %d not seen in slot %d, move abandoned", move.from, move.to);
+
+	/* Drops the command too if it never got through */
+	move_end();
+	downlink_flush(move.from);
+	slot_free(move.to);
+}
+
+static void handle_evt(const struct onboard_evt *evt)
+{
+	struct onboard_ctx *ctx = &ctxs[evt->ctx];
+	int err;
+
+	switch (evt->type) {
+	case EVT_FOUND:
+		handle_found(&evt->addr, evt->value);
+		return;
+	case EVT_RESET:
+		handle_reset();
+		return;
+	case EVT_MOVE:
+		handle_move(evt->value, evt->subevent);
+		return;
+	case EVT_RESUME:
+		return;
+	case EVT_FORGET:
+		for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+			if (evt->value == ONBOARDING_FORGET_ALL || evt->value == tag) {
+				handle_forget(tag);
+			}
+		}
+		return;
+	case EVT_SYNCED:
+		if (move.deadline && evt->value == move.to) {
+			move_done();
+			return;
+		}
+
+		/* From the tag's notification or its first response in its slot.
+		 * The notification can arrive before the timing write completes,
+		 * in which case the write completion closes the link.
+		 */
+		for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+			if (ctxs[i].state == ONBOARD_IDLE || ctxs[i].state == ONBOARD_DISCONNECTING ||
+			    ctxs[i].tag != evt->value) {
+				continue;
+			}
+
+			ctxs[i].confirmed = true;
+			if (ctxs[i].state == ONBOARD_WAIT_SYNC) {
+				disconnect(&ctxs[i]);
+			}
+		}
+		return;
+	default:
+		break;
+	}
+
+	if (evt->ctx >= ARRAY_SIZE(ctxs) || ctx->state == ONBOARD_IDLE) {
+		return;
+	}
+
+	switch (evt->type) {
+	case EVT_CONNECTED:
+		atomic_clear(&connecting);
+		if (evt->err) {
+			/* Failed or cancelled connection, no disconnected callback follows */
+			if (!ctx->stale) {
+				if (!ctx->registered) {
+					slot_free(ctx->tag);
+				}
+				stats.failed++;
+			}
+			stats.active--;
+			bt_conn_unref(ctx->conn);
+			ctx->conn = NULL;
+			ctx->state = ONBOARD_IDLE;
+			ctx->deadline = 0;
+			break;
+		}
+
+		if (ctx->state != ONBOARD_CONNECTING) {
+			break;
+		}
+
+		ctx->state = ONBOARD_REMOTE_INFO;
+		ctx->deadline = k_uptime_get() + GATT_TIMEOUT_MS;
+		break;
+	case EVT_REMOTE_INFO:
+		if (ctx->state != ONBOARD_REMOTE_INFO) {
+			break;
+		}
+
+		err = bt_le_per_adv_set_info_transfer(
+			pawr_params_adv(SUBEVENT_TRAIN(TAG_SUBEVENT(ctx->tag))), ctx->conn, 0);
+		if (err) {
+			LOG_ERR("Failed to send PAST (err %d)", err);
+			disconnect(ctx);
+			break;
+		}
+
+		ctx->attr_handle = handle_cache_lookup(ctx->fw_version);
+		if (ctx->attr_handle) {
+			stats.cache_hits++;
+			ctx->cached_handle = true;
+			write_timing(ctx);
+		} else {
+			stats.cache_misses++;
+			discover(ctx);
+		}
+		break;
+	case EVT_DISCOVERED:
+		if (ctx->state != ONBOARD_DISCOVERING) {
+			break;
+		}
+
+		if (evt->err) {
+			LOG_ERR("PAwR characteristic not found");
+			disconnect(ctx);
+			break;
+		}
+
+		ctx->attr_handle = evt->value;
+		handle_cache_store(ctx->fw_version, ctx->attr_handle);
+		LOG_INF("Characteristic handle: %d (firmware %d)", ctx->attr_handle, ctx->fw_version);
+		write_timing(ctx);
+		break;
+	case EVT_WRITTEN:
+		if (ctx->state != ONBOARD_WRITING) {
+			break;
+		}
+
+		if (evt->err && ctx->cached_handle) {
+			/* Layout changed without a version bump, rediscover on this link */
+			LOG_WRN("Cached handle rejected (err %d), rediscovering", evt->err);
+			handle_cache_invalidate(ctx->fw_version);
+			ctx->cached_handle = false;
+			discover(ctx);
+			break;
+		}
+
+		if (evt->err) {
+			LOG_ERR("Write failed (err %d)", evt->err);
+			disconnect(ctx);
+			break;
+		}
+
+		ctx->configured = true;
+		if (!ctx->registered) {
+			/* Not fatal, the tag just gets a new slot after a reboot */
+			(void)registry_add(ctx->tag, &ctx->addr, ctx->timing.group);
+			ctx->registered = true;
+		}
+
+		if (ctx->confirmed) {
+			disconnect(ctx);
+			break;
+		}
+
+		ctx->state = ONBOARD_WAIT_SYNC;
+		ctx->deadline = k_uptime_get() + pawr_params_sync_timeout_ms();
+		atomic_set_bit(awaiting_sync, ctx->tag);
+		break;
+	case EVT_DISCONNECTED:
+		if (ctx->state == ONBOARD_CONNECTING) {
+			atomic_clear(&connecting);
+		}
+		ctx_release(ctx);
+		break;
+	default:
+		break;
+	}
+}
+
+static void handle_timeouts(void)
+{
+	int64_t now = k_uptime_get();
+
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		struct onboard_ctx *ctx = &ctxs[i];
+
+		if (!ctx->deadline || now < ctx->deadline) {
+			continue;
+		}
+
+		if (ctx->state != ONBOARD_WAIT_SYNC) {
+			LOG_ERR("Tag %d timed out in state %d", ctx->tag, ctx->state);
+		}
+
+		/* Also cancels a pending connection attempt */
+		disconnect(ctx);
+	}
+
+	if (move.deadline && now >= move.deadline) {
+		move_timeout();
+	}
+}
+
+static k_timeout_t next_timeout(void)
+{
+	int64_t next = move.deadline ? move.deadline : INT64_MAX;
+
+	for (size_t i = 0; i < ARRAY_SIZE(ctxs); i++) {
+		if (ctxs[i].deadline) {
+			next = MIN(next, ctxs[i].deadline);
+		}
+	}
+
+	/* Lost tags are looked for by scanning even when no slot is free */
+	if (registry_count()) {
+		next = MIN(next, k_uptime_get() + LOST_CHECK_MS);
+	}
+
+	if (next == INT64_MAX) {
+		return K_FOREVER;
+	}
+
+	return K_MSEC(MAX(next - k_uptime_get(), 0));
+}
+
+void onboarding_run(void)
+{
+	struct onboard_evt evt;
+
+	slots_restore();
+	scan_update();
+
+	while (true) {
+		if (k_msgq_get(&evt_q, &evt, next_timeout()) == 0) {
+			handle_evt(&evt);
+		}
+
+		handle_timeouts();
+		scan_update();
+
+		if (!complete && !slots_available() && !stats.active) {
+			complete = true;
+			LOG_INF("Maximum number of syncs onboarded, %u confirmed in %u s",
+				stats.onboarded,
+				(uint32_t)((stats.last_ms - stats.first_ms) / MSEC_PER_SEC));
+		}
+	}
+}
+
+int onboarding_reset(void)
+{
+	struct onboard_evt evt = {
+		.type = EVT_RESET,
+	};
+
+	return k_msgq_put(&evt_q, &evt, K_MSEC(100));
+}
+
+int onboarding_forget(uint16_t tag)
+{
+	struct onboard_evt evt = {
+		.type = EVT_FORGET,
+		.value = tag,
+	};
+
+	if (tag >= MAX_SYNCS && tag != ONBOARDING_FORGET_ALL) {
+		return -EINVAL;
+	}
+
+	return k_msgq_put(&evt_q, &evt, K_MSEC(100));
+}
+
+int onboarding_move(uint16_t tag, uint8_t subevent)
+{
+	struct onboard_evt evt = {
+		.type = EVT_MOVE,
+		.value = tag,
+		.subevent = subevent,
+	};
+
+	if (tag >= MAX_SYNCS || subevent >= NUM_SUBEVENTS) {
+		return -EINVAL;
+	}
+
+	return k_msgq_put(&evt_q, &evt, K_MSEC(100));
+}
+
+void onboarding_pause(void)
+{
+	atomic_inc(&paused);
+}
+
+void onboarding_resume(void)
+{
+	struct onboard_evt evt = {
+		.type = EVT_RESUME,
+	};
+
+	atomic_dec(&paused);
+
+	/* Scanning may have stopped with nothing left to wake the thread */
+	(void)k_msgq_put(&evt_q, &evt, K_MSEC(100));
+}
+
+int onboarding_set_group(uint8_t group)
+{
+	if (group >= ESL_GROUP_COUNT && group != ESL_GROUP_NONE) {
+		return -EINVAL;
+	}
+
+	onboard_group = group;
+	return 0;
+}
+
+uint8_t onboarding_get_group(void)
+{
+	return onboard_group;
+}
+
+void onboarding_get_stats(struct onboarding_stats *out)
+{
+	*out = stats;
+}
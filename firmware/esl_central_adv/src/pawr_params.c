@@ -0,0 +1,645 @@
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(pawr_params, LOG_LEVEL_INF);
+
+#include "pawr_params.h"
+
+/* Periodic advertising interval in 1.25ms units */
+#define PER_ADV_INT_MIN 0x1F40
+/* Periodic advertising interval in 1.25ms units */
+#define PER_ADV_INT_MAX 0x1F40
+/* Periodic advertising subevent interval in 1.25ms units */
+#define SUBEVENT_INTERVAL 0xFF
+/* Periodic advertising subevent response delay in 1.25ms units */
+#define RESPONSE_SLOT_DELAY 0x7C
+/* Periodic advertising response slot spacing in 0.125ms units */
+#define RESPONSE_SLOT_SPACING 0x10
+
+/* Valid ranges of the individual parameters */
+#define SUBEVENT_INTERVAL_MIN     0x6
+#define SUBEVENT_INTERVAL_MAX     0xFF
+#define RESPONSE_SLOT_DELAY_MIN   0x1
+#define RESPONSE_SLOT_DELAY_MAX   0xFE
+#define RESPONSE_SLOT_SPACING_MIN 0x2
+#define RESPONSE_SLOT_SPACING_MAX 0xFF
+
+/* Response slot delay used by the planner, in 1.25ms units. Gives the tag time
+ * to parse the subevent and hand its response to the controller.
+ */
+#define PLAN_RSP_DELAY 0x10
+/* Room left after the last response slot of a subevent, in 1.25ms units */
+#define PLAN_SUBEVENT_MARGIN 0x2
+
+/* Validate interval range overlap with Controller */
+BUILD_ASSERT(PER_ADV_INT_MAX >= BT_GAP_PER_ADV_MIN_INTERVAL,
+            "Periodic advertising maximum interval must overlap with Controller's minimum.");
+BUILD_ASSERT(PER_ADV_INT_MIN <= BT_GAP_PER_ADV_MAX_INTERVAL,
+            "Periodic advertising minimum interval must overlap with Controller's maximum.");
+
+/* Validate that interval min <= max */
+BUILD_ASSERT(PER_ADV_INT_MIN <= PER_ADV_INT_MAX,
+            "Periodic advertising minimum interval must not exceed maximum interval");
+
+/* If num_subevents is not 0, validate subevent interval */
+#if (TRAIN_SUBEVENTS > 0)
+BUILD_ASSERT(SUBEVENT_INTERVAL <= (PER_ADV_INT_MIN / TRAIN_SUBEVENTS),
+            "Subevent interval must be <= periodic advertising interval min divided by num subevents");
+#endif
+
+/* Validate response slot delay against subevent interval */
+#if (TRAIN_SUBEVENTS > 0)
+BUILD_ASSERT(RESPONSE_SLOT_DELAY < SUBEVENT_INTERVAL,
+            "Response slot delay must be less than subevent interval");
+#endif
+
+/* Validate response slot spacing when multiple response slots are used */
+#if (NUM_RSP_SLOTS > 1)
+BUILD_ASSERT(RESPONSE_SLOT_SPACING <= (10 * (SUBEVENT_INTERVAL - RESPONSE_SLOT_DELAY) / NUM_RSP_SLOTS),
+            "Response slot spacing exceeds maximum allowed value");
+#endif
+
+/* Range checks for individual parameters */
+#if (TRAIN_SUBEVENTS > 0)
+BUILD_ASSERT(SUBEVENT_INTERVAL >= SUBEVENT_INTERVAL_MIN && SUBEVENT_INTERVAL <= SUBEVENT_INTERVAL_MAX,
+            "Subevent interval not in valid range (0x6 to 0xFF)");
+#endif
+
+#if (NUM_RSP_SLOTS > 0)
+BUILD_ASSERT(RESPONSE_SLOT_DELAY >= RESPONSE_SLOT_DELAY_MIN && RESPONSE_SLOT_DELAY <= RESPONSE_SLOT_DELAY_MAX,
+            "Response slot delay not in valid range (0x1 to 0xFE)");
+
+BUILD_ASSERT(RESPONSE_SLOT_SPACING >= RESPONSE_SLOT_SPACING_MIN && RESPONSE_SLOT_SPACING <= RESPONSE_SLOT_SPACING_MAX,
+            "Response slot spacing not in valid range (0x2 to 0xFF)");
+#endif
+
+BUILD_ASSERT(NUM_TRAINS <= CONFIG_BT_EXT_ADV_MAX_ADV_SET,
+	     "Every train needs its own advertising set");
+
+/* Timing chosen by the user, used whenever the fast interval is not */
+static struct bt_le_per_adv_param configured = {
+	.interval_min = PER_ADV_INT_MIN,
+	.interval_max = PER_ADV_INT_MAX,
+	.options = 0,
+	.num_subevents = TRAIN_SUBEVENTS,
+	.subevent_interval = SUBEVENT_INTERVAL,
+	.response_slot_delay = RESPONSE_SLOT_DELAY,
+	.response_slot_spacing = RESPONSE_SLOT_SPACING,
+	.num_response_slots = NUM_RSP_SLOTS,
+};
+
+/* Only changed with periodic advertising stopped, so the PAwR callbacks can
+ * read it without locking. Every train runs the same timing.
+ */
+static struct bt_le_per_adv_param per_adv_params;
+static bool fast;
+
+static struct bt_le_ext_adv *trains[NUM_TRAINS];
+/* Uptime at which the first train was last started, in us */
+static int64_t anchor_us;
+
+static K_MUTEX_DEFINE(apply_lock);
+
+int pawr_params_init(struct bt_le_ext_adv *const adv[NUM_TRAINS])
+{
+	int err;
+
+	per_adv_params = configured;
+
+	for (uint8_t train = 0; train < NUM_TRAINS; train++) {
+		trains[train] = adv[train];
+
+		err = bt_le_per_adv_set_param(trains[train], &per_adv_params);
+		if (err) {
+			trains[0] = NULL;
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+struct bt_le_ext_adv *pawr_params_adv(uint8_t train)
+{
+	return train < NUM_TRAINS ? trains[train] : NULL;
+}
+
+int pawr_params_train(const struct bt_le_ext_adv *adv)
+{
+	for (uint8_t train = 0; train < NUM_TRAINS; train++) {
+		if (trains[train] == adv) {
+			return train;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* Offset of a train's events from the first train's, in 1.25ms units. Puts
+ * the subevents of each train in the gaps between those of the train before.
+ */
+static uint32_t stagger(const struct bt_le_per_adv_param *param, uint8_t train, uint8_t count)
+{
+	return (uint32_t)param->subevent_interval * train / count;
+}
+
+/* Must be called with apply_lock held, or before anyone else can call in */
+static int start_trains(const struct bt_le_per_adv_param *param)
+{
+	uint32_t started_at = 0;
+	int err;
+
+	/* The host has no way to place periodic events, the controller anchors
+	 * each train once both its periodic and its extended advertising are
+	 * enabled. Enabling them one offset apart puts them there, give or take
+	 * the controller's scheduling.
+	 */
+	for (uint8_t train = 0; train < NUM_TRAINS; train++) {
+		uint32_t offset = stagger(param, train, NUM_TRAINS);
+
+		if (offset > started_at) {
+			k_msleep(DIV_ROUND_UP((offset - started_at) * 5U, 4U));
+			started_at = offset;
+		}
+
+		err = bt_le_per_adv_start(trains[train]);
+		if (err && err != -EALREADY) {
+			LOG_ERR("Failed to start train %d (err %d)", train, err);
+			return err;
+		}
+
+		/* Already running after the first start, only the periodic part
+		 * is stopped to move a train
+		 */
+		err = bt_le_ext_adv_start(trains[train], BT_LE_EXT_ADV_START_DEFAULT);
+		if (err && err != -EALREADY) {
+			LOG_ERR("Failed to start advertising of train %d (err %d)", train, err);
+			return err;
+		}
+
+		if (train == 0) {
+			anchor_us = k_ticks_to_us_floor64(k_uptime_ticks());
+		}
+	}
+
+	return 0;
+}
+
+int pawr_params_start(void)
+{
+	int err;
+
+	if (!trains[0]) {
+		return -EAGAIN;
+	}
+
+	k_mutex_lock(&apply_lock, K_FOREVER);
+	err = start_trains(&per_adv_params);
+	k_mutex_unlock(&apply_lock);
+
+	return err;
+}
+
+/* Must be called with apply_lock held */
+static int stop_trains(bool *running)
+{
+	int err;
+
+	*running = false;
+
+	for (uint8_t train = 0; train < NUM_TRAINS; train++) {
+		err = bt_le_per_adv_stop(trains[train]);
+		if (err && err != -EALREADY) {
+			LOG_ERR("Failed to stop train %d (err %d)", train, err);
+			return err;
+		}
+		*running |= (err == 0);
+	}
+
+	return 0;
+}
+
+int pawr_params_realign(uint32_t delay_us)
+{
+	bool running;
+	int err;
+
+	if (!trains[0]) {
+		return -EAGAIN;
+	}
+
+	k_mutex_lock(&apply_lock, K_FOREVER);
+
+	err = stop_trains(&running);
+	if (!err && !running) {
+		/* Nothing to move, the trains get their anchor when started */
+		err = -EALREADY;
+	}
+
+	if (!err) {
+		k_usleep(delay_us);
+		err = start_trains(&per_adv_params);
+	}
+
+	k_mutex_unlock(&apply_lock);
+	return err;
+}
+
+uint32_t pawr_params_phase_us(void)
+{
+	int64_t now = k_ticks_to_us_floor64(k_uptime_ticks());
+
+	if (!anchor_us) {
+		return 0;
+	}
+
+	return (now - anchor_us) % (per_adv_params.interval_max * 1250U);
+}
+
+const struct bt_le_per_adv_param *pawr_params_get(void)
+{
+	return &per_adv_params;
+}
+
+int pawr_params_check(const struct bt_le_per_adv_param *param)
+{
+	if (param->interval_max < BT_GAP_PER_ADV_MIN_INTERVAL ||
+	    param->interval_min > BT_GAP_PER_ADV_MAX_INTERVAL) {
+		LOG_WRN("Interval must overlap with the Controller's range");
+		return -EINVAL;
+	}
+
+	if (param->interval_min > param->interval_max) {
+		LOG_WRN("Interval min must not exceed max");
+		return -EINVAL;
+	}
+
+	/* The tables are sized at build time, and the controller needs at
+	 * least one of each for PAwR.
+	 */
+	if (param->num_subevents == 0 || param->num_subevents > TRAIN_SUBEVENTS ||
+	    param->num_response_slots == 0 || param->num_response_slots > NUM_RSP_SLOTS) {
+		LOG_WRN("Need 1 to %d subevents and 1 to %d response slots", TRAIN_SUBEVENTS,
+			NUM_RSP_SLOTS);
+		return -EINVAL;
+	}
+
+	if (param->subevent_interval > param->interval_min / param->num_subevents) {
+		LOG_WRN("Subevent interval must be <= interval min divided by num subevents");
+		return -EINVAL;
+	}
+
+	if (param->response_slot_delay >= param->subevent_interval) {
+		LOG_WRN("Response slot delay must be less than subevent interval");
+		return -EINVAL;
+	}
+
+	if (param->num_response_slots > 1 &&
+	    param->response_slot_spacing > 10 * (param->subevent_interval -
+						 param->response_slot_delay) /
+						param->num_response_slots) {
+		LOG_WRN("Response slot spacing exceeds maximum allowed value");
+		return -EINVAL;
+	}
+
+	if (param->subevent_interval < SUBEVENT_INTERVAL_MIN ||
+	    param->subevent_interval > SUBEVENT_INTERVAL_MAX ||
+	    param->response_slot_delay < RESPONSE_SLOT_DELAY_MIN ||
+	    param->response_slot_delay > RESPONSE_SLOT_DELAY_MAX ||
+	    param->response_slot_spacing < RESPONSE_SLOT_SPACING_MIN ||
+	    param->response_slot_spacing > RESPONSE_SLOT_SPACING_MAX) {
+		LOG_WRN("Subevent interval, response slot delay or spacing out of range");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Shortest subevent that fits the response slots with the planner's delay */
+static uint32_t plan_subevent_interval(uint8_t slots)
+{
+	uint32_t subevent_interval = PLAN_RSP_DELAY +
+				     DIV_ROUND_UP(slots * RESPONSE_SLOT_SPACING, 10) +
+				     PLAN_SUBEVENT_MARGIN;
+
+	return MAX(subevent_interval, SUBEVENT_INTERVAL_MIN);
+}
+
+/* Timing of one train holding a share of the tags */
+static int plan_train(uint16_t tags, uint32_t latency_ms, struct bt_le_per_adv_param *param)
+{
+	uint32_t subevent_interval;
+	uint32_t interval;
+	uint32_t budget;
+	uint8_t subevents;
+	uint8_t slots;
+
+	if (tags == 0 || tags > TRAIN_SUBEVENTS * NUM_RSP_SLOTS) {
+		return -EINVAL;
+	}
+
+	/* Fewest subevents that hold every tag, then spread the tags evenly so
+	 * the subevents are as short as possible.
+	 */
+	subevents = DIV_ROUND_UP(tags, NUM_RSP_SLOTS);
+	slots = DIV_ROUND_UP(tags, subevents);
+
+	subevent_interval = plan_subevent_interval(slots);
+	if (subevent_interval > SUBEVENT_INTERVAL_MAX) {
+		return -ERANGE;
+	}
+
+	interval = MAX(subevents * subevent_interval, BT_GAP_PER_ADV_MIN_INTERVAL);
+
+	/* Milliseconds to 1.25ms units */
+	budget = MIN((uint64_t)latency_ms * 4 / 5, BT_GAP_PER_ADV_MAX_INTERVAL);
+	if (interval > budget) {
+		return -ERANGE;
+	}
+
+	interval = budget;
+
+	/* Spread the subevents over the interval rather than bunching them at
+	 * the start, the data requests for them then come in evenly too.
+	 */
+	subevent_interval = MIN(interval / subevents, SUBEVENT_INTERVAL_MAX);
+
+	param->interval_min = interval;
+	param->interval_max = interval;
+	param->options = 0;
+	param->num_subevents = subevents;
+	param->subevent_interval = subevent_interval;
+	param->response_slot_delay = PLAN_RSP_DELAY;
+	param->response_slot_spacing = RESPONSE_SLOT_SPACING;
+	param->num_response_slots = slots;
+
+	return 0;
+}
+
+int pawr_params_plan(uint16_t tags, uint32_t latency_ms, struct bt_le_per_adv_param *param)
+{
+	int err;
+
+	if (tags == 0 || tags > MAX_SYNCS) {
+		return -EINVAL;
+	}
+
+	/* Tags are spread over every train, so each holds its share */
+	err = plan_train(DIV_ROUND_UP(tags, NUM_TRAINS), latency_ms, param);
+	if (err) {
+		return err;
+	}
+
+	return pawr_params_check(param);
+}
+
+/* Airtime two trains' subevents share, each busy for @p busy from its start,
+ * with the second starting @p distance after the first. Units are 1.25ms and
+ * the pattern repeats every @p interval.
+ */
+static uint32_t overlap(uint32_t busy, uint32_t distance, uint32_t interval)
+{
+	uint32_t shared = 0;
+
+	busy = MIN(busy, interval);
+	distance %= interval;
+
+	if (distance < busy) {
+		shared += busy - distance;
+	}
+	if (distance + busy > interval) {
+		shared += distance + busy - interval;
+	}
+
+	return shared;
+}
+
+int pawr_params_capacity(uint16_t tags, uint32_t latency_ms, struct pawr_capacity *out)
+{
+	struct bt_le_per_adv_param param;
+	uint64_t shared = 0;
+	uint32_t busy;
+
+	if (tags == 0) {
+		return -EINVAL;
+	}
+
+	memset(out, 0, sizeof(*out));
+	out->trains_max = MIN(CONFIG_BT_EXT_ADV_MAX_ADV_SET, UINT8_MAX);
+
+	/* Fewest trains that hold the tags within the budget. Not limited to
+	 * the trains or advertising sets of this build, it is a plan for how
+	 * many it would take. Too many tags for one train's tables is no
+	 * different from too many for the budget, more trains fix both.
+	 */
+	for (uint8_t n = 1; n <= PAWR_CAPACITY_TRAINS_MAX; n++) {
+		if (!plan_train(DIV_ROUND_UP(tags, n), latency_ms, &param)) {
+			out->trains = n;
+			break;
+		}
+	}
+
+	if (!out->trains) {
+		return -ERANGE;
+	}
+
+	out->tags_per_train = DIV_ROUND_UP(tags, out->trains);
+	out->interval = param.interval_max;
+	out->subevents = param.num_subevents;
+	out->response_slots = param.num_response_slots;
+
+	/* The radio is taken from the subevent's own packet to the end of its
+	 * last response slot, the planner spreads what is left over the interval.
+	 */
+	busy = plan_subevent_interval(param.num_response_slots);
+	out->busy_permille = MIN(1000U, busy * param.num_subevents * 1000U / param.interval_max);
+
+	/* Every subevent of every pair of trains, staggered as they would be
+	 * started. Fine for the handful of trains and subevents there are.
+	 */
+	for (uint8_t a = 0; a < out->trains; a++) {
+		for (uint8_t b = a + 1; b < out->trains; b++) {
+			for (uint8_t i = 0; i < param.num_subevents; i++) {
+				for (uint8_t j = 0; j < param.num_subevents; j++) {
+					uint32_t start_a = stagger(&param, a, out->trains) +
+							   i * param.subevent_interval;
+					uint32_t start_b = stagger(&param, b, out->trains) +
+							   j * param.subevent_interval;
+
+					shared += overlap(busy, start_b + param.interval_max -
+								start_a,
+							  param.interval_max);
+				}
+			}
+		}
+	}
+
+	/* Airtime of either train that the other also wants */
+	out->collide_permille = MIN(1000U, shared * 2U * 1000U /
+						  ((uint64_t)busy * param.num_subevents *
+						   out->trains));
+
+	return 0;
+}
+
+/* Same subevents and response slots packed back to back, so every tag keeps
+ * its slot and only has to resync.
+ */
+static void fast_params(struct bt_le_per_adv_param *param)
+{
+	uint32_t subevent_interval = plan_subevent_interval(configured.num_response_slots);
+	uint32_t interval = MAX(configured.num_subevents * subevent_interval,
+				BT_GAP_PER_ADV_MIN_INTERVAL);
+
+	*param = configured;
+
+	if (subevent_interval > SUBEVENT_INTERVAL_MAX || interval >= configured.interval_min) {
+		/* Already as fast as the planner would make it */
+		return;
+	}
+
+	param->interval_min = interval;
+	param->interval_max = interval;
+	param->subevent_interval = subevent_interval;
+	param->response_slot_delay = PLAN_RSP_DELAY;
+	param->response_slot_spacing = RESPONSE_SLOT_SPACING;
+}
+
+/* Must be called with apply_lock held */
+static int program(const struct bt_le_per_adv_param *param)
+{
+	bool running;
+	int err;
+
+	/* The parameters can only be changed with periodic advertising off,
+	 * and the trains are restarted together to keep their stagger.
+	 */
+	err = stop_trains(&running);
+	if (err) {
+		return err;
+	}
+
+	err = 0;
+	for (uint8_t train = 0; train < NUM_TRAINS && !err; train++) {
+		err = bt_le_per_adv_set_param(trains[train], param);
+		if (err) {
+			LOG_ERR("Failed to set periodic advertising parameters (err %d)", err);
+		}
+	}
+
+	if (err) {
+		/* Put back whatever was changed before the failure */
+		for (uint8_t train = 0; train < NUM_TRAINS; train++) {
+			(void)bt_le_per_adv_set_param(trains[train], &per_adv_params);
+		}
+	} else {
+		per_adv_params = *param;
+	}
+
+	if (running) {
+		int start_err = start_trains(&per_adv_params);
+
+		if (start_err) {
+			LOG_ERR("Failed to restart periodic advertising (err %d)", start_err);
+			err = err ? err : start_err;
+		}
+	}
+
+	if (!err) {
+		LOG_INF("Interval %u, %u trains of %u subevents of %u slots",
+			per_adv_params.interval_max, NUM_TRAINS, per_adv_params.num_subevents,
+			per_adv_params.num_response_slots);
+	}
+
+	return err;
+}
+
+int pawr_params_apply(const struct bt_le_per_adv_param *param)
+{
+	int err;
+
+	err = pawr_params_check(param);
+	if (err) {
+		return err;
+	}
+
+	if (!trains[0]) {
+		return -EAGAIN;
+	}
+
+	k_mutex_lock(&apply_lock, K_FOREVER);
+
+	err = program(param);
+	if (!err) {
+		configured = *param;
+		fast = false;
+	}
+
+	k_mutex_unlock(&apply_lock);
+	return err;
+}
+
+uint16_t pawr_params_interval(bool use_fast)
+{
+	struct bt_le_per_adv_param param;
+
+	if (!use_fast) {
+		return configured.interval_max;
+	}
+
+	fast_params(&param);
+	return param.interval_max;
+}
+
+int pawr_params_set_fast(bool use_fast)
+{
+	struct bt_le_per_adv_param param;
+	int err = 0;
+
+	if (!trains[0]) {
+		return -EAGAIN;
+	}
+
+	k_mutex_lock(&apply_lock, K_FOREVER);
+
+	if (use_fast != fast) {
+		if (use_fast) {
+			fast_params(&param);
+		} else {
+			param = configured;
+		}
+
+		err = program(&param);
+		if (!err) {
+			fast = use_fast;
+		}
+	}
+
+	k_mutex_unlock(&apply_lock);
+	return err;
+}
+
+bool pawr_params_is_fast(void)
+{
+	return fast;
+}
+
+bool pawr_params_subevent_active(uint8_t subevent)
+{
+	return subevent < NUM_SUBEVENTS && SUBEVENT_LOCAL(subevent) < per_adv_params.num_subevents;
+}
+
+bool pawr_params_tag_active(uint16_t tag)
+{
+	return tag < MAX_SYNCS && pawr_params_subevent_active(TAG_SUBEVENT(tag)) &&
+	       TAG_RSP_SLOT(tag) < per_adv_params.num_response_slots;
+}
+
+uint32_t pawr_params_sync_timeout_ms(void)
+{
+	/* Allow 2ms per interval unit (rather than the controller's 1.25ms) for
+	 * a tag to sync before giving up on seeing it in its response slot.
+	 */
+	return per_adv_params.interval_max * 2;
+}
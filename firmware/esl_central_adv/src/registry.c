@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(registry, LOG_LEVEL_INF);
+
+#include "registry.h"
+
+#define REGISTRY_SUBTREE "reg"
+/* Open addressing from address to tag, at most half full */
+#define REGISTRY_BUCKETS 512
+#define BUCKET_MASK      (REGISTRY_BUCKETS - 1)
+/* Buckets hold the tag index plus one, zero is empty */
+#define BUCKET_EMPTY     0
+
+BUILD_ASSERT(IS_POWER_OF_TWO(REGISTRY_BUCKETS) && REGISTRY_BUCKETS >= 2 * MAX_SYNCS,
+	     "Address table too small for MAX_SYNCS");
+
+static struct k_spinlock lock;
+static struct registry_entry entries[MAX_SYNCS];
+static ATOMIC_DEFINE(used, MAX_SYNCS);
+static uint16_t buckets[REGISTRY_BUCKETS];
+static uint16_t count;
+
+static uint32_t addr_hash(const bt_addr_le_t *addr)
+{
+	/* FNV-1a, random static addresses are spread well enough already */
+	uint32_t hash = 2166136261U;
+
+	hash = (hash ^ addr->type) * 16777619U;
+	for (size_t i = 0; i < sizeof(addr->a.val); i++) {
+		hash = (hash ^ addr->a.val[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+/* Bucket holding the address, or the empty bucket it would go in. Must be
+ * called with the lock held.
+ */
+static uint16_t bucket_find(const bt_addr_le_t *addr)
+{
+	uint16_t i = addr_hash(addr) & BUCKET_MASK;
+
+	while (buckets[i] != BUCKET_EMPTY &&
+	       !bt_addr_le_eq(&entries[buckets[i] - 1].addr, addr)) {
+		i = (i + 1) & BUCKET_MASK;
+	}
+
+	return i;
+}
+
+/* Must be called with the lock held */
+static void bucket_remove(uint16_t i)
+{
+	uint16_t j = i;
+
+	buckets[i] = BUCKET_EMPTY;
+
+	/* Pull later entries of the probe sequence back over the hole */
+	while (true) {
+		uint16_t home;
+
+		j = (j + 1) & BUCKET_MASK;
+		if (buckets[j] == BUCKET_EMPTY) {
+			return;
+		}
+
+		home = addr_hash(&entries[buckets[j] - 1].addr) & BUCKET_MASK;
+		if (((j - home) & BUCKET_MASK) >= ((j - i) & BUCKET_MASK)) {
+			buckets[i] = buckets[j];
+			buckets[j] = BUCKET_EMPTY;
+			i = j;
+		}
+	}
+}
+
+/* Must be called with the lock held */
+static void entry_unlink(uint16_t tag)
+{
+	if (!atomic_test_and_clear_bit(used, tag)) {
+		return;
+	}
+
+	bucket_remove(bucket_find(&entries[tag].addr));
+	count--;
+}
+
+/* Must be called with the lock held */
+static void entry_link(uint16_t tag, const struct registry_entry *entry)
+{
+	entries[tag] = *entry;
+	buckets[bucket_find(&entry->addr)] = tag + 1;
+	atomic_set_bit(used, tag);
+	count++;
+}
+
+static void key_name(char *name, size_t len, uint16_t tag)
+{
+	snprintf(name, len, REGISTRY_SUBTREE "/%u", tag);
+}
+
+static int save(uint16_t tag, const struct registry_entry *entry)
+{
+	char name[16];
+	int err;
+
+	key_name(name, sizeof(name), tag);
+	err = entry ? settings_save_one(name, entry, sizeof(*entry)) : settings_delete(name);
+	if (err) {
+		LOG_ERR("Failed to save tag %d (err %d)", tag, err);
+	}
+
+	return err;
+}
+
+static int registry_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	struct registry_entry entry;
+	k_spinlock_key_t key;
+	unsigned long tag;
+	char *end;
+	ssize_t read;
+
+	tag = strtoul(name, &end, 10);
+	if (end == name || *end != '\0' || tag >= MAX_SYNCS || len != sizeof(entry)) {
+		/* Left over from a build with more slots or another layout */
+		LOG_WRN("Ignoring saved tag %s", name);
+		return 0;
+	}
+
+	read = read_cb(cb_arg, &entry, sizeof(entry));
+	if (read != sizeof(entry)) {
+		return read < 0 ? read : -EIO;
+	}
+
+	key = k_spin_lock(&lock);
+	entry_unlink(tag);
+	if (buckets[bucket_find(&entry.addr)] == BUCKET_EMPTY) {
+		entry_link(tag, &entry);
+	}
+	k_spin_unlock(&lock, key);
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(registry, REGISTRY_SUBTREE, NULL, registry_set, NULL, NULL);
+
+int registry_init(void)
+{
+	int err;
+
+	err = settings_subsys_init();
+	if (err) {
+		LOG_ERR("Settings init failed (err %d)", err);
+		return err;
+	}
+
+	err = settings_load_subtree(REGISTRY_SUBTREE);
+	if (err) {
+		LOG_ERR("Failed to load tags (err %d)", err);
+		return err;
+	}
+
+	LOG_INF("%d tags registered", count);
+
+	return 0;
+}
+
+int registry_lookup(const bt_addr_le_t *addr)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	uint16_t tag = buckets[bucket_find(addr)];
+
+	k_spin_unlock(&lock, key);
+
+	return tag == BUCKET_EMPTY ? -ENOENT : tag - 1;
+}
+
+int registry_get(uint16_t tag, struct registry_entry *entry)
+{
+	k_spinlock_key_t key;
+	int err = -ENOENT;
+
+	if (tag >= MAX_SYNCS) {
+		return -ENOENT;
+	}
+
+	key = k_spin_lock(&lock);
+	if (atomic_test_bit(used, tag)) {
+		*entry = entries[tag];
+		err = 0;
+	}
+	k_spin_unlock(&lock, key);
+
+	return err;
+}
+
+bool registry_known(uint16_t tag)
+{
+	return tag < MAX_SYNCS && atomic_test_bit(used, tag);
+}
+
+int registry_add(uint16_t tag, const bt_addr_le_t *addr, uint8_t group)
+{
+	struct registry_entry entry = { .group = group };
+	k_spinlock_key_t key;
+	uint16_t old;
+	int err;
+
+	if (tag >= MAX_SYNCS) {
+		return -EINVAL;
+	}
+
+	bt_addr_le_copy(&entry.addr, addr);
+
+	key = k_spin_lock(&lock);
+	old = buckets[bucket_find(addr)];
+	if (old != BUCKET_EMPTY) {
+		entry_unlink(old - 1);
+	}
+	entry_unlink(tag);
+	entry_link(tag, &entry);
+	k_spin_unlock(&lock, key);
+
+	if (old != BUCKET_EMPTY && old - 1 != tag) {
+		(void)save(old - 1, NULL);
+	}
+
+	err = save(tag, &entry);
+	if (!err) {
+		LOG_INF("Tag %d registered", tag);
+	}
+
+	return err;
+}
+
+void registry_remove(uint16_t tag)
+{
+	k_spinlock_key_t key;
+	bool was_used;
+
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	was_used = atomic_test_bit(used, tag);
+	entry_unlink(tag);
+	k_spin_unlock(&lock, key);
+
+	if (was_used) {
+		(void)save(tag, NULL);
+		LOG_INF("Tag %d forgotten", tag);
+	}
+}
+
+void registry_set_group(uint16_t tag, uint8_t group)
+{
+	struct registry_entry entry;
+	k_spinlock_key_t key;
+	bool changed = false;
+
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	if (atomic_test_bit(used, tag) && entries[tag].group != group) {
+		entries[tag].group = group;
+		entry = entries[tag];
+		changed = true;
+	}
+	k_spin_unlock(&lock, key);
+
+	if (changed) {
+		(void)save(tag, &entry);
+	}
+}
+
+uint16_t registry_count(void)
+{
+	return count;
+}
@@ -1,5 +1,19 @@
+#include <stdlib.h>
 #include <zephyr/kernel.h>
 #include <zephyr/shell/shell.h>
+#include <zephyr/sys/util.h>
+
+#include "adaptive.h"
+#include "balance.h"
+#include "coord.h"
+#include "downlink.h"
+#include "groups.h"
+#include "image_xfer.h"
+#include "onboarding.h"
+#include "pawr_params.h"
+#include "registry.h"
+#include "telemetry.h"
+#include "esl_pool.h"
 
 /* Handler for command with no arguments */
 static int cmd_simple(const struct shell *sh, size_t argc, char **argv)
@@ -48,3 +62,934 @@ SHELL_CMD_REGISTER(args, NULL,
 /* Register command group with subcommands */
 SHELL_CMD_REGISTER(group, &sub_group,
     "Group of commands help string", NULL);
+
+/* esl downlink send <tag> <type> [hex data] */
+static int cmd_downlink_send(const struct shell *sh, size_t argc, char **argv)
+{
+    uint8_t data[DOWNLINK_CMD_DATA_MAX];
+    size_t len = 0;
+    unsigned long tag;
+    unsigned long type;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    type = shell_strtoul(argv[2], 0, &err);
+    if (err || tag >= MAX_SYNCS || type > UINT8_MAX) {
+        shell_error(sh, "Invalid tag or type");
+        return -EINVAL;
+    }
+
+    if (!pawr_params_tag_active(tag)) {
+        shell_error(sh, "Tag %lu has no slot in the current timing", tag);
+        return -EINVAL;
+    }
+
+    if (argc > 3) {
+        len = hex2bin(argv[3], strlen(argv[3]), data, sizeof(data));
+        if (len == 0) {
+            shell_error(sh, "Invalid hex data (max %d bytes)", (int)DOWNLINK_CMD_DATA_MAX);
+            return -EINVAL;
+        }
+    }
+
+    err = downlink_enqueue(tag, type, data, len);
+    if (err) {
+        shell_error(sh, "Failed to queue command (err %d)", err);
+        return err;
+    }
+
+    shell_print(sh, "Queued type 0x%02lx (%d bytes) for tag %lu, depth %d, in flight %d", type,
+                len, tag, downlink_queue_depth(tag), downlink_inflight(tag));
+    return 0;
+}
+
+static int cmd_downlink_flush(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS) {
+        shell_error(sh, "Invalid tag");
+        return -EINVAL;
+    }
+
+    downlink_flush(tag);
+    return 0;
+}
+
+static int cmd_downlink_burst(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag;
+    uint8_t subevent;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS) {
+        shell_error(sh, "Invalid tag");
+        return -EINVAL;
+    }
+
+    subevent = downlink_burst_subevent(tag);
+    if (subevent != ESL_SUBEVENT_NONE) {
+        shell_print(sh, "Tag %lu also receives subevent %d", tag, subevent);
+        return 0;
+    }
+
+    err = downlink_burst(tag);
+    if (err) {
+        shell_error(sh, "No subevent to lend (err %d)", err);
+        return err;
+    }
+
+    shell_print(sh, "Telling tag %lu to receive a second subevent", tag);
+    return 0;
+}
+
+static int cmd_downlink_stats(const struct shell *sh, size_t argc, char **argv)
+{
+    struct downlink_stats stats;
+
+    downlink_get_stats(&stats);
+
+    shell_print(sh, "Queued %u, sent %u, dropped %u", stats.queued, stats.sent, stats.dropped);
+    shell_print(sh, "Acked %u, retried %u, expired %u", stats.acked, stats.retried, stats.expired);
+    shell_print(sh, "Subevents lent %u, commands sent in them %u", stats.bursts, stats.burst_sent);
+    shell_print(sh, "Sleep hints %u", stats.hints);
+    shell_print(sh, "Queue depth %u (max %u)", stats.queue_depth, stats.queue_depth_max);
+    shell_print(sh, "Subevent  last  total      used       empty");
+    for (int i = 0; i < NUM_SUBEVENTS; i++) {
+        shell_print(sh, "%8d  %4u  %-9u  %-9u  %u", i, stats.subevent[i].bytes_last,
+                    stats.subevent[i].bytes_total, stats.subevent[i].events_used,
+                    stats.subevent[i].events_empty);
+    }
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_downlink,
+    SHELL_CMD_ARG(send, NULL, "Queue a command: <tag> <type> [hex data]", cmd_downlink_send, 3, 1),
+    SHELL_CMD_ARG(flush, NULL, "Drop queued commands: <tag>", cmd_downlink_flush, 2, 0),
+    SHELL_CMD_ARG(burst, NULL, "Lend a tag a second subevent: <tag>", cmd_downlink_burst, 2, 0),
+    SHELL_CMD(stats, NULL, "Queue depth and payload bytes per subevent", cmd_downlink_stats),
+    SHELL_SUBCMD_SET_END
+);
+
+static int cmd_onboard_stats(const struct shell *sh, size_t argc, char **argv)
+{
+    struct onboarding_stats stats;
+    uint32_t configured;
+    uint32_t elapsed_ms;
+
+    onboarding_get_stats(&stats);
+
+    configured = stats.onboarded + stats.unconfirmed;
+    elapsed_ms = (uint32_t)(stats.last_ms - stats.first_ms);
+
+    shell_print(sh, "Onboarded %u, unconfirmed %u, failed %u, in progress %u", stats.onboarded,
+                stats.unconfirmed, stats.failed, stats.active);
+    shell_print(sh, "Handle cache hits %u, misses %u", stats.cache_hits, stats.cache_misses);
+
+    if (configured) {
+        shell_print(sh, "Average connection time %u ms",
+                    (uint32_t)(stats.conn_time_ms / configured));
+    }
+
+    if (elapsed_ms) {
+        /* Tenths of a tag per minute */
+        uint32_t rate = (uint32_t)((uint64_t)configured * 600000U / elapsed_ms);
+
+        shell_print(sh, "Rate %u.%u tags/min", rate / 10, rate % 10);
+    }
+    return 0;
+}
+
+/* Group id or "none" */
+static int parse_group(const char *arg, uint8_t *group)
+{
+    unsigned long id;
+    int err = 0;
+
+    if (!strcmp(arg, "none")) {
+        *group = ESL_GROUP_NONE;
+        return 0;
+    }
+
+    id = shell_strtoul(arg, 0, &err);
+    if (err || id >= ESL_GROUP_COUNT) {
+        return -EINVAL;
+    }
+
+    *group = id;
+    return 0;
+}
+
+static int cmd_onboard_group(const struct shell *sh, size_t argc, char **argv)
+{
+    uint8_t group;
+
+    if (argc > 1) {
+        if (parse_group(argv[1], &group)) {
+            shell_error(sh, "Expected a group below %d or none", ESL_GROUP_COUNT);
+            return -EINVAL;
+        }
+
+        onboarding_set_group(group);
+    }
+
+    group = onboarding_get_group();
+    if (group == ESL_GROUP_NONE) {
+        shell_print(sh, "New tags join no group");
+    } else {
+        shell_print(sh, "New tags join group %d", group);
+    }
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_onboard,
+    SHELL_CMD(stats, NULL, "Onboarding counters and tags per minute", cmd_onboard_stats),
+    SHELL_CMD_ARG(group, NULL, "Group for newly onboarded tags: [<group>|none]",
+                  cmd_onboard_group, 1, 1),
+    SHELL_SUBCMD_SET_END
+);
+
+static int cmd_group_show(const struct shell *sh, size_t argc, char **argv)
+{
+    bool any = false;
+
+    for (uint8_t group = 0; group < ESL_GROUP_COUNT; group++) {
+        int tags = 0;
+        int subevents = 0;
+
+        for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+            uint16_t slots = groups_members(group, subevent);
+
+            if (slots) {
+                tags += POPCOUNT(slots);
+                subevents++;
+            }
+        }
+
+        if (tags) {
+            shell_print(sh, "Group %3d: %d tags in %d subevents", group, tags, subevents);
+            any = true;
+        }
+    }
+
+    if (!any) {
+        shell_print(sh, "No groups");
+    }
+    return 0;
+}
+
+static int cmd_group_set(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag;
+    uint8_t group;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS || parse_group(argv[2], &group)) {
+        shell_error(sh, "Invalid tag or group");
+        return -EINVAL;
+    }
+
+    err = groups_move(tag, group);
+    if (err) {
+        shell_error(sh, "Failed to move tag %lu (err %d)", tag, err);
+        return err;
+    }
+
+    return 0;
+}
+
+static int cmd_group_send(const struct shell *sh, size_t argc, char **argv)
+{
+    uint8_t data[DOWNLINK_CMD_DATA_MAX];
+    size_t len = 0;
+    unsigned long type;
+    uint8_t group = ESL_GROUP_NONE;
+    int err = 0;
+
+    type = shell_strtoul(argv[2], 0, &err);
+    if (err || type > UINT8_MAX ||
+        (strcmp(argv[1], "all") && (parse_group(argv[1], &group) || group == ESL_GROUP_NONE))) {
+        shell_error(sh, "Invalid group or type");
+        return -EINVAL;
+    }
+
+    if (argc > 3) {
+        len = hex2bin(argv[3], strlen(argv[3]), data, sizeof(data));
+        if (len == 0) {
+            shell_error(sh, "Invalid hex data (max %d bytes)", (int)DOWNLINK_CMD_DATA_MAX);
+            return -EINVAL;
+        }
+    }
+
+    if (group == ESL_GROUP_NONE) {
+        err = groups_broadcast(type, data, len);
+    } else {
+        err = groups_send(group, type, data, len);
+    }
+
+    if (err < 0) {
+        shell_error(sh, "Failed to queue command (err %d)", err);
+        return err;
+    }
+
+    shell_print(sh, "Queued type 0x%02lx (%d bytes) in %d subevents", type, len, err);
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_esl_group,
+    SHELL_CMD(show, NULL, "Tags and subevents of each group", cmd_group_show),
+    SHELL_CMD_ARG(set, NULL, "Move a tag to a group: <tag> <group|none>", cmd_group_set, 3, 0),
+    SHELL_CMD_ARG(send, NULL, "Queue a command for a group: <group|all> <type> [hex data]",
+                  cmd_group_send, 3, 1),
+    SHELL_SUBCMD_SET_END
+);
+
+static int cmd_registry_show(const struct shell *sh, size_t argc, char **argv)
+{
+    struct registry_entry entry;
+    char addr[BT_ADDR_LE_STR_LEN];
+
+    for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+        if (registry_get(tag, &entry)) {
+            continue;
+        }
+
+        bt_addr_le_to_str(&entry.addr, addr, sizeof(addr));
+        if (entry.group == ESL_GROUP_NONE) {
+            shell_print(sh, "Tag %3d: %s, last seen %u events ago", tag, addr,
+                        telemetry_age(tag));
+        } else {
+            shell_print(sh, "Tag %3d: %s, group %d, last seen %u events ago", tag, addr,
+                        entry.group, telemetry_age(tag));
+        }
+    }
+
+    shell_print(sh, "%d of %d slots registered", registry_count(), MAX_SYNCS);
+    return 0;
+}
+
+static int cmd_registry_forget(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag = ONBOARDING_FORGET_ALL;
+    int err = 0;
+
+    if (strcmp(argv[1], "all")) {
+        tag = shell_strtoul(argv[1], 0, &err);
+        if (err || tag >= MAX_SYNCS) {
+            shell_error(sh, "Invalid tag");
+            return -EINVAL;
+        }
+    }
+
+    err = onboarding_forget(tag);
+    if (err) {
+        shell_error(sh, "Failed to forget (err %d)", err);
+        return err;
+    }
+
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_registry,
+    SHELL_CMD(show, NULL, "Registered tags and their addresses", cmd_registry_show),
+    SHELL_CMD_ARG(forget, NULL, "Free the slot of a tag out of service: <tag|all>",
+                  cmd_registry_forget, 2, 0),
+    SHELL_SUBCMD_SET_END
+);
+
+/* esl balance show [on|off] */
+static int cmd_balance_show(const struct shell *sh, size_t argc, char **argv)
+{
+    const struct bt_le_per_adv_param *param = pawr_params_get();
+    struct balance_stats stats;
+    bool enable;
+    int err = 0;
+
+    if (argc > 1) {
+        enable = shell_strtobool(argv[1], 0, &err);
+        if (err) {
+            shell_error(sh, "Expected on or off");
+            return -EINVAL;
+        }
+
+        balance_enable(enable);
+    }
+
+    balance_get_stats(&stats);
+
+    shell_print(sh, "Rebalancing %s, %u moves requested, %u done",
+                balance_is_enabled() ? "on" : "off", stats.requested, stats.moved);
+
+    for (uint8_t subevent = 0; subevent < NUM_SUBEVENTS; subevent++) {
+        uint16_t busiest = 0;
+        int tags = 0;
+
+        if (!pawr_params_subevent_active(subevent)) {
+            continue;
+        }
+
+        for (uint8_t slot = 0; slot < param->num_response_slots; slot++) {
+            uint16_t tag = TAG_ID(subevent, slot);
+
+            if (registry_known(tag)) {
+                tags++;
+                if (balance_tag_load(tag) > balance_tag_load(busiest)) {
+                    busiest = tag;
+                }
+            }
+        }
+
+        shell_print(sh, "Subevent %d: %d tags, %u B per %d s, busiest tag %d (%u B)", subevent,
+                    tags, stats.load[subevent], BALANCE_PERIOD_S, busiest,
+                    balance_tag_load(busiest));
+    }
+    return 0;
+}
+
+static int cmd_balance_run(const struct shell *sh, size_t argc, char **argv)
+{
+    int err = balance_run();
+
+    if (err == -EALREADY) {
+        shell_print(sh, "Subevents are balanced");
+    } else if (err == -ENOENT) {
+        shell_print(sh, "No tag can be moved right now");
+    } else if (err) {
+        shell_error(sh, "Failed to move a tag (err %d)", err);
+        return err;
+    }
+
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_balance,
+    SHELL_CMD_ARG(show, NULL, "Load per subevent, rebalancing every period: [on|off]",
+                  cmd_balance_show, 1, 1),
+    SHELL_CMD(run, NULL, "Move one tag off the busiest subevent now", cmd_balance_run),
+    SHELL_SUBCMD_SET_END
+);
+
+static int cmd_coord_show(const struct shell *sh, size_t argc, char **argv)
+{
+    struct coord_stats stats;
+    struct coord_peer peer;
+
+    coord_get_stats(&stats);
+
+    shell_print(sh, "Central %08x, %u peers", stats.id, stats.peers);
+
+    for (uint8_t i = 0; coord_get_peer(i, &peer) == 0; i++) {
+        shell_print(sh, "  %08x: heard %u ms ago, %u tags, %u trains, interval %u, "
+                    "phase %u us", peer.id, peer.age_ms, peer.hello.tags, peer.hello.trains,
+                    peer.hello.interval, peer.hello.phase_us);
+    }
+
+    shell_print(sh, "Claims %u, won %u, lost %u", stats.claimed, stats.won, stats.lost);
+    shell_print(sh, "Released %u, handed over %u", stats.released, stats.handed_over);
+    shell_print(sh, "Realigned %u times, anchor error %d us", stats.realigns,
+                stats.phase_error_us);
+    shell_print(sh, "Frames dropped %u", stats.dropped);
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_coord,
+    SHELL_CMD(show, NULL, "Other centrals, tag claims and anchor alignment", cmd_coord_show),
+    SHELL_SUBCMD_SET_END
+);
+
+static int cmd_pool(const struct shell *sh, size_t argc, char **argv)
+{
+    esl_pool_foreach(pool) {
+        struct esl_pool_stats stats;
+
+        esl_pool_get_stats(pool, &stats);
+        shell_print(sh, "%s: %u of %u blocks of %zu B in use, at most %u, %u failed",
+                    stats.name, stats.used, stats.blocks, stats.block_size, stats.used_max,
+                    stats.failed);
+    }
+    return 0;
+}
+
+/* Prints hundredths as a fixed point number, keeps float formatting out of the shell */
+#define CENTI_FMT "%s%d.%02d"
+#define CENTI_ARG(v) ((int)(v) < 0 ? "-" : ""), abs((int)(v)) / 100, abs((int)(v)) % 100
+
+static int cmd_telemetry_summary(const struct shell *sh, size_t argc, char **argv)
+{
+    struct telemetry_summary summary;
+
+    telemetry_summarize(&summary);
+
+    shell_print(sh, "Tags reporting %u/%u, responses %u, missed %u", summary.tags_seen,
+                MAX_SYNCS, summary.responses, summary.missed);
+
+    if (summary.tags_seen == 0) {
+        return 0;
+    }
+
+    shell_print(sh, "Temperature min " CENTI_FMT " avg " CENTI_FMT " max " CENTI_FMT " C",
+                CENTI_ARG(summary.temperature_min), CENTI_ARG(summary.temperature_avg),
+                CENTI_ARG(summary.temperature_max));
+    shell_print(sh, "Humidity avg " CENTI_FMT " %%", CENTI_ARG(summary.humidity_avg));
+    shell_print(sh, "Weakest RSSI %d dBm", summary.rssi_min);
+    return 0;
+}
+
+static int cmd_telemetry_tag(const struct shell *sh, size_t argc, char **argv)
+{
+    struct telemetry_tag entry;
+    unsigned long tag;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS) {
+        shell_error(sh, "Invalid tag");
+        return -EINVAL;
+    }
+
+    if (telemetry_get(tag, &entry)) {
+        shell_print(sh, "Tag %lu has not responded", tag);
+        return 0;
+    }
+
+    shell_print(sh, "Tag %lu (train %d, subevent %d, slot %d)", tag,
+                SUBEVENT_TRAIN(TAG_SUBEVENT(tag)), SUBEVENT_LOCAL(TAG_SUBEVENT(tag)),
+                TAG_RSP_SLOT(tag));
+    shell_print(sh, "  Temperature " CENTI_FMT " C, humidity " CENTI_FMT " %%",
+                CENTI_ARG(entry.temperature), CENTI_ARG(entry.humidity));
+    shell_print(sh, "  RSSI %d dBm, last seen %u events ago, missed %u", entry.rssi,
+                telemetry_age(tag), entry.missed);
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_telemetry,
+    SHELL_CMD(summary, NULL, "Summary over all tags", cmd_telemetry_summary),
+    SHELL_CMD_ARG(tag, NULL, "Last readings of one tag: <tag>", cmd_telemetry_tag, 2, 0),
+    SHELL_SUBCMD_SET_END
+);
+
+static void print_timing(const struct shell *sh, const struct bt_le_per_adv_param *param)
+{
+    /* Intervals in 1.25 ms units and slot spacing in 0.125 ms units, printed in us */
+    shell_print(sh, "Interval %u us (0x%04x), %u tags", param->interval_max * 1250U,
+                param->interval_max,
+                NUM_TRAINS * param->num_subevents * param->num_response_slots);
+    shell_print(sh, "%u trains of %u subevents every %u us, %u response slots", NUM_TRAINS,
+                param->num_subevents, param->subevent_interval * 1250U,
+                param->num_response_slots);
+    shell_print(sh, "Response slot delay %u us, spacing %u us",
+                param->response_slot_delay * 1250U, param->response_slot_spacing * 125U);
+}
+
+static int parse_plan(const struct shell *sh, char **argv, struct bt_le_per_adv_param *param)
+{
+    unsigned long tags;
+    unsigned long latency_ms;
+    int err = 0;
+
+    tags = shell_strtoul(argv[1], 0, &err);
+    latency_ms = shell_strtoul(argv[2], 0, &err);
+    if (err || tags == 0 || tags > MAX_SYNCS) {
+        shell_error(sh, "Need 1 to %d tags and a latency in ms", MAX_SYNCS);
+        return -EINVAL;
+    }
+
+    err = pawr_params_plan(tags, latency_ms, param);
+    if (err == -ERANGE) {
+        shell_error(sh, "%lu tags do not fit in %lu ms", tags, latency_ms);
+    } else if (err) {
+        shell_error(sh, "No valid timing (err %d)", err);
+    }
+
+    return err;
+}
+
+static int apply_timing(const struct shell *sh, const struct bt_le_per_adv_param *param)
+{
+    int err;
+
+    err = pawr_params_apply(param);
+    if (err) {
+        shell_error(sh, "Failed to apply timing (err %d)", err);
+        return err;
+    }
+
+    err = onboarding_reset();
+    if (err) {
+        shell_error(sh, "Failed to reset onboarding (err %d)", err);
+        return err;
+    }
+
+    print_timing(sh, pawr_params_get());
+    shell_print(sh, "Tags will be onboarded again as they lose sync");
+    return 0;
+}
+
+static int cmd_timing_show(const struct shell *sh, size_t argc, char **argv)
+{
+    print_timing(sh, pawr_params_get());
+    return 0;
+}
+
+/* esl timing plan <tags> <latency ms> */
+static int cmd_timing_plan(const struct shell *sh, size_t argc, char **argv)
+{
+    struct bt_le_per_adv_param param;
+    int err;
+
+    err = parse_plan(sh, argv, &param);
+    if (err) {
+        return err;
+    }
+
+    print_timing(sh, &param);
+    return 0;
+}
+
+static int cmd_timing_apply(const struct shell *sh, size_t argc, char **argv)
+{
+    struct bt_le_per_adv_param param;
+    int err;
+
+    err = parse_plan(sh, argv, &param);
+    if (err) {
+        return err;
+    }
+
+    return apply_timing(sh, &param);
+}
+
+/* esl timing capacity <tags> <latency ms> */
+static int cmd_timing_capacity(const struct shell *sh, size_t argc, char **argv)
+{
+    struct pawr_capacity cap;
+    unsigned long tags;
+    unsigned long latency_ms;
+    int err = 0;
+
+    tags = shell_strtoul(argv[1], 0, &err);
+    latency_ms = shell_strtoul(argv[2], 0, &err);
+    if (err || tags == 0 || tags > UINT16_MAX) {
+        shell_error(sh, "Need a tag count and a latency in ms");
+        return -EINVAL;
+    }
+
+    err = pawr_params_capacity(tags, latency_ms, &cap);
+    if (err) {
+        shell_error(sh, "%lu tags do not fit %lu ms on up to %d trains", tags, latency_ms,
+                    PAWR_CAPACITY_TRAINS_MAX);
+        return err;
+    }
+
+    shell_print(sh, "%u trains of %u tags (%u subevents of %u slots), interval %u us",
+                cap.trains, cap.tags_per_train, cap.subevents, cap.response_slots,
+                cap.interval * 1250U);
+    shell_print(sh, "Each train busy %u.%u %% of the interval, %u.%u %% of the airtime collides",
+                cap.busy_permille / 10U, cap.busy_permille % 10U, cap.collide_permille / 10U,
+                cap.collide_permille % 10U);
+    shell_print(sh, "This build runs %d trains, the host supports %u", NUM_TRAINS,
+                cap.trains_max);
+    if (cap.trains > cap.trains_max) {
+        shell_warn(sh, "Needs %u more advertising sets than the host has",
+                   cap.trains - cap.trains_max);
+    }
+    return 0;
+}
+
+/* esl timing set <interval> <subevents> <subevent interval> <delay> <spacing> <slots>,
+ * all in controller units
+ */
+static int cmd_timing_set(const struct shell *sh, size_t argc, char **argv)
+{
+    struct bt_le_per_adv_param param = { 0 };
+    unsigned long val[6];
+    int err = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(val); i++) {
+        val[i] = shell_strtoul(argv[i + 1], 0, &err);
+    }
+
+    if (err || val[0] > UINT16_MAX || val[1] > UINT8_MAX || val[2] > UINT8_MAX ||
+        val[3] > UINT8_MAX || val[4] > UINT8_MAX || val[5] > UINT8_MAX) {
+        shell_error(sh, "Invalid value");
+        return -EINVAL;
+    }
+
+    param.interval_min = val[0];
+    param.interval_max = val[0];
+    param.num_subevents = val[1];
+    param.subevent_interval = val[2];
+    param.response_slot_delay = val[3];
+    param.response_slot_spacing = val[4];
+    param.num_response_slots = val[5];
+
+    if (pawr_params_check(&param)) {
+        shell_error(sh, "Timing violates the PAwR constraints, see log");
+        return -EINVAL;
+    }
+
+    return apply_timing(sh, &param);
+}
+
+/* esl timing adaptive [on|off] */
+static int cmd_timing_adaptive(const struct shell *sh, size_t argc, char **argv)
+{
+    struct adaptive_stats stats;
+    bool enable;
+    int err = 0;
+
+    if (argc > 1) {
+        enable = shell_strtobool(argv[1], 0, &err);
+        if (err) {
+            shell_error(sh, "Expected on or off");
+            return -EINVAL;
+        }
+
+        adaptive_enable(enable);
+    }
+
+    adaptive_get_stats(&stats);
+
+    shell_print(sh, "Adaptive interval %s, now %s (%u ms, fast %u ms)",
+                adaptive_is_enabled() ? "on" : "off", pawr_params_is_fast() ? "fast" : "slow",
+                pawr_params_get()->interval_max * 5U / 4U, pawr_params_interval(true) * 5U / 4U);
+    shell_print(sh, "Switched to fast %u times, to slow %u times, %u s on fast", stats.to_fast,
+                stats.to_slow, (uint32_t)(stats.fast_ms / MSEC_PER_SEC));
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_timing,
+    SHELL_CMD(show, NULL, "Current PAwR timing", cmd_timing_show),
+    SHELL_CMD_ARG(plan, NULL, "Compute timing without applying it: <tags> <latency ms>",
+                  cmd_timing_plan, 3, 0),
+    SHELL_CMD_ARG(apply, NULL, "Compute and apply timing: <tags> <latency ms>",
+                  cmd_timing_apply, 3, 0),
+    SHELL_CMD_ARG(capacity, NULL,
+                  "Trains needed and how much they collide: <tags> <latency ms>",
+                  cmd_timing_capacity, 3, 0),
+    SHELL_CMD_ARG(set, NULL,
+                  "Apply raw timing: <interval> <subevents> <subevent interval> <delay> "
+                  "<spacing> <slots>",
+                  cmd_timing_set, 7, 0),
+    SHELL_CMD_ARG(adaptive, NULL, "Fast interval while downlink is busy: [on|off]",
+                  cmd_timing_adaptive, 1, 1),
+    SHELL_SUBCMD_SET_END
+);
+
+/* Frame sent by "esl image send", filled by "esl image load" or "esl image pattern" */
+static uint8_t image[ESL_IMG_SIZE];
+/* Copy of a frame the tags show, set by "esl image base" */
+static uint8_t base[ESL_IMG_SIZE];
+
+/* esl image load <offset> <hex data> */
+static int cmd_image_load(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long offset;
+    size_t len;
+    int err = 0;
+
+    offset = shell_strtoul(argv[1], 0, &err);
+    if (err || offset >= sizeof(image)) {
+        shell_error(sh, "Offset must be below %d", ESL_IMG_SIZE);
+        return -EINVAL;
+    }
+
+    len = hex2bin(argv[2], strlen(argv[2]), &image[offset], sizeof(image) - offset);
+    if (len == 0) {
+        shell_error(sh, "Invalid hex data");
+        return -EINVAL;
+    }
+
+    shell_print(sh, "Loaded %d bytes at %lu", len, offset);
+    return 0;
+}
+
+/* esl image pattern <0: white, 1: black, 2: checkerboard, 3: stripes> */
+static int cmd_image_pattern(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long pattern;
+    int err = 0;
+
+    pattern = shell_strtoul(argv[1], 0, &err);
+    if (err || pattern > 3) {
+        shell_error(sh, "Unknown pattern");
+        return -EINVAL;
+    }
+
+    for (size_t row = 0; row < ESL_IMG_HEIGHT; row++) {
+        for (size_t col = 0; col < ESL_IMG_STRIDE; col++) {
+            uint8_t *p = &image[row * ESL_IMG_STRIDE + col];
+
+            switch (pattern) {
+            case 0:
+                *p = 0x00;
+                break;
+            case 1:
+                *p = 0xFF;
+                break;
+            case 2:
+                *p = ((row / 8 + col) % 2) ? 0xFF : 0x00;
+                break;
+            default:
+                *p = ((row / 4) % 2) ? 0xFF : 0x00;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int cmd_image_base(const struct shell *sh, size_t argc, char **argv)
+{
+    memcpy(base, image, sizeof(base));
+    shell_print(sh, "Frame saved as delta base");
+    return 0;
+}
+
+/* esl image send <tag> [delta] */
+static int cmd_image_send(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag;
+    bool delta = false;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS || !pawr_params_tag_active(tag)) {
+        shell_error(sh, "Invalid tag");
+        return -EINVAL;
+    }
+
+    if (argc > 2) {
+        if (strcmp(argv[2], "delta")) {
+            shell_error(sh, "Unknown option %s", argv[2]);
+            return -EINVAL;
+        }
+        delta = true;
+    }
+
+    err = image_xfer_start(tag, image, delta ? base : NULL, sizeof(image));
+    if (err) {
+        shell_error(sh, "Failed to start transfer (err %d)", err);
+        return err;
+    }
+
+    return 0;
+}
+
+/* esl image rect <tag> <x> <y> <width> <height> */
+static int cmd_image_rect(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag;
+    unsigned long area[4];
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS || !pawr_params_tag_active(tag)) {
+        shell_error(sh, "Invalid tag");
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < ARRAY_SIZE(area); i++) {
+        area[i] = shell_strtoul(argv[i + 2], 0, &err);
+        if (err || area[i] > UINT8_MAX) {
+            shell_error(sh, "Invalid area");
+            return -EINVAL;
+        }
+    }
+
+    err = image_xfer_send_rect(tag, image, area[0], area[1], area[2], area[3]);
+    if (err == -EINVAL) {
+        shell_error(sh, "Area must fit %dx%d, y and height multiples of %d", ESL_IMG_WIDTH,
+                    ESL_IMG_HEIGHT, ESL_RECT_ALIGN);
+        return err;
+    } else if (err) {
+        shell_error(sh, "Failed to queue area (err %d)", err);
+        return err;
+    }
+
+    return 0;
+}
+
+static int cmd_image_abort(const struct shell *sh, size_t argc, char **argv)
+{
+    unsigned long tag;
+    int err = 0;
+
+    tag = shell_strtoul(argv[1], 0, &err);
+    if (err || tag >= MAX_SYNCS) {
+        shell_error(sh, "Invalid tag");
+        return -EINVAL;
+    }
+
+    image_xfer_abort(tag);
+    return 0;
+}
+
+static int cmd_image_stats(const struct shell *sh, size_t argc, char **argv)
+{
+    struct image_xfer_progress progress;
+    struct image_xfer_stats stats;
+
+    image_xfer_get_stats(&stats);
+
+    shell_print(sh, "Started %u, completed %u, failed %u", stats.started, stats.completed,
+                stats.failed);
+    shell_print(sh, "Chunks sent %u, resent %u", stats.chunks_sent, stats.chunks_resent);
+
+    if (stats.image_bytes) {
+        shell_print(sh, "Coded %u of %u bytes (%u%%), %u deltas rejected", stats.coded_bytes,
+                    stats.image_bytes,
+                    (uint32_t)((uint64_t)stats.coded_bytes * 100 / stats.image_bytes),
+                    stats.rejected);
+    }
+
+    if (stats.completed) {
+        uint32_t avg_ms = (uint32_t)(stats.total_ms / stats.completed);
+
+        shell_print(sh, "Seconds per image: last %u.%u, average %u.%u", stats.last_ms / 1000,
+                    (stats.last_ms % 1000) / 100, avg_ms / 1000, (avg_ms % 1000) / 100);
+    }
+
+    for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+        if (image_xfer_get_progress(tag, &progress) == 0) {
+            shell_print(sh, "Tag %d: image %d, %d/%d chunks, round %d, %u ms", tag,
+                        progress.image_id, progress.received, progress.num_chunks,
+                        progress.round + 1, progress.elapsed_ms);
+        }
+    }
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_image,
+    SHELL_CMD_ARG(load, NULL, "Write frame bytes: <offset> <hex data>", cmd_image_load, 3, 0),
+    SHELL_CMD_ARG(pattern, NULL, "Fill the frame: <0 white|1 black|2 checker|3 stripes>",
+                  cmd_image_pattern, 2, 0),
+    SHELL_CMD(base, NULL, "Save the frame as the base for deltas", cmd_image_base),
+    SHELL_CMD_ARG(send, NULL, "Send the frame to a tag: <tag> [delta]", cmd_image_send, 2, 1),
+    SHELL_CMD_ARG(rect, NULL, "Draw an area of the frame on a tag: <tag> <x> <y> <w> <h>",
+                  cmd_image_rect, 6, 0),
+    SHELL_CMD_ARG(abort, NULL, "Stop sending to a tag: <tag>", cmd_image_abort, 2, 0),
+    SHELL_CMD(stats, NULL, "Transfers in progress and seconds per image", cmd_image_stats),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_esl,
+    SHELL_CMD(downlink, &sub_downlink, "Downlink queue", NULL),
+    SHELL_CMD(onboard, &sub_onboard, "Tag onboarding", NULL),
+    SHELL_CMD(group, &sub_esl_group, "Tag groups", NULL),
+    SHELL_CMD(registry, &sub_registry, "Tags known by address", NULL),
+    SHELL_CMD(balance, &sub_balance, "Subevent load balancing", NULL),
+    SHELL_CMD(coord, &sub_coord, "Coordination with other centrals", NULL),
+    SHELL_CMD(pool, NULL, "Buffer pools and their high-water marks", cmd_pool),
+    SHELL_CMD(telemetry, &sub_telemetry, "Tag sensor readings", NULL),
+    SHELL_CMD(timing, &sub_timing, "PAwR timing", NULL),
+    SHELL_CMD(image, &sub_image, "Image transfer", NULL),
+    SHELL_SUBCMD_SET_END
+);
+
+SHELL_CMD_REGISTER(esl, &sub_esl, "ESL network commands", NULL);
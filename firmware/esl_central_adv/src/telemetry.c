@@ -0,0 +1,128 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+#include "telemetry.h"
+#include "esl_packets.h"
+
+/* AD length and type in front of the sensor reading */
+#define RSP_SENSOR_LEN (2 + sizeof(struct esl_sensor_reading))
+
+/* Kept as separate arrays so a sweep over one field (e.g. the summary, or a
+ * staleness scan) touches only that field's cache lines.
+ */
+static int16_t temperature[MAX_SYNCS];
+static uint16_t humidity[MAX_SYNCS];
+static int8_t rssi[MAX_SYNCS];
+static uint16_t event_counter[MAX_SYNCS];
+static uint16_t missed[MAX_SYNCS];
+static ATOMIC_DEFINE(seen, MAX_SYNCS);
+
+static uint16_t subevent_events[NUM_SUBEVENTS];
+static uint32_t responses_total;
+static uint32_t missed_total;
+
+void telemetry_subevent_event(uint8_t subevent)
+{
+	if (subevent < NUM_SUBEVENTS) {
+		subevent_events[subevent]++;
+	}
+}
+
+void telemetry_ingest(uint16_t tag, const struct bt_le_per_adv_response_info *info,
+		      const struct net_buf_simple *buf)
+{
+	struct esl_sensor_reading reading;
+
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	if (!buf) {
+		missed[tag]++;
+		missed_total++;
+		return;
+	}
+
+	responses_total++;
+	rssi[tag] = info->rssi;
+	event_counter[tag] = subevent_events[TAG_SUBEVENT(tag)];
+	atomic_set_bit(seen, tag);
+
+	if (buf->len < RSP_SENSOR_LEN || buf->data[0] < RSP_SENSOR_LEN - 1 ||
+	    buf->data[1] != BT_DATA_MANUFACTURER_DATA) {
+		return;
+	}
+
+	memcpy(&reading, &buf->data[2], sizeof(reading));
+	temperature[tag] = (int16_t)(reading.temperature * 100.0f);
+	humidity[tag] = (uint16_t)(reading.humidity * 100.0f);
+}
+
+int telemetry_get(uint16_t tag, struct telemetry_tag *out)
+{
+	if (tag >= MAX_SYNCS || !atomic_test_bit(seen, tag)) {
+		return -ENOENT;
+	}
+
+	out->temperature = temperature[tag];
+	out->humidity = humidity[tag];
+	out->rssi = rssi[tag];
+	out->event_counter = event_counter[tag];
+	out->missed = missed[tag];
+
+	return 0;
+}
+
+void telemetry_forget(uint16_t tag)
+{
+	if (tag >= MAX_SYNCS) {
+		return;
+	}
+
+	atomic_clear_bit(seen, tag);
+	missed[tag] = 0;
+	/* Age counts from now, not from the previous owner's last response */
+	event_counter[tag] = subevent_events[TAG_SUBEVENT(tag)];
+}
+
+uint16_t telemetry_age(uint16_t tag)
+{
+	if (tag >= MAX_SYNCS) {
+		return 0;
+	}
+
+	return subevent_events[TAG_SUBEVENT(tag)] - event_counter[tag];
+}
+
+void telemetry_summarize(struct telemetry_summary *summary)
+{
+	int32_t temperature_sum = 0;
+	uint32_t humidity_sum = 0;
+
+	memset(summary, 0, sizeof(*summary));
+	summary->temperature_min = INT16_MAX;
+	summary->temperature_max = INT16_MIN;
+	summary->rssi_min = INT8_MAX;
+
+	for (uint16_t tag = 0; tag < MAX_SYNCS; tag++) {
+		if (!atomic_test_bit(seen, tag)) {
+			continue;
+		}
+
+		summary->tags_seen++;
+		summary->temperature_min = MIN(summary->temperature_min, temperature[tag]);
+		summary->temperature_max = MAX(summary->temperature_max, temperature[tag]);
+		summary->rssi_min = MIN(summary->rssi_min, rssi[tag]);
+		temperature_sum += temperature[tag];
+		humidity_sum += humidity[tag];
+	}
+
+	if (summary->tags_seen) {
+		summary->temperature_avg = temperature_sum / summary->tags_seen;
+		summary->humidity_avg = humidity_sum / summary->tags_seen;
+	}
+
+	summary->responses = responses_total;
+	summary->missed = missed_total;
+}
@@ -4,14 +4,70 @@
 #include <zephyr/device.h>
 #include <lvgl.h>
 
+#include "rect_update.h"
+
+/*
+ * LVGL objects can be changed at any time, suspended or not. Nothing is drawn
+ * until the next update, which renders every area changed since the last one
+ * once, however often it changed in between.
+ *
+ * The panel is powered while it is held by display_manager_resume() or while
+ * a session from display_manager_begin() is open. An update or area write on
+ * a suspended display opens its own session, so resume, draw and suspend
+ * happen together.
+ */
+
+/**
+ * @brief Draw what changed with a full refresh of the panel
+ */
 void display_manager_full_update(void);
 
-void display_manager_partial_update(void);
+/**
+ * @brief Run LVGL's timers and draw what changed
+ *
+ * @return uint32_t ms until LVGL needs to run again, LV_NO_TIMER_READY if
+ *         nothing is animating or left to draw, or the display is suspended
+ */
+uint32_t display_manager_partial_update(void);
+
+/**
+ * @brief Draw an area straight to the panel, bypassing LVGL
+ *
+ * Only the area is written and refreshed. LVGL does not know about it, so the
+ * next redraw of the screen replaces it.
+ *
+ * @return int 0 on success, negative error code from the driver otherwise
+ */
+int display_manager_write_rect(const struct rect_update *update);
+
+/**
+ * @brief Open a session, powering the panel up if needed
+ *
+ * Batches several draws under one resume. Sessions nest, every successful
+ * call needs a display_manager_end().
+ *
+ * @return int 0 on success, negative error code if the panel did not resume
+ */
+int display_manager_begin(void);
+
+/**
+ * @brief Close a session, the panel is suspended unless it is held
+ */
+void display_manager_end(void);
 
+/**
+ * @brief Keep the panel powered until display_manager_suspend()
+ */
 int display_manager_resume(void);
 
+/**
+ * @brief Let the panel be suspended, as soon as no session is open
+ */
 int display_manager_suspend(void);
 
+/**
+ * @brief Check whether the panel is powered
+ */
 bool display_manager_is_active(void);
 
 #endif /* DISPLAY_MANAGER_H__ */
@@ -0,0 +1,46 @@
+#ifndef IMAGE_TRANSFER_H__
+#define IMAGE_TRANSFER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/zbus/zbus.h>
+
+/* Published on image_chan when every chunk of a transfer has arrived */
+struct image_transfer_done {
+	uint8_t image_id;
+	uint32_t elapsed_ms;
+};
+
+ZBUS_CHAN_DECLARE(image_chan);
+
+/**
+ * @brief Handle ESL_CMD_IMG_START, a repeat of the current transfer is ignored
+ */
+void image_transfer_start(const uint8_t *data, uint8_t len);
+
+/**
+ * @brief Handle ESL_CMD_IMG_CHUNK
+ */
+void image_transfer_chunk(const uint8_t *data, uint8_t len);
+
+/**
+ * @brief Append the transfer status record to a response payload
+ *
+ * Nothing is added before the first transfer starts.
+ */
+void image_transfer_add_status(struct net_buf_simple *rsp);
+
+/**
+ * @brief Last completed image, for the display thread
+ *
+ * The map stays untouched until the next call, transfers are assembled in
+ * another buffer meanwhile.
+ *
+ * @param size Set to the length of the returned buffer
+ * @return const uint8_t* LV_IMG_CF_INDEXED_1BIT map including the palette, or
+ *         NULL if no image is complete
+ */
+const uint8_t *image_transfer_get(size_t *size);
+
+#endif /* IMAGE_TRANSFER_H__ */
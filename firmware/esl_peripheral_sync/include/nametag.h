@@ -7,6 +7,7 @@
 void nametag_display_show(uint8_t index);
 void nametag_display_next(void);
 void nametag_display_previous(void);
+void nametag_display_refresh(void);
 size_t nametag_get_string(char *str, size_t length);
 
 #endif
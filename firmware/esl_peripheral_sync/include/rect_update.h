@@ -0,0 +1,24 @@
+#ifndef RECT_UPDATE_H__
+#define RECT_UPDATE_H__
+
+#include <stdint.h>
+
+#include "esl_packets.h"
+
+/* Queued as UI_CMD_RECT for every valid ESL_CMD_RECT */
+struct rect_update {
+	struct esl_cmd_rect area;
+	uint8_t len;
+	uint8_t pixels[ESL_RECT_PIXELS_MAX];
+};
+
+/**
+ * @brief Handle ESL_CMD_RECT
+ *
+ * The area is decoded straight into a ui_queue slot, checked against the
+ * frame size and alignment and queued for the state manager; nothing is drawn
+ * from the Bluetooth thread.
+ */
+void rect_update_handle(const uint8_t *data, uint8_t len);
+
+#endif /* RECT_UPDATE_H__ */
@@ -0,0 +1,37 @@
+#ifndef RESPONSE_H__
+#define RESPONSE_H__
+
+#include <zephyr/net/buf.h>
+#include "esl_packets.h"
+
+/*
+ * The response to the home subevent is encoded ahead of time, off the
+ * Bluetooth RX thread: sensor readings as they are published on sensor_chan,
+ * the image transfer and burst status when they change. recv_cb only picks up
+ * the latest one, so what it sends is the state as of the previous event.
+ */
+
+/**
+ * @brief Latest encoded response
+ *
+ * Call from recv_cb only, the buffer stays valid until it returns.
+ *
+ * @return const struct net_buf_simple* NULL until the first one is built
+ */
+const struct net_buf_simple *response_get(void);
+
+/**
+ * @brief Rebuild the response on the system workqueue
+ *
+ * Call after the image transfer status changed. Cheap, safe from recv_cb.
+ */
+void response_update(void);
+
+/**
+ * @brief Set the burst status record and rebuild the response
+ *
+ * @param burst Record to add, NULL to leave it out
+ */
+void response_set_burst(const struct esl_burst_status *burst);
+
+#endif /* RESPONSE_H__ */
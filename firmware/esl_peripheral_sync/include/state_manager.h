@@ -10,6 +10,13 @@
 #define EVENT_KEY_2     BIT(2)
 #define EVENT_KEY_3     BIT(3)
 #define EVENT_BOOT_DONE BIT(4)
+#define EVENT_IMAGE_READY BIT(5)
+/* Display commands queued in ui_queue */
+#define EVENT_DOWNLINK  BIT(6)
+/* A key was released, only for LVGL's input device */
+#define EVENT_KEY_UP    BIT(7)
+
+#define EVENT_KEYS (EVENT_KEY_0 | EVENT_KEY_1 | EVENT_KEY_2 | EVENT_KEY_3)
 
 struct epd_sm_data {
     struct smf_ctx ctx;
@@ -17,6 +24,13 @@ struct epd_sm_data {
     struct k_timer boot_timer;
     uint32_t events;
     uint8_t current_state;
+    /* Set by a state that needs LVGL run again, in ms, LV_NO_TIMER_READY if not */
+    uint32_t lvgl_next_ms;
+    /* LVGL is run on its own timers until then after a key, see config_run() */
+    int64_t input_until;
+    /* Times the thread woke up, reported per hour once an hour has passed */
+    uint32_t wakeups;
+    int64_t wakeups_since;
 };
 
 #endif
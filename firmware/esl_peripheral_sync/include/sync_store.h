@@ -0,0 +1,41 @@
+#ifndef SYNC_STORE_H__
+#define SYNC_STORE_H__
+
+#include <stdint.h>
+#include <zephyr/bluetooth/addr.h>
+
+/* What a tag needs to find its train again after a reboot */
+struct sync_store {
+	bt_addr_le_t addr;
+	uint8_t sid;
+	/* Periodic advertising interval, 1.25ms units */
+	uint16_t interval;
+	uint8_t subevent;
+	uint8_t response_slot;
+	uint8_t group;
+} __packed;
+
+/**
+ * @brief Load the saved record from settings
+ *
+ * Initializes the settings subsystem, call once at boot after bt_enable().
+ *
+ * @return int 0 if a record was loaded, -ENOENT if there is none, error from
+ *         the settings subsystem otherwise
+ */
+int sync_store_load(struct sync_store *store);
+
+/**
+ * @brief Save the record
+ *
+ * Safe from the Bluetooth threads, the flash write happens on the system
+ * workqueue and only if the record changed.
+ */
+void sync_store_save(const struct sync_store *store);
+
+/**
+ * @brief Delete the saved record, the next boot waits for onboarding
+ */
+void sync_store_clear(void);
+
+#endif /* SYNC_STORE_H__ */
@@ -0,0 +1,75 @@
+#ifndef UI_QUEUE_H__
+#define UI_QUEUE_H__
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+#include "rect_update.h"
+
+/*
+ * Display commands, decoded in recv_cb and drawn by the state manager
+ *
+ * A lock-free single producer, single consumer ring: only the Bluetooth RX
+ * thread queues, only the state manager thread drains. Neither side waits on
+ * the other, a full ring drops the command.
+ */
+#define UI_QUEUE_LEN 4
+
+enum ui_cmd_type {
+	UI_CMD_RECT,
+};
+
+struct ui_cmd {
+	uint8_t type;
+	union {
+		struct rect_update rect;
+	};
+};
+
+/**
+ * @brief Attach the consumer
+ *
+ * Until then nothing is queued. Call from the consumer thread.
+ *
+ * @param events Event object to post @p event to whenever a command is queued
+ */
+void ui_queue_attach(struct k_event *events, uint32_t event);
+
+/**
+ * @brief Slot to decode the next command into, producer only
+ *
+ * Nothing is queued before ui_queue_produce(), a slot that is not produced is
+ * handed out again.
+ *
+ * @return struct ui_cmd* NULL if the ring is full or there is no consumer
+ */
+struct ui_cmd *ui_queue_acquire(void);
+
+/**
+ * @brief Queue the slot from ui_queue_acquire() and wake the consumer
+ */
+void ui_queue_produce(void);
+
+/**
+ * @brief Oldest queued command, consumer only
+ *
+ * @return struct ui_cmd* NULL if there is none, valid until ui_queue_release()
+ */
+struct ui_cmd *ui_queue_consume(void);
+
+/**
+ * @brief Hand the slot from ui_queue_consume() back to the producer
+ */
+void ui_queue_release(void);
+
+/**
+ * @brief Drop every queued command, consumer only
+ */
+void ui_queue_purge(void);
+
+/**
+ * @brief Commands dropped for a full ring
+ */
+uint32_t ui_queue_dropped(void);
+
+#endif /* UI_QUEUE_H__ */
@@ -11,48 +11,156 @@ LOG_MODULE_REGISTER(display_manager, LOG_LEVEL_INF);
 
 static const struct device *display_dev = DEVICE_DT_GET(DT_CHOSEN(zephyr_display));
 
+/* Whether the panel is powered */
 static bool display_active = true;
+/* Kept on by display_manager_resume() until display_manager_suspend() */
+static bool display_held = true;
+/* Open display_manager_begin() calls */
+static uint8_t sessions;
+
+/* Area in the panel's own layout, never larger than the packed rows */
+static uint8_t rect_buf[ESL_RECT_PIXELS_MAX];
+
+static int display_power(bool on) {
+#if defined(CONFIG_PM_DEVICE)
+    int err;
+
+    if (display_active == on) {
+        return 0;
+    }
+
+    err = pm_device_action_run(display_dev, on ? PM_DEVICE_ACTION_RESUME :
+                                                 PM_DEVICE_ACTION_SUSPEND);
+    if (err) {
+        LOG_ERR("Failed to %s display: %d", on ? "resume" : "suspend", err);
+        return err;
+    }
+    display_active = on;
+    LOG_INF("Display %s", on ? "resumed" : "suspended");
+#endif
+    return 0;
+}
+
+int display_manager_begin(void) {
+    int err = display_power(true);
+
+    if (err) {
+        return err;
+    }
+    sessions++;
+
+    return 0;
+}
+
+void display_manager_end(void) {
+    __ASSERT_NO_MSG(sessions > 0);
+
+    if (--sessions == 0 && !display_held) {
+        (void)display_power(false);
+    }
+}
 
 void display_manager_full_update(void) {
-    if (!display_active) {
+    if (display_manager_begin()) {
         return;
     }
     display_blanking_on(display_dev);
     lv_task_handler();
     display_blanking_off(display_dev);
+    display_manager_end();
 }
 
-void display_manager_partial_update(void) {
+uint32_t display_manager_partial_update(void) {
+    uint32_t next;
+
+    /* Input and animations only run while the panel is kept on, a suspended
+     * display is drawn by the next full update
+     */
     if (!display_active) {
-        return;
+        return LV_NO_TIMER_READY;
     }
-    lv_task_handler();
+
+    next = lv_task_handler();
+
+    /* The refresh and input device timers are periodic, so LVGL is always
+     * due again within a refresh period. Only follow it while there is
+     * something to show.
+     */
+    if (lv_anim_count_running() == 0 && lv_disp_get_default()->inv_p == 0) {
+        return LV_NO_TIMER_READY;
+    }
+
+    return next;
 }
 
-int display_manager_resume(void) {
-#if defined(CONFIG_PM_DEVICE)
-    int err = pm_device_action_run(display_dev, PM_DEVICE_ACTION_RESUME);
+int display_manager_write_rect(const struct rect_update *update) {
+    const struct esl_cmd_rect *area = &update->area;
+    size_t stride = DIV_ROUND_UP(area->width, 8);
+    struct display_capabilities caps;
+    struct display_buffer_descriptor desc = { 0 };
+    bool vtiled;
+    bool msb_first;
+    bool invert;
+    int err;
+
+    err = display_manager_begin();
     if (err) {
-        LOG_ERR("Failed to resume display: %d", err);
         return err;
     }
-    display_active = true;
-    LOG_INF("Display resumed");
-#endif
-    return 0;
+
+    display_get_capabilities(display_dev, &caps);
+    vtiled = caps.screen_info & SCREEN_INFO_MONO_VTILED;
+    msb_first = caps.screen_info & SCREEN_INFO_MONO_MSB_FIRST;
+    invert = caps.current_pixel_format == PIXEL_FORMAT_MONO10;
+
+    memset(rect_buf, 0, sizeof(rect_buf));
+
+    for (size_t row = 0; row < area->height; row++) {
+        for (size_t col = 0; col < area->width; col++) {
+            bool black = update->pixels[row * stride + col / 8] & BIT(7 - col % 8);
+            size_t byte;
+            size_t bit;
+
+            if (black == invert) {
+                continue;
+            }
+
+            if (vtiled) {
+                byte = (row / 8) * area->width + col;
+                bit = row % 8;
+            } else {
+                byte = row * stride + col / 8;
+                bit = col % 8;
+            }
+
+            rect_buf[byte] |= BIT(msb_first ? 7 - bit : bit);
+        }
+    }
+
+    desc.width = area->width;
+    desc.height = area->height;
+    desc.pitch = vtiled ? area->width : stride * 8;
+    desc.buf_size = vtiled ? area->width * area->height / 8 : stride * area->height;
+
+    /* Blanking is off outside of full updates, so the panel refreshes right
+     * away with its partial waveform.
+     */
+    err = display_write(display_dev, area->x, area->y, &desc, rect_buf);
+    display_manager_end();
+
+    return err;
+}
+
+int display_manager_resume(void) {
+    display_held = true;
+
+    return display_power(true);
 }
 
 int display_manager_suspend(void) {
-#if defined(CONFIG_PM_DEVICE)
-    int err = pm_device_action_run(display_dev, PM_DEVICE_ACTION_SUSPEND);
-    if (err) {
-        LOG_ERR("Failed to suspend display: %d", err);
-        return err;
-    }
-    display_active = false;
-    LOG_INF("Display suspended");
-#endif
-    return 0;
+    display_held = false;
+
+    return sessions ? 0 : display_power(false);
 }
 
 bool display_manager_is_active(void) {
@@ -0,0 +1,334 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/zbus/zbus.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(image_transfer, LOG_LEVEL_INF);
+
+#include "image_transfer.h"
+#include "esl_packets.h"
+#include "esl_image.h"
+
+/* Two 32-bit palette entries in front of the pixels, index 0 white, 1 black */
+#define PALETTE_LEN 8
+
+ZBUS_CHAN_DEFINE(image_chan,
+		 struct image_transfer_done,
+		 NULL,
+		 NULL,
+		 ZBUS_OBSERVERS_EMPTY,
+		 ZBUS_MSG_INIT(0)
+);
+
+/* A map handed to LVGL as is, with what the pixels add up to */
+struct frame {
+	uint8_t map[PALETTE_LEN + ESL_IMG_SIZE];
+	uint16_t size;
+	/* esl_img_crc() of the pixels */
+	uint16_t crc;
+};
+
+#define FRAME_INIT {                     \
+	.map = {                         \
+		0xff, 0xff, 0xff, 0xff,  \
+		0x00, 0x00, 0x00, 0xff,  \
+	},                               \
+}
+
+/* Transfers are assembled in the frame LVGL was not handed, and only shown
+ * once complete. Only the pointers are shared with the display thread.
+ */
+static struct frame frames[2] = { FRAME_INIT, FRAME_INIT };
+static struct k_spinlock lock;
+/* Last complete frame, NULL before the first */
+static struct frame *shown;
+/* Frame last handed out by image_transfer_get() */
+static struct frame *displayed;
+/* Frame the transfer in progress is written into */
+static struct frame *back = &frames[0];
+
+static struct {
+	uint8_t id;
+	uint16_t size;
+	uint8_t chunk_len;
+	uint8_t encoding;
+	uint8_t num_chunks;
+	uint8_t received;
+	bool started;
+	bool complete;
+	/* Complete, but the frame did not match the crc of the start */
+	bool failed;
+	/* Start of the transfer and of the one before, as received */
+	struct esl_img_start start;
+	struct esl_img_start prev_start;
+	/* A delta was refused, reported until the next transfer starts */
+	bool rejected;
+	/* Last start refused, kept after the next transfer starts */
+	struct esl_img_start rejected_start;
+	int64_t start_ms;
+} xfer;
+
+static ATOMIC_DEFINE(chunks, ESL_IMG_MAX_CHUNKS);
+
+void image_transfer_start(const uint8_t *data, uint8_t len)
+{
+	struct esl_img_start start;
+	const struct frame *base;
+	k_spinlock_key_t key;
+	uint16_t size;
+	uint8_t num_chunks;
+
+	if (len < sizeof(start)) {
+		return;
+	}
+
+	memcpy(&start, data, sizeof(start));
+	size = sys_le16_to_cpu(start.size);
+
+	/* The central repeats the start until it is acknowledged, which can be
+	 * after the next transfer started. The status is on the last one heard.
+	 */
+	if (xfer.started && !memcmp(&start, &xfer.start, sizeof(start))) {
+		xfer.rejected = false;
+		return;
+	}
+
+	if (!memcmp(&start, &xfer.rejected_start, sizeof(start))) {
+		xfer.rejected = true;
+		return;
+	}
+
+	if (!memcmp(&start, &xfer.prev_start, sizeof(start))) {
+		return;
+	}
+
+	if (size == 0 || size > ESL_IMG_SIZE || start.encoding > ESL_IMG_ENC_DELTA) {
+		LOG_WRN("Rejected image %d: %d bytes, encoding %d", start.image_id, size,
+			start.encoding);
+		return;
+	}
+
+	if (start.encoding == ESL_IMG_ENC_RAW) {
+		num_chunks = start.chunk_len ? DIV_ROUND_UP(size, start.chunk_len) : 0;
+	} else {
+		num_chunks = start.num_chunks;
+	}
+
+	if (num_chunks == 0 || num_chunks > ESL_IMG_MAX_CHUNKS) {
+		LOG_WRN("Rejected image %d: %d chunks", start.image_id, num_chunks);
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	base = shown;
+
+	/* A delta applied to any other frame would be garbage */
+	if (start.encoding == ESL_IMG_ENC_DELTA &&
+	    (!base || size != base->size || sys_le16_to_cpu(start.base_crc) != base->crc)) {
+		k_spin_unlock(&lock, key);
+		LOG_INF("Image %d is a delta against a frame not shown", start.image_id);
+		xfer.rejected = true;
+		xfer.rejected_start = start;
+		return;
+	}
+
+	/* The display may still draw from the frame it was handed. A complete
+	 * frame it has not picked up yet is written over, what it shows now is
+	 * the last complete frame again.
+	 */
+	back = displayed == &frames[0] ? &frames[1] : &frames[0];
+	if (shown == back) {
+		shown = displayed;
+	}
+	k_spin_unlock(&lock, key);
+
+	xfer.id = start.image_id;
+	xfer.size = size;
+	xfer.chunk_len = start.chunk_len;
+	xfer.encoding = start.encoding;
+	xfer.num_chunks = num_chunks;
+	xfer.received = 0;
+	xfer.started = true;
+	xfer.complete = false;
+	xfer.failed = false;
+	xfer.rejected = false;
+	xfer.prev_start = xfer.start;
+	xfer.start = start;
+	xfer.start_ms = k_uptime_get();
+
+	for (size_t i = 0; i < ARRAY_SIZE(chunks); i++) {
+		atomic_clear(&chunks[i]);
+	}
+
+	/* Whatever is not sent stays white, a delta applies to the frame shown */
+	if (xfer.encoding != ESL_IMG_ENC_DELTA) {
+		memset(&back->map[PALETTE_LEN], 0, ESL_IMG_SIZE);
+	} else if (base != back) {
+		memcpy(&back->map[PALETTE_LEN], &base->map[PALETTE_LEN], ESL_IMG_SIZE);
+	}
+
+	LOG_INF("Image %d: %d bytes in %d chunks, encoding %d", xfer.id, size, num_chunks,
+		xfer.encoding);
+}
+
+/* Check a chunk and write it into the frame, false if it is bad or a repeat */
+static bool store_raw(const uint8_t *data, uint8_t len)
+{
+	struct esl_img_chunk hdr;
+	size_t offset;
+	size_t expected;
+
+	if (len < sizeof(hdr)) {
+		return false;
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+	if (hdr.image_id != xfer.id || hdr.index >= xfer.num_chunks) {
+		return false;
+	}
+
+	offset = hdr.index * xfer.chunk_len;
+	expected = MIN(xfer.chunk_len, xfer.size - offset);
+	if (len - sizeof(hdr) != expected) {
+		LOG_WRN("Chunk %d of image %d is %d bytes, expected %d", hdr.index, hdr.image_id,
+			(int)(len - sizeof(hdr)), (int)expected);
+		return false;
+	}
+
+	/* Retransmissions of chunks that did arrive are expected */
+	if (atomic_test_and_set_bit(chunks, hdr.index)) {
+		return false;
+	}
+
+	memcpy(&back->map[PALETTE_LEN + offset], data + sizeof(hdr), expected);
+
+	return true;
+}
+
+/* Decode a coded chunk in place, without a copy of the decoded data */
+static bool store_rle(const uint8_t *data, uint8_t len)
+{
+	struct esl_img_rle_chunk hdr;
+	bool delta = xfer.encoding == ESL_IMG_ENC_DELTA;
+	uint16_t offset;
+	int err;
+
+	if (len < sizeof(hdr)) {
+		return false;
+	}
+
+	memcpy(&hdr, data, sizeof(hdr));
+	offset = sys_le16_to_cpu(hdr.offset);
+	if (hdr.image_id != xfer.id || hdr.index >= xfer.num_chunks || offset >= xfer.size) {
+		return false;
+	}
+
+	data += sizeof(hdr);
+	len -= sizeof(hdr);
+
+	/* Applying a delta twice undoes it, so check before marking it received */
+	err = esl_rle_decode(data, len, NULL, xfer.size - offset, delta);
+	if (err < 0) {
+		LOG_WRN("Chunk %d of image %d is malformed", hdr.index, hdr.image_id);
+		return false;
+	}
+
+	if (atomic_test_and_set_bit(chunks, hdr.index)) {
+		return false;
+	}
+
+	(void)esl_rle_decode(data, len, &back->map[PALETTE_LEN + offset], xfer.size - offset,
+			     delta);
+
+	return true;
+}
+
+void image_transfer_chunk(const uint8_t *data, uint8_t len)
+{
+	struct image_transfer_done done;
+	k_spinlock_key_t key;
+	bool stored;
+
+	if (!xfer.started || xfer.complete) {
+		return;
+	}
+
+	if (xfer.encoding == ESL_IMG_ENC_RAW) {
+		stored = store_raw(data, len);
+	} else {
+		stored = store_rle(data, len);
+	}
+
+	if (!stored || ++xfer.received < xfer.num_chunks) {
+		return;
+	}
+
+	xfer.complete = true;
+	back->size = xfer.size;
+	back->crc = esl_img_crc(&back->map[PALETTE_LEN], xfer.size);
+	if (back->crc != sys_le16_to_cpu(xfer.start.crc)) {
+		/* The frame shown stays, the central hears of it in the status */
+		LOG_WRN("Image %d does not match its crc", xfer.id);
+		xfer.failed = true;
+		return;
+	}
+
+	key = k_spin_lock(&lock);
+	shown = back;
+	k_spin_unlock(&lock, key);
+
+	done.image_id = xfer.id;
+	done.elapsed_ms = k_uptime_get() - xfer.start_ms;
+	LOG_INF("Image %d complete in %u ms", done.image_id, done.elapsed_ms);
+
+	(void)zbus_chan_pub(&image_chan, &done, K_NO_WAIT);
+}
+
+void image_transfer_add_status(struct net_buf_simple *rsp)
+{
+	struct esl_img_status status = { 0 };
+
+	if (xfer.rejected) {
+		status.image_id = xfer.rejected_start.image_id;
+		status.crc = xfer.rejected_start.crc;
+		status.flags = ESL_IMG_STATUS_REJECTED;
+		(void)esl_rsp_add(rsp, ESL_RSP_IMG_STATUS, &status, sizeof(status));
+		return;
+	}
+
+	if (!xfer.started) {
+		return;
+	}
+
+	status.image_id = xfer.id;
+	status.crc = xfer.start.crc;
+	status.received = xfer.received;
+	status.flags = xfer.failed ? ESL_IMG_STATUS_CRC_FAILED : 0;
+
+	for (uint8_t i = 0; i < xfer.num_chunks; i++) {
+		if (!atomic_test_bit(chunks, i)) {
+			WRITE_BIT(status.missing[i / 8], i % 8, 1);
+		}
+	}
+
+	if (esl_rsp_add(rsp, ESL_RSP_IMG_STATUS, &status, sizeof(status))) {
+		LOG_WRN("No room for image status");
+	}
+}
+
+const uint8_t *image_transfer_get(size_t *size)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	/* Not written to again until the display is handed another frame */
+	displayed = shown;
+	k_spin_unlock(&lock, key);
+
+	if (!displayed) {
+		return NULL;
+	}
+
+	*size = sizeof(displayed->map);
+	return displayed->map;
+}
@@ -10,14 +10,36 @@
 #include <zephyr/bluetooth/uuid.h>
 #include <zephyr/bluetooth/hci.h>
 #include <zephyr/sys/util.h>
-#include <zephyr/zbus/zbus.h>
 
 #include <zephyr/logging/log.h>
 #include "esl_packets.h"
+#include "esl_pool.h"
+#include "image_transfer.h"
+#include "rect_update.h"
+#include "ui_queue.h"
+#include "response.h"
+#include "sync_store.h"
 
 LOG_MODULE_REGISTER(peripheral_sync, LOG_LEVEL_DBG);
 
 #define NAME_LEN 30
+/* Extra wait after a timing notice before resyncing, covers clock drift */
+#define RESYNC_MARGIN_MS 50
+/* Intervals to look for the restarted train before waiting for PAST again */
+#define RESYNC_INTERVALS 6
+/* Intervals to look for the saved train at boot, the central may be rebooting too */
+#define RESTORE_INTERVALS 20
+/* Periodic advertising interval units of 1.25ms to milliseconds */
+#define INTERVAL_MS(interval) ((uint32_t)(interval) * 5 / 4)
+/*
+ * Radio time estimate from the windows actually received: a receive window
+ * costs ramp-up, window widening and the sync packet on top of the payload, a
+ * response its ramp-up on top of the data. Bytes take 8us at 1M PHY.
+ */
+#define RX_WINDOW_US 300
+#define TX_OVERHEAD_US 150
+#define BYTE_US 8
+#define RADIO_REPORT_S 60
 
 static K_SEM_DEFINE(sem_per_adv, 0, 1);
 static K_SEM_DEFINE(sem_per_sync, 0, 1);
@@ -28,32 +50,242 @@ static struct bt_le_per_adv_sync *default_sync;
 static struct __packed {
 	uint8_t subevent;
 	uint8_t response_slot;
-} pawr_timing;
-
-static void sync_cb(struct bt_le_per_adv_sync *sync, struct bt_le_per_adv_sync_synced_info *info)
+	uint8_t group;
+} pawr_timing = { .group = ESL_GROUP_NONE };
+
+/* Train to resync to after the central changes its interval */
+static bt_addr_le_t sync_addr;
+static uint8_t sync_sid;
+static uint16_t sync_interval;
+static uint16_t resync_interval;
+static uint8_t sync_num_subevents;
+static struct bt_le_per_adv_sync *resync_sync;
+static bool resyncing;
+/* Looking for the train saved before a reboot, see restore_sync() */
+static bool restoring;
+
+/* Subevent received besides the home one, see ESL_CMD_LISTEN */
+static uint8_t burst_subevent = ESL_SUBEVENT_NONE;
+static uint8_t burst_idle_max;
+static uint8_t burst_idle;
+/* Events in the burst subevent that carried commands for us, see esl_burst_status */
+static uint8_t burst_batches;
+/* Receive windows per kind of subevent, what listening to more of them costs */
+static uint32_t rx_home;
+static uint32_t rx_extra;
+/* Events of the train by the controller's event counter, received or not */
+static uint32_t home_events;
+static uint16_t last_event_counter;
+static bool event_counter_valid;
+
+/* Home subevent and response slot from ESL_CMD_MOVE, taken on after answering */
+static struct esl_cmd_move move;
+static bool move_pending;
+/* ESL_CMD_RELEASE received, the sync is dropped after answering */
+static bool release_pending;
+
+/* Reports off until the next ESL_CMD_PENDING hint, see sleep_handler() */
+static bool asleep;
+static uint8_t sleep_events;
+static uint32_t slept_events;
+static uint64_t radio_on_us;
+
+static void notify_sync_status(void);
+static void resync_handler(struct k_work *work);
+static void resync_timeout_handler(struct k_work *work);
+static void listen_handler(struct k_work *work);
+static void sleep_handler(struct k_work *work);
+static void wake_handler(struct k_work *work);
+static void radio_report_handler(struct k_work *work);
+static void release_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(resync_work, resync_handler);
+static K_WORK_DELAYABLE_DEFINE(resync_timeout_work, resync_timeout_handler);
+static K_WORK_DEFINE(listen_work, listen_handler);
+static K_WORK_DEFINE(sleep_work, sleep_handler);
+static K_WORK_DELAYABLE_DEFINE(wake_work, wake_handler);
+static K_WORK_DELAYABLE_DEFINE(radio_report_work, radio_report_handler);
+static K_WORK_DEFINE(release_work, release_handler);
+
+/* The home subevent, then the burst subevent if one is lent. The home
+ * subevent stays selected while asleep, see sleep_handler().
+ */
+static int set_subevents(struct bt_le_per_adv_sync *sync)
 {
 	struct bt_le_per_adv_sync_subevent_params params;
-	uint8_t subevents[1];
-	char le_addr[BT_ADDR_LE_STR_LEN];
+	uint8_t subevents[2];
 	int err;
 
-	bt_addr_le_to_str(info->addr, le_addr, sizeof(le_addr));
-	LOG_INF("Synced to %s with %d subevents", le_addr, info->num_subevents);
-
-	default_sync = sync;
-
 	params.properties = 0;
-	params.num_subevents = 1;
+	params.num_subevents = 0;
 	params.subevents = subevents;
-	subevents[0] = pawr_timing.subevent;
+
+	subevents[params.num_subevents++] = pawr_timing.subevent;
+
+	if (burst_subevent != ESL_SUBEVENT_NONE && burst_subevent != pawr_timing.subevent) {
+		subevents[params.num_subevents++] = burst_subevent;
+	}
 
 	err = bt_le_per_adv_sync_subevent(sync, &params);
 	if (err) {
 		LOG_ERR("Failed to set subevents to sync to (err %d)", err);
 	} else {
-		LOG_INF("Changed sync to subevent %d", subevents[0]);
+		LOG_INF("Changed sync to subevent %d, %d extra", subevents[0],
+			params.num_subevents - 1);
+	}
+
+	return err;
+}
+
+/* Remembers the train and our place in it across reboots */
+static void save_sync(void)
+{
+	struct sync_store store = {
+		.sid = sync_sid,
+		.interval = sync_interval,
+		.subevent = pawr_timing.subevent,
+		.response_slot = pawr_timing.response_slot,
+		.group = pawr_timing.group,
+	};
+
+	/* Timing can come before the first sync, which saves it then */
+	if (!sync_interval) {
+		return;
+	}
+
+	bt_addr_le_copy(&store.addr, &sync_addr);
+	sync_store_save(&store);
+}
+
+static void listen_handler(struct k_work *work)
+{
+	if (default_sync) {
+		(void)set_subevents(default_sync);
+	}
+}
+
+/* Nothing is queued for us until the next hint. The home subevent stays
+ * selected so the controller keeps the sync alive, but with reports off the
+ * host is not woken for it and sets no response, so nothing is sent in the
+ * response slot. Selecting no subevent at all is not an option, the
+ * controller would have nothing left to keep the sync with.
+ */
+static void sleep_handler(struct k_work *work)
+{
+	uint32_t interval_ms = INTERVAL_MS(sync_interval);
+	int err;
+
+	if (!default_sync || asleep || sleep_events < 2) {
+		return;
+	}
+
+	err = bt_le_per_adv_sync_recv_disable(default_sync);
+	if (err) {
+		LOG_WRN("Failed to stop reports (err %d)", err);
+		return;
+	}
+
+	asleep = true;
+	slept_events += sleep_events - 1;
+	/* The controller still listens in the home subevent */
+	radio_on_us += (uint64_t)(sleep_events - 1) * RX_WINDOW_US;
+
+	/* Back on half an interval before the event with the next hint */
+	k_work_reschedule(&wake_work, K_MSEC((sleep_events - 1) * interval_ms - interval_ms / 2));
+}
+
+static void wake_handler(struct k_work *work)
+{
+	int err;
+
+	if (!asleep) {
+		return;
+	}
+
+	asleep = false;
+
+	if (default_sync) {
+		err = bt_le_per_adv_sync_recv_enable(default_sync);
+		if (err) {
+			LOG_ERR("Failed to start reports again (err %d)", err);
+		}
+	}
+}
+
+static void radio_report_handler(struct k_work *work)
+{
+	static uint64_t last_us;
+	static uint32_t last_slept;
+	static uint32_t last_events;
+	static uint32_t last_rx;
+	uint32_t on_us = radio_on_us - last_us;
+	uint32_t events = home_events - last_events;
+	uint32_t rx = rx_home - last_rx;
+	/* Hundredths of a percent of the report period */
+	uint32_t duty = on_us / (RADIO_REPORT_S * 100U);
+
+	LOG_INF("Home subevent: %u of %u events received, %u missed or skipped, %u slept",
+		rx, events, events - MIN(rx, events), slept_events - last_slept);
+	LOG_INF("Radio on about %u ms in %u s (%u.%02u%%), estimated from the events received",
+		on_us / 1000, RADIO_REPORT_S, duty / 100, duty % 100);
+
+	/* High-water marks to size the pools by */
+	esl_pool_foreach(pool) {
+		struct esl_pool_stats stats;
+
+		esl_pool_get_stats(pool, &stats);
+		LOG_INF("Pool %s: %u of %u blocks of %zu B used at most, %u failed", stats.name,
+			stats.used_max, stats.blocks, stats.block_size, stats.failed);
+	}
+	LOG_INF("Display queue: %u commands dropped", ui_queue_dropped());
+
+	last_us = radio_on_us;
+	last_slept = slept_events;
+	last_events = home_events;
+	last_rx = rx_home;
+	k_work_reschedule(&radio_report_work, K_SECONDS(RADIO_REPORT_S));
+}
+
+static void sync_cb(struct bt_le_per_adv_sync *sync, struct bt_le_per_adv_sync_synced_info *info)
+{
+	char le_addr[BT_ADDR_LE_STR_LEN];
+
+	bt_addr_le_to_str(info->addr, le_addr, sizeof(le_addr));
+	LOG_INF("Synced to %s with %d subevents", le_addr, info->num_subevents);
+
+	default_sync = sync;
+	bt_addr_le_copy(&sync_addr, info->addr);
+	sync_sid = info->sid;
+	sync_interval = info->interval;
+	sync_num_subevents = info->num_subevents;
+
+	/* A new sync starts out receiving, and counts events afresh */
+	asleep = false;
+	k_work_cancel_delayable(&wake_work);
+	event_counter_valid = false;
+
+	(void)set_subevents(sync);
+	save_sync();
+
+	if (restoring) {
+		restoring = false;
+		(void)bt_le_scan_stop();
+		LOG_INF("Restored saved sync");
 	}
 
+	if (resyncing) {
+		/* Still synced as far as the main loop is concerned */
+		resyncing = false;
+		resync_sync = NULL;
+		k_work_cancel_delayable(&resync_timeout_work);
+		(void)bt_le_scan_stop();
+		LOG_INF("Resynced after interval change");
+		return;
+	}
+
+	/* Lets the central disconnect now instead of waiting out a timeout */
+	notify_sync_status();
+
 	k_sem_give(&sem_per_sync);
 }
 
@@ -68,9 +300,94 @@ static void term_cb(struct bt_le_per_adv_sync *sync,
 
 	default_sync = NULL;
 
+	/* Dropping the old train on purpose, the resync handles the rest */
+	if (!resyncing) {
+		k_sem_give(&sem_per_sync_lost);
+	}
+}
+
+static void resync_handler(struct k_work *work)
+{
+	struct bt_le_per_adv_sync_param param = { 0 };
+	int err;
+
+	resyncing = true;
+
+	if (default_sync) {
+		err = bt_le_per_adv_sync_delete(default_sync);
+		if (err) {
+			LOG_WRN("Failed to delete sync (err %d)", err);
+		}
+		default_sync = NULL;
+	}
+
+	err = bt_le_scan_start(BT_LE_SCAN_PASSIVE, NULL);
+	if (err && err != -EALREADY) {
+		LOG_ERR("Failed to start scanning for resync (err %d)", err);
+		goto fail;
+	}
+
+	bt_addr_le_copy(&param.addr, &sync_addr);
+	param.sid = sync_sid;
+	param.skip = 0;
+	/* Sync timeout in 10ms units, six of the new intervals */
+	param.timeout = CLAMP(INTERVAL_MS(resync_interval) * 6 / 10, BT_GAP_PER_ADV_MIN_TIMEOUT,
+			      BT_GAP_PER_ADV_MAX_TIMEOUT);
+
+	err = bt_le_per_adv_sync_create(&param, &resync_sync);
+	if (err) {
+		LOG_ERR("Failed to create resync (err %d)", err);
+		(void)bt_le_scan_stop();
+		goto fail;
+	}
+
+	LOG_INF("Resyncing to interval %u", resync_interval);
+	k_work_reschedule(&resync_timeout_work,
+			  K_MSEC(RESYNC_INTERVALS * INTERVAL_MS(resync_interval)));
+	return;
+
+fail:
+	resyncing = false;
 	k_sem_give(&sem_per_sync_lost);
 }
 
+static void resync_timeout_handler(struct k_work *work)
+{
+	if (!resyncing) {
+		return;
+	}
+
+	LOG_WRN("Train not found after interval change");
+
+	if (resync_sync) {
+		(void)bt_le_per_adv_sync_delete(resync_sync);
+		resync_sync = NULL;
+	}
+	(void)bt_le_scan_stop();
+
+	/* Back to connectable advertising so the central onboards us again */
+	resyncing = false;
+	k_sem_give(&sem_per_sync_lost);
+}
+
+static void release_handler(struct k_work *work)
+{
+	int err;
+
+	LOG_INF("Released by the central, advertising again");
+
+	/* Not coming back to this train after a reboot either */
+	sync_store_clear();
+
+	/* Ends in term_cb, which sends the main loop back to advertising */
+	if (default_sync) {
+		err = bt_le_per_adv_sync_delete(default_sync);
+		if (err) {
+			LOG_WRN("Failed to delete sync (err %d)", err);
+		}
+	}
+}
+
 static bool print_ad_field(struct bt_data *data, void *user_data)
 {
 	ARG_UNUSED(user_data);
@@ -90,49 +407,301 @@ int bt_le_per_adv_set_response_data(struct bt_le_per_adv_sync *per_adv_sync,
 
 static struct bt_le_per_adv_response_params rsp_params;
 
-NET_BUF_SIMPLE_DEFINE_STATIC(rsp_buf, 512);
+/* Keeps the burst status record in the response current */
+static void burst_publish(void)
+{
+	struct esl_burst_status status = {
+		.subevent = burst_subevent,
+		.batches = burst_batches,
+	};
+
+	response_set_burst(burst_subevent != ESL_SUBEVENT_NONE ? &status : NULL);
+}
+
+static void handle_timing(const struct esl_cmd *cmd)
+{
+	struct esl_cmd_timing timing;
+	uint32_t delay_ms;
+
+	if (cmd->len < sizeof(timing)) {
+		return;
+	}
+
+	memcpy(&timing, cmd->data, sizeof(timing));
+	resync_interval = sys_le16_to_cpu(timing.interval);
+
+	/* The central switches one interval after the last notice, every copy
+	 * lands on about the same time so later ones just refine it.
+	 */
+	delay_ms = (timing.countdown + 1) * INTERVAL_MS(sync_interval) + RESYNC_MARGIN_MS;
+	k_work_reschedule(&resync_work, K_MSEC(delay_ms));
+}
+
+static void handle_set_group(const struct esl_cmd *cmd)
+{
+	const struct esl_cmd_set_group *set = (const void *)cmd->data;
+
+	if (cmd->len < sizeof(*set) ||
+	    (set->group >= ESL_GROUP_COUNT && set->group != ESL_GROUP_NONE)) {
+		return;
+	}
+
+	pawr_timing.group = set->group;
+	LOG_INF("Moved to group %d", set->group);
+	save_sync();
+}
+
+static void handle_listen(const struct esl_cmd *cmd)
+{
+	struct esl_cmd_listen listen;
+
+	if (cmd->len < sizeof(listen)) {
+		return;
+	}
+
+	memcpy(&listen, cmd->data, sizeof(listen));
+	if ((listen.subevent >= sync_num_subevents && listen.subevent != ESL_SUBEVENT_NONE) ||
+	    listen.idle_events == 0) {
+		return;
+	}
+
+	burst_idle = 0;
+	burst_idle_max = listen.idle_events;
+	burst_batches = 0;
+	/* Resent until acknowledged, only the first copy changes anything */
+	if (listen.subevent == burst_subevent) {
+		return;
+	}
+	burst_subevent = listen.subevent;
+	burst_publish();
+
+	LOG_INF("Burst subevent %d (%u home, %u extra receive windows so far)", burst_subevent,
+		rx_home, rx_extra);
+
+	/* Not from the receive callback, it runs in the Bluetooth RX thread */
+	k_work_submit(&listen_work);
+}
+
+static void handle_pending(const struct esl_cmd *cmd)
+{
+	struct esl_cmd_pending hint;
+
+	if (cmd->len < sizeof(hint)) {
+		return;
+	}
+
+	memcpy(&hint, cmd->data, sizeof(hint));
 
-extern struct zbus_channel sensor_chan;
+	/* The hint does not cover the burst subevent */
+	if ((sys_le16_to_cpu(hint.slots) & BIT(pawr_timing.response_slot)) ||
+	    burst_subevent != ESL_SUBEVENT_NONE) {
+		return;
+	}
+
+	sleep_events = hint.events;
+	k_work_submit(&sleep_work);
+}
+
+static void handle_move(const struct esl_cmd *cmd)
+{
+	if (cmd->len < sizeof(move)) {
+		return;
+	}
+
+	memcpy(&move, cmd->data, sizeof(move));
+	move_pending = move.subevent < sync_num_subevents &&
+		       move.response_slot < ESL_ADDR_GROUP_BASE;
+}
+
+/* Done after the response to the event that carried ESL_CMD_MOVE, which the
+ * central expects in the old slot.
+ */
+static void apply_move(void)
+{
+	move_pending = false;
+
+	if (move.subevent == pawr_timing.subevent &&
+	    move.response_slot == pawr_timing.response_slot) {
+		return;
+	}
+
+	LOG_INF("Moved from subevent %d slot %d to subevent %d slot %d", pawr_timing.subevent,
+		pawr_timing.response_slot, move.subevent, move.response_slot);
+
+	pawr_timing.subevent = move.subevent;
+	pawr_timing.response_slot = move.response_slot;
+	save_sync();
+	k_work_submit(&listen_work);
+}
+
+/* Tracks whether the burst subevent still carries anything for us */
+static void burst_track(uint8_t subevent, bool used)
+{
+	if (subevent != burst_subevent) {
+		return;
+	}
+
+	if (used) {
+		burst_idle = 0;
+		burst_batches++;
+		burst_publish();
+		return;
+	}
+
+	if (++burst_idle >= burst_idle_max) {
+		LOG_INF("Burst subevent %d idle, %u extra receive windows so far", burst_subevent,
+			rx_extra);
+		burst_subevent = ESL_SUBEVENT_NONE;
+		burst_publish();
+		k_work_submit(&listen_work);
+	}
+}
+
+/* Passed to handle_cmd() for one received subevent */
+struct rx_ctx {
+	uint8_t subevent;
+	uint8_t count;
+	/* Some of the commands were sent to ESL_ADDR_BURST */
+	bool burst;
+};
+
+static bool addressed_to_us(uint8_t addr, uint8_t subevent)
+{
+	if (addr == ESL_ADDR_BROADCAST ||
+	    (pawr_timing.group != ESL_GROUP_NONE && addr == ESL_ADDR_GROUP(pawr_timing.group))) {
+		return true;
+	}
+
+	/* Response slots belong to the tags of the subevent they are sent in */
+	if (subevent == pawr_timing.subevent) {
+		return addr == pawr_timing.response_slot;
+	}
+
+	return subevent == burst_subevent && addr == ESL_ADDR_BURST;
+}
+
+static bool handle_cmd(const struct esl_cmd *cmd, void *user_data)
+{
+	struct rx_ctx *ctx = user_data;
+
+	if (!addressed_to_us(cmd->addr, ctx->subevent)) {
+		return true;
+	}
+
+	ctx->count++;
+	if (cmd->addr == ESL_ADDR_BURST) {
+		ctx->burst = true;
+	}
+	LOG_DBG("Command 0x%02X (%d bytes)", cmd->type, cmd->len);
+
+	switch (cmd->type) {
+	case ESL_CMD_TIMING:
+		handle_timing(cmd);
+		break;
+	case ESL_CMD_IMG_START:
+		image_transfer_start(cmd->data, cmd->len);
+		response_update();
+		break;
+	case ESL_CMD_IMG_CHUNK:
+		image_transfer_chunk(cmd->data, cmd->len);
+		response_update();
+		break;
+	case ESL_CMD_RECT:
+		rect_update_handle(cmd->data, cmd->len);
+		break;
+	case ESL_CMD_SET_GROUP:
+		handle_set_group(cmd);
+		break;
+	case ESL_CMD_LISTEN:
+		handle_listen(cmd);
+		break;
+	case ESL_CMD_PENDING:
+		/* Only about the tags of the subevent it is sent in */
+		if (ctx->subevent == pawr_timing.subevent) {
+			handle_pending(cmd);
+		}
+		break;
+	case ESL_CMD_MOVE:
+		/* Response slots only mean something in the home subevent */
+		if (ctx->subevent == pawr_timing.subevent) {
+			handle_move(cmd);
+		}
+		break;
+	case ESL_CMD_RELEASE:
+		/* Only ever meant for one tag, never for a group */
+		if (ctx->subevent == pawr_timing.subevent && cmd->addr == pawr_timing.response_slot) {
+			release_pending = true;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return true;
+}
 
 static void recv_cb(struct bt_le_per_adv_sync *sync,
-            const struct bt_le_per_adv_sync_recv_info *info, struct net_buf_simple *buf)
+		    const struct bt_le_per_adv_sync_recv_info *info, struct net_buf_simple *buf)
 {
-    int err = 0;
-    struct esl_sensor_reading sensor_reading = {0};
-
-    err = zbus_chan_read(&sensor_chan, &sensor_reading, K_NO_WAIT);
-    if (err == 0) {
-        LOG_INF("Zbus chan read: %.2f %.2f", sensor_reading.temperature, sensor_reading.humidity);
-        
-        /* Prepare response buffer with properly formatted advertising data */
-        net_buf_simple_reset(&rsp_buf);
-        
-        /* Add sensor data as manufacturer specific data */
-        net_buf_simple_add_u8(&rsp_buf, sizeof(struct esl_sensor_reading) + 1); // Length
-        net_buf_simple_add_u8(&rsp_buf, BT_DATA_MANUFACTURER_DATA);  // AD type
-        net_buf_simple_add_mem(&rsp_buf, &sensor_reading, sizeof(struct esl_sensor_reading));
-
-        /* Set up response parameters */
-        rsp_params.request_event = info->periodic_event_counter;
-        rsp_params.request_subevent = info->subevent;
-        rsp_params.response_subevent = info->subevent;
-        rsp_params.response_slot = pawr_timing.response_slot;
-
-        LOG_INF("Sending sensor data: temp=%.2f, humidity=%.2f in subevent %d, slot %d", 
-                sensor_reading.temperature, 
-                sensor_reading.humidity,
-                info->subevent,
-                pawr_timing.response_slot);
-
-        err = bt_le_per_adv_set_response_data(sync, &rsp_params, &rsp_buf);
-        if (err) {
-            LOG_ERR("Failed to send response (err %d)", err);
-        }
-    } else if (buf) {
-        LOG_INF("Received empty indication: subevent %d", info->subevent);
-    } else {
-        LOG_ERR("Failed to receive indication: subevent %d", info->subevent);
-    }
+	int err = 0;
+	struct rx_ctx ctx = { .subevent = info->subevent };
+	const struct net_buf_simple *rsp;
+
+	radio_on_us += RX_WINDOW_US + (buf ? buf->len * BYTE_US : 0);
+
+	/* Commands for every slot in the subevent share one payload, pick out ours */
+	if (buf && buf->len) {
+		err = esl_frame_parse(buf, handle_cmd, &ctx);
+		if (err < 0) {
+			LOG_WRN("Malformed payload in subevent %d (err %d)", info->subevent, err);
+		} else if (ctx.count) {
+			LOG_DBG("%d commands in subevent %d", ctx.count, info->subevent);
+		}
+	}
+
+	if (info->subevent != pawr_timing.subevent) {
+		/* No response slot here, the home subevent answers for it */
+		rx_extra++;
+		burst_track(info->subevent, ctx.burst);
+		return;
+	}
+
+	rx_home++;
+
+	/* The counter moves on for events the controller did not receive too */
+	home_events += event_counter_valid ?
+		       (uint16_t)(info->periodic_event_counter - last_event_counter) : 1;
+	last_event_counter = info->periodic_event_counter;
+	event_counter_valid = true;
+
+	/* Encoded ahead of time, see response.h. Answering is all that is left
+	 * before the response slot comes up.
+	 */
+	rsp = response_get();
+	if (!rsp) {
+		response_update();
+	} else {
+		rsp_params.request_event = info->periodic_event_counter;
+		rsp_params.request_subevent = info->subevent;
+		rsp_params.response_subevent = info->subevent;
+		rsp_params.response_slot = pawr_timing.response_slot;
+
+		err = bt_le_per_adv_set_response_data(sync, &rsp_params, rsp);
+		if (err) {
+			LOG_ERR("Failed to send response (err %d)", err);
+		} else {
+			radio_on_us += TX_OVERHEAD_US + rsp->len * BYTE_US;
+		}
+	}
+
+	if (move_pending) {
+		apply_move();
+	}
+
+	if (release_pending) {
+		release_pending = false;
+		k_work_submit(&release_work);
+	}
 }
 
 static struct bt_le_per_adv_sync_cb sync_callbacks = {
@@ -153,31 +722,24 @@ static ssize_t write_timing(struct bt_conn *conn, const struct bt_gatt_attr *att
 		return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
 	}
 
-	if (len != sizeof(pawr_timing)) {
+	/* Centrals that predate groups leave the group out */
+	if (len != sizeof(pawr_timing) && len != offsetof(typeof(pawr_timing), group)) {
 		return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
 	}
 
+	pawr_timing.group = ESL_GROUP_NONE;
 	memcpy(&pawr_timing, buf, len);
 
-	LOG_INF("New timing: subevent %d, response slot %d", pawr_timing.subevent,
-	       pawr_timing.response_slot);
-
-	struct bt_le_per_adv_sync_subevent_params params;
-	uint8_t subevents[1];
-	int err;
+	LOG_INF("New timing: subevent %d, response slot %d, group %d", pawr_timing.subevent,
+	       pawr_timing.response_slot, pawr_timing.group);
 
-	params.properties = 0;
-	params.num_subevents = 1;
-	params.subevents = subevents;
-	subevents[0] = pawr_timing.subevent;
+	/* Onboarded afresh, the central knows of no burst subevent */
+	burst_subevent = ESL_SUBEVENT_NONE;
+	burst_publish();
 
 	if (default_sync) {
-		err = bt_le_per_adv_sync_subevent(default_sync, &params);
-		if (err) {
-			LOG_ERR("Failed to set subevents to sync to (err %d)", err);
-		} else {
-			LOG_INF("Changed sync to subevent %d", subevents[0]);
-		}
+		(void)set_subevents(default_sync);
+		save_sync();
 	} else {
 		LOG_INF("Not synced yet");
 	}
@@ -185,12 +747,43 @@ static ssize_t write_timing(struct bt_conn *conn, const struct bt_gatt_attr *att
 	return len;
 }
 
+static bool sync_notify_enabled;
+
+static void sync_ccc_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+	sync_notify_enabled = (value == BT_GATT_CCC_NOTIFY);
+
+	/* Sync may have been established before the central subscribed */
+	notify_sync_status();
+}
+
 BT_GATT_SERVICE_DEFINE(pawr_svc, BT_GATT_PRIMARY_SERVICE(&pawr_svc_uuid.uuid),
-		       BT_GATT_CHARACTERISTIC(&pawr_char_uuid.uuid, BT_GATT_CHRC_WRITE,
+		       BT_GATT_CHARACTERISTIC(&pawr_char_uuid.uuid,
+					      BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
 					      BT_GATT_PERM_WRITE, NULL, write_timing,
 					      &pawr_timing),
+		       BT_GATT_CCC(sync_ccc_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
 );
 
+static void notify_sync_status(void)
+{
+	struct esl_sync_status status;
+	int err;
+
+	if (!default_conn || !default_sync || !sync_notify_enabled) {
+		return;
+	}
+
+	status.synced = 1;
+	status.subevent = pawr_timing.subevent;
+	status.response_slot = pawr_timing.response_slot;
+
+	err = bt_gatt_notify(default_conn, &pawr_svc.attrs[2], &status, sizeof(status));
+	if (err) {
+		LOG_ERR("Failed to notify sync status (err %d)", err);
+	}
+}
+
 void connected(struct bt_conn *conn, uint8_t err)
 {
 	LOG_INF("Connected, err 0x%02X %s", err, bt_hci_err_to_str(err));
@@ -208,6 +801,7 @@ void disconnected(struct bt_conn *conn, uint8_t reason)
 {
 	bt_conn_unref(default_conn);
 	default_conn = NULL;
+	sync_notify_enabled = false;
 
 	LOG_INF("Disconnected, reason 0x%02X %s", reason, bt_hci_err_to_str(reason));
 }
@@ -217,13 +811,89 @@ BT_CONN_CB_DEFINE(conn_cb) = {
 	.disconnected = disconnected,
 };
 
+/*
+ * Syncs to the train saved before a reboot by scanning for it, without
+ * waiting for the central to connect and send PAST. Returns true once
+ * synced; otherwise the record is dropped and the tag gets onboarded again.
+ */
+static bool restore_sync(void)
+{
+	struct bt_le_per_adv_sync_param param = { 0 };
+	struct bt_le_per_adv_sync *sync;
+	struct sync_store store;
+	char le_addr[BT_ADDR_LE_STR_LEN];
+	int err;
+
+	err = sync_store_load(&store);
+	if (err) {
+		return false;
+	}
+
+	bt_addr_le_copy(&sync_addr, &store.addr);
+	sync_sid = store.sid;
+	sync_interval = store.interval;
+	pawr_timing.subevent = store.subevent;
+	pawr_timing.response_slot = store.response_slot;
+	pawr_timing.group = store.group;
+
+	bt_addr_le_to_str(&sync_addr, le_addr, sizeof(le_addr));
+	LOG_INF("Restoring sync to %s, subevent %d, response slot %d, group %d", le_addr,
+		pawr_timing.subevent, pawr_timing.response_slot, pawr_timing.group);
+
+	err = bt_le_scan_start(BT_LE_SCAN_PASSIVE, NULL);
+	if (err && err != -EALREADY) {
+		LOG_ERR("Failed to start scanning for saved sync (err %d)", err);
+		return false;
+	}
+
+	bt_addr_le_copy(&param.addr, &sync_addr);
+	param.sid = sync_sid;
+	param.skip = 0;
+	param.timeout = CLAMP(INTERVAL_MS(sync_interval) * 6 / 10, BT_GAP_PER_ADV_MIN_TIMEOUT,
+			      BT_GAP_PER_ADV_MAX_TIMEOUT);
+
+	restoring = true;
+	err = bt_le_per_adv_sync_create(&param, &sync);
+	if (err) {
+		LOG_ERR("Failed to create sync (err %d)", err);
+		restoring = false;
+		(void)bt_le_scan_stop();
+		return false;
+	}
+
+	if (!k_sem_take(&sem_per_sync, K_MSEC(RESTORE_INTERVALS * INTERVAL_MS(sync_interval)))) {
+		return true;
+	}
+
+	LOG_WRN("Saved train not found, waiting for onboarding");
+
+	/* Also ends a sync that got established just now */
+	(void)bt_le_per_adv_sync_delete(sync);
+	(void)bt_le_scan_stop();
+	restoring = false;
+	default_sync = NULL;
+	k_sem_reset(&sem_per_sync);
+
+	/* Most likely the central restarted and gave our slot away */
+	sync_store_clear();
+
+	return false;
+}
+
+static const struct esl_adv_info adv_info = {
+	.company_id = sys_cpu_to_le16(ESL_COMPANY_ID),
+	.fw_version = sys_cpu_to_le16(ESL_FW_VERSION),
+};
+
 static const struct bt_data ad[] = {
 	BT_DATA(BT_DATA_NAME_COMPLETE, CONFIG_BT_DEVICE_NAME, sizeof(CONFIG_BT_DEVICE_NAME) - 1),
+	BT_DATA(BT_DATA_MANUFACTURER_DATA, &adv_info, sizeof(adv_info)),
 };
 
 int main(void)
 {
 	struct bt_le_per_adv_sync_transfer_param past_param;
+	bool synced;
 	int err;
 
 	LOG_INF("Starting Periodic Advertising with Responses Synchronization Demo");
@@ -247,25 +917,34 @@ int main(void)
 		return 0;
 	}
 
-	do {
-		err = bt_le_adv_start(
-			BT_LE_ADV_PARAM(BT_LE_ADV_OPT_ONE_TIME | BT_LE_ADV_OPT_CONNECTABLE,
-					BT_GAP_ADV_FAST_INT_MIN_2, BT_GAP_ADV_FAST_INT_MAX_2, NULL),
-			ad, ARRAY_SIZE(ad), NULL, 0);
-		if (err && err != -EALREADY) {
-			LOG_ERR("Advertising failed to start (err %d)", err);
-			bt_le_adv_stop();
-			k_msleep(1000);
-		}
+	k_work_schedule(&radio_report_work, K_SECONDS(RADIO_REPORT_S));
 
-		LOG_INF("Waiting for periodic sync...");
-		err = k_sem_take(&sem_per_sync, K_FOREVER);
-		if (err) {
-			LOG_ERR("Timed out while synchronizing");
+	synced = restore_sync();
 
-			continue;
+	do {
+		/* Restored at boot, nothing to wait for the first time round */
+		if (!synced) {
+			err = bt_le_adv_start(
+				BT_LE_ADV_PARAM(BT_LE_ADV_OPT_ONE_TIME | BT_LE_ADV_OPT_CONNECTABLE,
+						BT_GAP_ADV_FAST_INT_MIN_2, BT_GAP_ADV_FAST_INT_MAX_2,
+						NULL),
+				ad, ARRAY_SIZE(ad), NULL, 0);
+			if (err && err != -EALREADY) {
+				LOG_ERR("Advertising failed to start (err %d)", err);
+				bt_le_adv_stop();
+				k_msleep(1000);
+			}
+
+			LOG_INF("Waiting for periodic sync...");
+			err = k_sem_take(&sem_per_sync, K_FOREVER);
+			if (err) {
+				LOG_ERR("Timed out while synchronizing");
+
+				continue;
+			}
 		}
 
+		synced = false;
 		LOG_INF("Periodic sync established.");
 
 		err = k_sem_take(&sem_per_sync_lost, K_FOREVER);
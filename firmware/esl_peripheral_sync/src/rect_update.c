@@ -0,0 +1,43 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(rect_update, LOG_LEVEL_INF);
+
+#include "rect_update.h"
+#include "ui_queue.h"
+
+void rect_update_handle(const uint8_t *data, uint8_t len)
+{
+	struct ui_cmd *cmd;
+	struct rect_update *update;
+	const struct esl_cmd_rect *area;
+
+	if (len < sizeof(update->area)) {
+		return;
+	}
+
+	cmd = ui_queue_acquire();
+	if (!cmd) {
+		LOG_WRN("Display queue full, dropped area");
+		return;
+	}
+
+	update = &cmd->rect;
+	area = &update->area;
+	memcpy(&update->area, data, sizeof(update->area));
+	update->len = len - sizeof(update->area);
+
+	if (area->width == 0 || area->height == 0 ||
+	    area->x + area->width > ESL_IMG_WIDTH || area->y + area->height > ESL_IMG_HEIGHT ||
+	    area->y % ESL_RECT_ALIGN || area->height % ESL_RECT_ALIGN ||
+	    update->len != DIV_ROUND_UP(area->width, 8) * area->height) {
+		LOG_WRN("Rejected %dx%d area at (%d, %d) with %d bytes", area->width, area->height,
+			area->x, area->y, update->len);
+		return;
+	}
+
+	memcpy(update->pixels, data + sizeof(update->area), update->len);
+
+	cmd->type = UI_CMD_RECT;
+	ui_queue_produce();
+}
@@ -0,0 +1,109 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/zbus/zbus.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(response, LOG_LEVEL_INF);
+
+#include "response.h"
+#include "image_transfer.h"
+#include "esl_packets.h"
+#include "esl_pool.h"
+
+extern struct zbus_channel sensor_chan;
+
+/*
+ * One buffer is handed to the controller from recv_cb, the other is rebuilt
+ * and then swapped in. recv_cb and the system workqueue both run in
+ * cooperative threads, so a rebuild never lands on the buffer recv_cb holds.
+ * Each takes its block on its first build and keeps it.
+ */
+ESL_POOL_DEFINE(response_pool, ESL_RSP_MAX_LEN, 2);
+static struct net_buf_simple rsp_a;
+static struct net_buf_simple rsp_b;
+static atomic_ptr_t front;
+
+static struct k_spinlock lock;
+static struct esl_sensor_reading reading;
+static struct esl_burst_status burst;
+static bool burst_valid;
+
+static void build_handler(struct k_work *work);
+
+static K_WORK_DEFINE(build_work, build_handler);
+
+static void build_handler(struct k_work *work)
+{
+	struct net_buf_simple *back = atomic_ptr_get(&front) == &rsp_a ? &rsp_b : &rsp_a;
+	struct esl_sensor_reading sensor;
+	struct esl_burst_status status;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool with_burst = burst_valid;
+
+	sensor = reading;
+	status = burst;
+	k_spin_unlock(&lock, key);
+
+	if (!back->__buf && esl_pool_buf_alloc(&response_pool, back)) {
+		LOG_ERR("No response buffer");
+		return;
+	}
+
+	net_buf_simple_reset(back);
+
+	net_buf_simple_add_u8(back, sizeof(sensor) + 1);
+	net_buf_simple_add_u8(back, BT_DATA_MANUFACTURER_DATA);
+	net_buf_simple_add_mem(back, &sensor, sizeof(sensor));
+
+	/* Lets the central resend only the chunks that were lost. Chunks keep
+	 * arriving meanwhile, a record that misses one is redone for the next
+	 * event.
+	 */
+	image_transfer_add_status(back);
+
+	if (with_burst) {
+		(void)esl_rsp_add(back, ESL_RSP_BURST, &status, sizeof(status));
+	}
+
+	atomic_ptr_set(&front, back);
+}
+
+const struct net_buf_simple *response_get(void)
+{
+	return atomic_ptr_get(&front);
+}
+
+void response_update(void)
+{
+	k_work_submit(&build_work);
+}
+
+void response_set_burst(const struct esl_burst_status *status)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	burst_valid = (status != NULL);
+	if (status) {
+		burst = *status;
+	}
+
+	k_spin_unlock(&lock, key);
+
+	response_update();
+}
+
+/* Runs in the publisher's context, the sensor work item */
+static void sensor_callback(const struct zbus_channel *chan)
+{
+	const struct esl_sensor_reading *msg = zbus_chan_const_msg(chan);
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	reading = *msg;
+	k_spin_unlock(&lock, key);
+
+	response_update();
+}
+
+ZBUS_LISTENER_DEFINE(response_sensor_listener, sensor_callback);
+ZBUS_CHAN_ADD_OBS(sensor_chan, response_sensor_listener, 0);
@@ -71,6 +71,10 @@ void handle_config(void) {
     lv_obj_set_style_bg_opa(config_roller, LV_OPA_COVER, LV_PART_SELECTED);
     lv_obj_set_style_text_color(config_roller, lv_color_white(), LV_PART_SELECTED);
 
+    // Every frame of a scroll would be a panel refresh, only to be
+    // overwritten by the next one
+    lv_obj_set_style_anim_time(config_roller, 0, 0);
+
     lv_obj_center(config_roller);
 	
 	ui_manager_set_buttons(buttons, sizeof(buttons)/sizeof(button_config_t));
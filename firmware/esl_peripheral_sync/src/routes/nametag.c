@@ -4,6 +4,8 @@
 LOG_MODULE_REGISTER(nametag, LOG_LEVEL_INF);
 
 #include "images.h"
+#include "image_transfer.h"
+#include "esl_packets.h"
 #include "ui_manager.h"
 #include "display_manager.h"
 
@@ -90,6 +92,30 @@ static button_config_t buttons[] = {
 static const size_t NUM_NAMETAGS = sizeof(nametags) / sizeof(nametags[0]);
 static uint8_t current_nametag_index = 0;
 
+/* Image sent over the air, shown instead of the built-in one */
+static lv_img_dsc_t received_image = {
+    .header.cf = LV_IMG_CF_INDEXED_1BIT,
+    .header.w = ESL_IMG_WIDTH,
+    .header.h = ESL_IMG_HEIGHT,
+};
+
+static const lv_img_dsc_t *nametag_image(const nametag_data_t *nametag) {
+    size_t size;
+    const uint8_t *map = image_transfer_get(&size);
+
+    if (!map) {
+        return nametag->image;
+    }
+
+    received_image.data = map;
+    received_image.data_size = size;
+
+    /* The two frames take turns, drop what LVGL cached of the last one */
+    lv_img_cache_invalidate_src(&received_image);
+
+    return &received_image;
+}
+
 static void update_main_content(const nametag_data_t *nametag) {
     lv_obj_t *main_content = ui_manager_get_main();
     ui_manager_clear_main();
@@ -98,7 +124,7 @@ static void update_main_content(const nametag_data_t *nametag) {
     lv_obj_t *image = lv_img_create(main_content);
     lv_obj_set_size(image, X_RESOLUTION, CONTENT_HEIGHT);
     lv_obj_center(image);
-    lv_img_set_src(image, nametag->image);
+    lv_img_set_src(image, nametag_image(nametag));
 
     // Create floating container with black background
     static lv_style_t style_container;
@@ -136,10 +162,11 @@ static void update_main_content(const nametag_data_t *nametag) {
     lv_label_set_text(location_label, nametag->location);
     lv_obj_align_to(location_label, name_label, LV_ALIGN_OUT_BOTTOM_LEFT, 0, 0);
 
-    display_manager_full_update();
-
 	ui_manager_set_buttons(buttons, sizeof(buttons)/sizeof(button_config_t));
 	ui_manager_show_bottom_bar(false);
+
+    // One refresh once the bar is set up too, not one before and one after
+    display_manager_full_update();
 }
 
 void nametag_display_show(uint8_t index) {
@@ -150,6 +177,10 @@ void nametag_display_show(uint8_t index) {
     update_main_content(&nametags[current_nametag_index]);
 }
 
+void nametag_display_refresh(void) {
+    update_main_content(&nametags[current_nametag_index]);
+}
+
 void nametag_display_next(void) {
     current_nametag_index = (current_nametag_index + 1) % NUM_NAMETAGS;
     update_main_content(&nametags[current_nametag_index]);
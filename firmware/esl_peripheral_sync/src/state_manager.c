@@ -2,6 +2,7 @@
 #include <zephyr/device.h>
 #include <zephyr/smf.h>
 #include <zephyr/input/input.h>
+#include <zephyr/zbus/zbus.h>
 #include <lvgl.h>
 #include <zephyr/logging/log.h>
 
@@ -13,12 +14,20 @@ LOG_MODULE_REGISTER(state_manager, LOG_LEVEL_INF);
 #include "ui_manager.h"
 #include "nametag.h"
 #include "routes.h"
+#include "image_transfer.h"
+#include "ui_queue.h"
 
 static const struct device *const buttons_dev = DEVICE_DT_GET(DT_NODELABEL(buttons));
 
 // Global state machine context
 static struct epd_sm_data sm_data;
 
+// LVGL's input device gets the keys on its own callback, it is run for this
+// long after a key whether or not it has anything to draw yet
+#define INPUT_SETTLE_MS 200
+
+#define WAKEUP_REPORT_MS (60 * 60 * MSEC_PER_SEC)
+
 // Forward declarations for state handlers
 static void boot_entry(void *o);
 static void boot_run(void *o);
@@ -85,8 +94,16 @@ static void config_entry(void *o) {
 
 static void config_run(void *o) {
     struct epd_sm_data *sm = (struct epd_sm_data *)o;
+    int64_t now = k_uptime_get();
+
+	if (sm->events & (EVENT_KEYS | EVENT_KEY_UP)) {
+		sm->input_until = now + INPUT_SETTLE_MS;
+	}
 
-	display_manager_partial_update();
+	sm->lvgl_next_ms = display_manager_partial_update();
+	if (sm->lvgl_next_ms == LV_NO_TIMER_READY && now < sm->input_until) {
+		sm->lvgl_next_ms = MIN(LV_DISP_DEF_REFR_PERIOD, sm->input_until - now);
+	}
 
 	if (sm->events & EVENT_KEY_0) {
 		smf_set_state(SMF_CTX(&sm->ctx), &display_states[MOSAIC_STATE]);
@@ -110,12 +127,49 @@ static void name_tag_entry(void *o) {
 	ui_manager_show_bottom_bar(false);
 	nametag_display_show(config_get_selected());
 
+	// The full redraw supersedes any area received before it
+	ui_queue_purge();
+
 	display_manager_suspend();
 }
 
 static void name_tag_run(void *o) {
     struct epd_sm_data *sm = (struct epd_sm_data *)o;
 
+    if (sm->events & EVENT_IMAGE_READY) {
+        LOG_INF("Showing received image");
+        nametag_display_refresh();
+        sm->events &= ~EVENT_IMAGE_READY;
+    }
+
+    if (sm->events & EVENT_DOWNLINK) {
+        struct ui_cmd *cmd;
+
+        // All queued areas under one resume
+        if (display_manager_begin()) {
+            ui_queue_purge();
+        } else {
+            while ((cmd = ui_queue_consume()) != NULL) {
+                int err = 0;
+
+                switch (cmd->type) {
+                case UI_CMD_RECT:
+                    err = display_manager_write_rect(&cmd->rect);
+                    break;
+                default:
+                    break;
+                }
+
+                if (err) {
+                    LOG_ERR("Failed to run display command %d: %d", cmd->type, err);
+                }
+                ui_queue_release();
+            }
+            display_manager_end();
+        }
+        sm->events &= ~EVENT_DOWNLINK;
+    }
+
 	if (ui_manager_is_bottom_bar_visible()) {
 		if (sm->events & EVENT_KEY_0) {
 			smf_set_state(SMF_CTX(&sm->ctx), &display_states[MOSAIC_STATE]);
@@ -125,12 +179,11 @@ static void name_tag_run(void *o) {
 			smf_set_state(SMF_CTX(&sm->ctx), &display_states[DIAGNOSTICS_STATE]);
 		} else if (sm->events & EVENT_KEY_3) {
 			LOG_INF("Canceled");
-			display_manager_resume();
 			ui_manager_show_bottom_bar(false);
 			display_manager_full_update();
 			display_manager_suspend();
 		}
-	} else if (sm->events != 0 ) {
+	} else if (sm->events & EVENT_KEYS) {
 		LOG_INF("Button press event raised");
 		display_manager_resume();
 		ui_manager_show_bottom_bar(true);
@@ -168,7 +221,9 @@ static void mosaic_exit(void *o) {
 // Button callback
 static void buttons_callback(struct input_event *evt, void *user_data) {
     ARG_UNUSED(user_data);
-    if (evt->type == INPUT_EV_KEY && evt->value == 1) {
+    if (evt->type == INPUT_EV_KEY && evt->value == 0) {
+        k_event_post(&sm_data.smf_event, EVENT_KEY_UP);
+    } else if (evt->type == INPUT_EV_KEY && evt->value == 1) {
         switch (evt->code) {
             case INPUT_KEY_0:
                 LOG_INF("Button 0 pressed, posting EVENT_KEY_0");
@@ -195,6 +250,27 @@ static void buttons_callback(struct input_event *evt, void *user_data) {
 
 INPUT_CALLBACK_DEFINE(buttons_dev, buttons_callback, NULL);
 
+// Runs in the Bluetooth RX thread, the redraw happens in the state machine
+static void image_ready_callback(const struct zbus_channel *chan) {
+    k_event_post(&sm_data.smf_event, EVENT_IMAGE_READY);
+}
+
+ZBUS_LISTENER_DEFINE(image_ready_listener, image_ready_callback);
+ZBUS_CHAN_ADD_OBS(image_chan, image_ready_listener, 0);
+
+static void count_wakeup(struct epd_sm_data *sm) {
+    int64_t now = k_uptime_get();
+
+    sm->wakeups++;
+    if (now - sm->wakeups_since >= WAKEUP_REPORT_MS) {
+        uint32_t per_hour = (int64_t)sm->wakeups * WAKEUP_REPORT_MS / (now - sm->wakeups_since);
+
+        LOG_INF("Woke up %u times per hour", per_hour);
+        sm->wakeups = 0;
+        sm->wakeups_since = now;
+    }
+}
+
 // State machine thread
 static void state_manager_thread(void *p1, void *p2, void *p3) {
     ARG_UNUSED(p1);
@@ -207,27 +283,40 @@ static void state_manager_thread(void *p1, void *p2, void *p3) {
     }
 
     k_event_init(&sm_data.smf_event);
+    ui_queue_attach(&sm_data.smf_event, EVENT_DOWNLINK);
     k_timer_init(&sm_data.boot_timer, boot_timer_expired, NULL);
     
     smf_set_initial(SMF_CTX(&sm_data.ctx), &display_states[BOOT_STATE]);
     sm_data.current_state = BOOT_STATE;
 
     sm_data.events = 0;
+    sm_data.lvgl_next_ms = LV_NO_TIMER_READY;
+    sm_data.wakeups_since = k_uptime_get();
 
     if (smf_run_state(SMF_CTX(&sm_data.ctx))) {
         LOG_ERR("Initial state machine run failed");
     }
 
+    // Nothing polls: the thread only wakes up for an event or when LVGL,
+    // as last run by the state, has something to do
     while (1) {
+        k_timeout_t timeout = sm_data.lvgl_next_ms == LV_NO_TIMER_READY ?
+                              K_FOREVER : K_MSEC(sm_data.lvgl_next_ms);
+
         sm_data.events = k_event_wait(&sm_data.smf_event,
-                                    EVENT_KEY_0 | EVENT_KEY_1 | EVENT_KEY_2 | 
-                                    EVENT_KEY_3 | EVENT_BOOT_DONE,
-                                    true, K_MSEC(100));
-        
+                                    EVENT_KEYS | EVENT_KEY_UP | EVENT_BOOT_DONE |
+                                    EVENT_IMAGE_READY | EVENT_DOWNLINK,
+                                    false, timeout);
+        // Clearing on entry to the wait would lose what was posted while the
+        // state ran, with no poll to pick it up later
+        k_event_clear(&sm_data.smf_event, sm_data.events);
+        count_wakeup(&sm_data);
+
         if (sm_data.events != 0) {
             LOG_INF("Got events: 0x%x", sm_data.events);
         }
-        
+
+        sm_data.lvgl_next_ms = LV_NO_TIMER_READY;
         if (smf_run_state(SMF_CTX(&sm_data.ctx))) {
             LOG_ERR("State machine run failed");
         }
@@ -0,0 +1,133 @@
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(sync_store, LOG_LEVEL_INF);
+
+#include "sync_store.h"
+
+#define SYNC_STORE_KEY "esl/sync"
+
+static struct k_spinlock lock;
+/* Last record handed in and what is still to be written */
+static struct sync_store pending;
+static bool pending_dirty;
+static bool pending_clear;
+/* What is in flash, to skip writes that change nothing */
+static struct sync_store saved;
+static bool saved_valid;
+
+static void save_handler(struct k_work *work);
+
+static K_WORK_DEFINE(save_work, save_handler);
+
+static int sync_store_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	ssize_t read;
+
+	if (!settings_name_steq(name, "sync", NULL)) {
+		return -ENOENT;
+	}
+
+	/* Left over from firmware with another layout, onboarding replaces it */
+	if (len != sizeof(saved)) {
+		LOG_WRN("Ignoring saved sync of %zu bytes", len);
+		return 0;
+	}
+
+	read = read_cb(cb_arg, &saved, sizeof(saved));
+	if (read != sizeof(saved)) {
+		return read < 0 ? read : -EIO;
+	}
+
+	saved_valid = true;
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(esl, "esl", NULL, sync_store_set, NULL, NULL);
+
+static void save_handler(struct k_work *work)
+{
+	struct sync_store store;
+	k_spinlock_key_t key = k_spin_lock(&lock);
+	bool clear = pending_clear;
+	bool dirty = pending_dirty;
+	int err;
+
+	store = pending;
+	pending_clear = false;
+	pending_dirty = false;
+	k_spin_unlock(&lock, key);
+
+	if (clear) {
+		err = settings_delete(SYNC_STORE_KEY);
+		if (err) {
+			LOG_ERR("Failed to delete saved sync (err %d)", err);
+		} else {
+			saved_valid = false;
+		}
+	}
+
+	if (!dirty || (saved_valid && !memcmp(&saved, &store, sizeof(store)))) {
+		return;
+	}
+
+	err = settings_save_one(SYNC_STORE_KEY, &store, sizeof(store));
+	if (err) {
+		LOG_ERR("Failed to save sync (err %d)", err);
+		return;
+	}
+
+	saved = store;
+	saved_valid = true;
+	LOG_INF("Saved sync: sid %d, interval %u, subevent %d, response slot %d, group %d",
+		store.sid, store.interval, store.subevent, store.response_slot, store.group);
+}
+
+int sync_store_load(struct sync_store *store)
+{
+	int err;
+
+	err = settings_subsys_init();
+	if (err) {
+		LOG_ERR("Settings init failed (err %d)", err);
+		return err;
+	}
+
+	err = settings_load_subtree("esl");
+	if (err) {
+		LOG_ERR("Failed to load settings (err %d)", err);
+		return err;
+	}
+
+	if (!saved_valid) {
+		return -ENOENT;
+	}
+
+	*store = saved;
+
+	return 0;
+}
+
+void sync_store_save(const struct sync_store *store)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	pending = *store;
+	pending_dirty = true;
+	k_spin_unlock(&lock, key);
+
+	k_work_submit(&save_work);
+}
+
+void sync_store_clear(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&lock);
+
+	pending_dirty = false;
+	pending_clear = true;
+	k_spin_unlock(&lock, key);
+
+	k_work_submit(&save_work);
+}
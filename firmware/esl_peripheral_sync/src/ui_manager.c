@@ -18,7 +18,6 @@ LOG_MODULE_REGISTER(ui_manager);
 #define CONTENT_HEIGHT (Y_RESOLUTION - STATUS_HEIGHT)
 
 static ui_components_t ui_components;
-static bool display_active = true;
 
 static void create_base_layout(void) {
     lv_obj_t *scr = lv_scr_act();
@@ -71,9 +70,6 @@ int ui_manager_init() {
 
 void ui_manager_clear_main(void) {
 	LOG_INF("Clearing main content");
-    if (!display_active) {
-        return;
-    }
     lv_obj_clean(ui_components.main_content);
 }
 
@@ -82,21 +78,15 @@ lv_obj_t *ui_manager_get_main(void) {
 }
 
 void ui_manager_update_battery(const char *battery_symbol) {
-    if (!display_active) {
-        return;
-    }
     lv_label_set_text(ui_components.battery_label, battery_symbol);
 }
 
 void ui_manager_update_company(const char *name) {
-    if (!display_active) {
-        return;
-    }
     lv_label_set_text(ui_components.company_label, name);
 }
 
 void ui_manager_set_buttons(button_config_t *buttons, uint8_t button_count) {
-    if (!display_active || !buttons) {
+    if (!buttons) {
         return;
     }
 
@@ -0,0 +1,70 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "ui_queue.h"
+
+BUILD_ASSERT(IS_POWER_OF_TWO(UI_QUEUE_LEN), "Ring indices wrap with a mask");
+
+static struct ui_cmd ring[UI_QUEUE_LEN];
+/* Free running, head only moved by the producer and tail by the consumer */
+static atomic_t head;
+static atomic_t tail;
+static atomic_t dropped;
+
+static atomic_ptr_t consumer;
+static uint32_t consumer_event;
+
+void ui_queue_attach(struct k_event *events, uint32_t event)
+{
+	consumer_event = event;
+	/* The atomic store orders it after the event bit */
+	atomic_ptr_set(&consumer, events);
+}
+
+struct ui_cmd *ui_queue_acquire(void)
+{
+	atomic_val_t in = atomic_get(&head);
+
+	if (!atomic_ptr_get(&consumer) ||
+	    (atomic_val_t)(in - atomic_get(&tail)) >= UI_QUEUE_LEN) {
+		atomic_inc(&dropped);
+		return NULL;
+	}
+
+	return &ring[in & (UI_QUEUE_LEN - 1)];
+}
+
+void ui_queue_produce(void)
+{
+	/* Atomic operations are full barriers, the slot is written before the
+	 * consumer sees the new head.
+	 */
+	atomic_inc(&head);
+	k_event_post(atomic_ptr_get(&consumer), consumer_event);
+}
+
+struct ui_cmd *ui_queue_consume(void)
+{
+	atomic_val_t out = atomic_get(&tail);
+
+	if (out == atomic_get(&head)) {
+		return NULL;
+	}
+
+	return &ring[out & (UI_QUEUE_LEN - 1)];
+}
+
+void ui_queue_release(void)
+{
+	atomic_inc(&tail);
+}
+
+void ui_queue_purge(void)
+{
+	atomic_set(&tail, atomic_get(&head));
+}
+
+uint32_t ui_queue_dropped(void)
+{
+	return atomic_get(&dropped);
+}
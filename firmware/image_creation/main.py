@@ -77,6 +77,63 @@ def atkinson_dither(img_array):
                 
     return (output > 0.5).astype(np.uint8) * 255
 
+# Run-length coding used for image transfers to tags, see common/include/esl_image.h.
+# Control byte 0x00-0x7F: the next ctrl + 1 bytes are literal.
+# Control byte 0x80-0xFF: the next byte is repeated (ctrl & 0x7F) + 3 times.
+RLE_LITERAL_MAX = 128
+RLE_RUN_MIN = 3
+RLE_RUN_MAX = 0x7F + RLE_RUN_MIN
+
+def rle_encode(data, base=None):
+    # Code the XOR against base when given, which leaves only what changed
+    if base is not None:
+        data = [a ^ b for a, b in zip(data, base)]
+
+    def run_len(i):
+        n = 1
+        while i + n < len(data) and n < RLE_RUN_MAX and data[i + n] == data[i]:
+            n += 1
+        return n
+
+    out = []
+    i = 0
+    while i < len(data):
+        run = run_len(i)
+        if run >= RLE_RUN_MIN:
+            out += [0x80 | (run - RLE_RUN_MIN), data[i]]
+            i += run
+            continue
+
+        # Literal up to the next run worth coding
+        n = 0
+        while n < RLE_LITERAL_MAX and i + n < len(data):
+            run = run_len(i + n)
+            if run >= RLE_RUN_MIN:
+                break
+            n += min(run, RLE_LITERAL_MAX - n)
+
+        out += [n - 1] + list(data[i:i + n])
+        i += n
+
+    return bytes(out)
+
+def rle_decode(coded, base=None):
+    out = []
+    i = 0
+    while i < len(coded):
+        ctrl = coded[i]
+        if ctrl & 0x80:
+            out += [coded[i + 1]] * ((ctrl & 0x7F) + RLE_RUN_MIN)
+            i += 2
+        else:
+            out += list(coded[i + 1:i + 2 + ctrl])
+            i += ctrl + 2
+
+    if base is not None:
+        out = [a ^ b for a, b in zip(out, base)]
+
+    return bytes(out)
+
 def process_image(input_path, output_path, target_size=(250, 102), dither_method='floyd', brightness=0, contrast=0):
     # Open and convert image to RGB
     img = Image.open(input_path).convert('RGB')
@@ -157,6 +214,10 @@ def process_image(input_path, output_path, target_size=(250, 102), dither_method
     with open(output_path, 'w') as f:
         f.write(output)
 
+    coded = rle_encode(byte_array)
+    assert rle_decode(coded) == bytes(byte_array)
+    print(f'{total_bytes} bytes, {len(coded)} run-length coded')
+
 if __name__ == "__main__":
     import argparse
     parser = argparse.ArgumentParser(description='Convert image to LVGL format')